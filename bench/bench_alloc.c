@@ -0,0 +1,345 @@
+#include <stdio.h>
+#include <execinfo.h>
+#include "../include/logger.h"
+
+/*
+ * Checks that log_message() never allocates once the logger is set up.
+ *
+ * Usage: bench_alloc [messages] [threads]
+ *
+ * malloc, calloc, realloc, free and the aligned allocators are replaced by
+ * wrappers that count calls made while a producer thread is inside
+ * log_message(). Every configuration (console, plain, buffered and throttled
+ * files, compressed and checksummed frames, binary records, metrics export,
+ * rate counters, sequence numbers) is set up, then stressed from several threads at once with
+ * nothing logged beforehand, so first-use allocations count too. Calls on other
+ * threads, such as the frame writers, are reported separately. The stack of the
+ * first allocation caught in log_message() is printed, and the exit status is 1
+ * if there was one. The rate counter configuration also checks that
+ * log_rate_count() and log_rate() give back exactly the messages logged, and
+ * the sequence configuration that each thread's numbers in the log file run
+ * 1, 2, 3, ... with no gap and never go backwards.
+ */
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void __libc_free(void *ptr);
+
+static __thread int in_log;            // Inside log_message() on a producer thread
+static __thread int in_hook;           // Inside a wrapper: the backtrace below must not count itself
+static int watching;                   // Counting calls on every thread (while a configuration runs)
+static unsigned long long hot_calls;   // Calls from inside log_message()
+static unsigned long long other_calls; // Calls on other threads while watching
+static void *first_stack[32];          // Where the first hot call came from
+static int first_depth;
+
+static void note_call(void) {
+    if (in_hook)
+        return;
+    if (in_log) {
+        if (__atomic_fetch_add(&hot_calls, 1, __ATOMIC_RELAXED) == 0) {
+            in_hook = 1;
+            first_depth = backtrace(first_stack, 32);
+            in_hook = 0;
+        }
+    } else if (__atomic_load_n(&watching, __ATOMIC_RELAXED)) {
+        __atomic_fetch_add(&other_calls, 1, __ATOMIC_RELAXED);
+    }
+}
+
+void *malloc(size_t size) {
+    note_call();
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+    note_call();
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    note_call();
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) {
+    if (ptr)
+        note_call();
+    __libc_free(ptr);
+}
+
+int posix_memalign(void **out, size_t alignment, size_t size) {
+    note_call();
+    void *p = __libc_memalign(alignment, size);
+    if (!p)
+        return ENOMEM;
+    *out = p;
+    return 0;
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    note_call();
+    return __libc_memalign(alignment, size);
+}
+
+void *memalign(size_t alignment, size_t size) {
+    note_call();
+    return __libc_memalign(alignment, size);
+}
+
+#define BENCH_FILE "bench_alloc.tmp"
+
+enum Setup {
+    SETUP_CONSOLE,
+    SETUP_FILE,
+    SETUP_BUFFERED,
+    SETUP_THROTTLED,
+    SETUP_COMPRESSED,
+    SETUP_CHECKSUM,
+    SETUP_BINARY,
+    SETUP_BINARY_COMPRESSED,
+    SETUP_METRICS,
+    SETUP_RATES,
+    SETUP_SEQUENCE,
+    NUM_SETUPS
+};
+
+static const char *setup_names[] = {"console",    "file",   "buffered",          "throttled", "compressed",
+                                    "checksum",   "binary", "binary+compressed", "metrics",   "rates",
+                                    "sequence"};
+
+struct Run {
+    struct Logger *logger;
+    pthread_barrier_t *start;
+    long messages;
+    int id;
+};
+
+static void *producer(void *arg) {
+    struct Run *run = (struct Run *)arg;
+    static const char *words[] = {"alpha", "beta", "gamma", "a considerably longer string argument", ""};
+    pthread_barrier_wait(run->start);
+    for (long i = 0; i < run->messages; i++) {
+        in_log = 1;
+        log_message(run->logger, (enum LogLevel)(i % 5), "worker %d msg %ld %s %5.2f %#x %c %-8s|%llu", run->id, i,
+                    words[i % 5], (double)i / 7.0, (unsigned)i, 'a' + (int)(i % 26), words[(i + 1) % 5],
+                    (unsigned long long)i * 1000003ULL);
+        if (i % 100 == 0)
+            LOG_MESSAGE(run->logger, WARNING, "checkpoint %ld of %ld", i, run->messages);
+        in_log = 0;
+    }
+    return NULL;
+}
+
+static void setup(struct Logger *logger, enum Setup which) {
+    int console = which == SETUP_CONSOLE;
+    init_logger(logger, console ? DEBUG : ERROR, DEBUG, BENCH_FILE, NULL, !console, 1, 1);
+    if (console)
+        logger->console_level = DEBUG;
+    else
+        set_log_levels(logger, (enum LogLevel)(ERROR + 1), DEBUG); // Console off
+    set_log_prefix(logger, "[bench]");
+    add_tag(logger, "bench");
+    switch (which) {
+    case SETUP_BUFFERED:
+        set_file_flush(logger, 0);
+        break;
+    case SETUP_THROTTLED:
+        set_file_throttle(logger, 256 * 1024, 64 * 1024, 256 * 1024, WARNING);
+        break;
+    case SETUP_COMPRESSED:
+        set_file_compression(logger, 1, 0, 2);
+        break;
+    case SETUP_CHECKSUM:
+        set_file_checksum(logger, 1);
+        break;
+    case SETUP_BINARY:
+        set_file_format(logger, LOG_FORMAT_BINARY);
+        break;
+    case SETUP_BINARY_COMPRESSED:
+        set_file_format(logger, LOG_FORMAT_BINARY);
+        set_file_compression(logger, 1, 0, 2);
+        break;
+    case SETUP_METRICS:
+        set_metrics_export(logger, BENCH_FILE ".prom", 1);
+        break;
+    case SETUP_RATES:
+        set_rate_counters(logger, 1000, 64);
+        break;
+    case SETUP_SEQUENCE:
+        set_include_sequence(logger, 1);
+        break;
+    default:
+        break;
+    }
+}
+
+/**
+ * Compares the rate counters with what the producers logged, per level and for
+ * the "bench" tag. Waits for the bucket in progress to end first, so log_rate(),
+ * which leaves that bucket out, sees every message too.
+ */
+static int check_rates(struct Logger *logger, long messages, int threads, FILE *report) {
+    unsigned long long expected[LOG_NUM_LEVELS] = {0}, total = 0, counted = 0;
+    for (long i = 0; i < messages; i++) {
+        expected[i % 5] += (unsigned long long)threads;
+        if (i % 100 == 0)
+            expected[WARNING] += (unsigned long long)threads;
+    }
+    usleep(1010000); // One 1000 ms bucket: buckets start at set_rate_counters(), not on the second
+    int failed = 0;
+    for (int level = 0; level < LOG_NUM_LEVELS; level++) {
+        unsigned long long count = log_rate_count(logger, (enum LogLevel)level, NULL, 60000);
+        unsigned long long rated = (unsigned long long)(log_rate(logger, (enum LogLevel)level, NULL, 60000) * 60.0 + 0.5);
+        if (count != expected[level] || rated != expected[level]) {
+            fprintf(report, "rates: level %d counted %llu, rate %llu, logged %llu\n", level, count, rated,
+                    expected[level]);
+            failed = 1;
+        }
+        total += expected[level];
+        counted += log_rate_count(logger, (enum LogLevel)level, "bench", 60000);
+    }
+    if (counted != total) {
+        fprintf(report, "rates: tag \"bench\" counted %llu, logged %llu\n", counted, total);
+        failed = 1;
+    }
+    return failed;
+}
+
+/**
+ * Reads the sequence numbers back from the log file and checks that every
+ * thread's run 1, 2, 3, ... up to the number of messages it logged.
+ */
+static int check_sequence(long messages, int threads, FILE *report) {
+    FILE *in = fopen(BENCH_FILE, "r");
+    if (!in) {
+        fprintf(report, "sequence: cannot read %s\n", BENCH_FILE);
+        return 1;
+    }
+    unsigned long ids[threads];
+    unsigned long long last[threads];
+    int seen = 0, failed = 0;
+    char line[LOG_MAX_LINE_LENGTH];
+    while (fgets(line, sizeof(line), in)) {
+        const char *id_text = strstr(line, "Thread ID: ");
+        const char *seq_text = strstr(line, "Seq: ");
+        if (!id_text || !seq_text) {
+            fprintf(report, "sequence: line without thread id or number: %s", line);
+            failed = 1;
+            break;
+        }
+        unsigned long id = strtoul(id_text + 11, NULL, 10);
+        unsigned long long seq = strtoull(seq_text + 5, NULL, 10);
+        int t = 0;
+        while (t < seen && ids[t] != id)
+            t++;
+        if (t == seen) {
+            if (seen == threads) {
+                fprintf(report, "sequence: more than %d threads in the log\n", threads);
+                failed = 1;
+                break;
+            }
+            ids[seen] = id;
+            last[seen++] = 0;
+        }
+        if (seq != last[t] + 1) {
+            fprintf(report, "sequence: thread %lu went from %llu to %llu\n", id, last[t], seq);
+            failed = 1;
+            break;
+        }
+        last[t] = seq;
+    }
+    fclose(in);
+    unsigned long long expected = (unsigned long long)messages + (unsigned long long)(messages + 99) / 100;
+    for (int t = 0; t < seen && !failed; t++) {
+        if (last[t] != expected) {
+            fprintf(report, "sequence: thread %lu ended at %llu of %llu\n", ids[t], last[t], expected);
+            failed = 1;
+        }
+    }
+    if (!failed && seen != threads) {
+        fprintf(report, "sequence: %d of %d threads in the log\n", seen, threads);
+        failed = 1;
+    }
+    return failed;
+}
+
+static void remove_files(void) {
+    remove(BENCH_FILE);
+    remove(BENCH_FILE ".idx");
+    remove(BENCH_FILE ".prom");
+}
+
+int main(int argc, char **argv) {
+    long messages = argc > 1 ? atol(argv[1]) : 20000;
+    int threads = argc > 2 ? atoi(argv[2]) : 4;
+    if (messages < 1)
+        messages = 1;
+    if (threads < 1)
+        threads = 1;
+
+    // Console output goes to /dev/null; the report to the real stdout
+    FILE *report = fdopen(dup(STDOUT_FILENO), "w");
+    if (!report || !freopen("/dev/null", "w", stdout)) {
+        fprintf(stderr, "bench_alloc: cannot redirect stdout\n");
+        return 1;
+    }
+    first_depth = backtrace(first_stack, 32); // Loads the unwinder now, so it never allocates while counting
+
+    int status = 0, miscounted = 0;
+    fprintf(report, "%ld messages on each of %d threads\n\n", messages, threads);
+    fprintf(report, "%-18s %14s %14s\n", "configuration", "in log_message", "other threads");
+    for (int which = 0; which < NUM_SETUPS; which++) {
+        remove_files();
+        struct Logger logger;
+        setup(&logger, (enum Setup)which);
+
+        pthread_barrier_t start;
+        pthread_barrier_init(&start, NULL, (unsigned)threads + 1);
+        struct Run runs[threads];
+        pthread_t tids[threads];
+        for (int i = 0; i < threads; i++) {
+            runs[i].logger = &logger;
+            runs[i].start = &start;
+            runs[i].messages = messages;
+            runs[i].id = i;
+            if (pthread_create(&tids[i], NULL, producer, &runs[i]) != 0) {
+                fprintf(stderr, "bench_alloc: cannot start thread\n");
+                return 1;
+            }
+        }
+        hot_calls = 0;
+        other_calls = 0;
+        first_depth = 0;
+        __atomic_store_n(&watching, 1, __ATOMIC_RELAXED);
+        pthread_barrier_wait(&start);
+        for (int i = 0; i < threads; i++)
+            pthread_join(tids[i], NULL); // Thread exit frees TLS; joins are counted as other threads
+        __atomic_store_n(&watching, 0, __ATOMIC_RELAXED);
+        flush_logger(&logger);
+        fflush(stdout);
+
+        fprintf(report, "%-18s %14llu %14llu\n", setup_names[which], hot_calls, other_calls);
+        if (hot_calls) {
+            fprintf(report, "first allocation in log_message():\n");
+            fflush(report);
+            backtrace_symbols_fd(first_stack, first_depth, fileno(report));
+            status = 1;
+        }
+        if (which == SETUP_RATES && check_rates(&logger, messages, threads, report))
+            miscounted = 1;
+        fflush(report);
+        pthread_barrier_destroy(&start);
+        close_logger(&logger);
+        if (which == SETUP_SEQUENCE && check_sequence(messages, threads, report))
+            miscounted = 1;
+    }
+    remove_files();
+    fprintf(report, "\n%s\n", status ? "FAIL: log_message() allocated" : "OK: log_message() never allocated");
+    if (miscounted)
+        fprintf(report, "FAIL: rate counters or sequence numbers miscounted\n");
+    fclose(report);
+    return status || miscounted;
+}
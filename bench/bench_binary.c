@@ -0,0 +1,152 @@
+#include <stdio.h>
+#include "../include/logger.h"
+
+/*
+ * Compares the text and binary file formats: bytes written and time spent per message.
+ *
+ * Usage: bench_binary [messages]
+ *
+ * Text is the line log_message() renders; binary is the capture taken on the
+ * logging thread plus the record encoded from it. Neither touches a file, so
+ * the numbers are the formatting cost alone.
+ *
+ * It then checks that a string with a precision ("%.*s", "%.2s") is captured
+ * without reading past the precision: the string ends right before a page that
+ * cannot be read, so reading one byte too far crashes.
+ */
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+enum Shape { SHAPE_CONSTANT, SHAPE_REQUEST, SHAPE_NUMERIC, SHAPE_STRINGS, NUM_SHAPES };
+
+static const char *shape_names[] = {"constant", "request", "numeric", "strings"};
+static const char *endpoints[] = {"/api/v1/items", "/api/v1/users", "/health", "/api/v2/orders", "/metrics"};
+
+static int render_text(struct Logger *logger, time_t seconds, char *line, size_t size, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    size_t message_offset;
+    int len = logger_format_line(logger, INFO, seconds, (unsigned long)pthread_self(), 0, 0, line, size, &message_offset, format, args);
+    va_end(args);
+    return len;
+}
+
+static int encode_binary(struct Logger *logger, long long us, unsigned char *out, size_t cap, const char *format, ...) {
+    unsigned char capture[LOG_MAX_LINE_LENGTH];
+    va_list args;
+    va_start(args, format);
+    int len = log_capture(capture, sizeof(capture), INFO, us, (unsigned long)pthread_self(), 0, __FILE__, __LINE__, format, args);
+    va_end(args);
+    return len < 0 ? -1 : logger_binary_encode(logger, capture, out, cap);
+}
+
+/* One message of the given shape, either rendered as text or encoded as a record. */
+#define BENCH_MESSAGE(CALL, i, seed)                                                                          \
+    switch (shape) {                                                                                          \
+        case SHAPE_CONSTANT:                                                                                  \
+            len = CALL("cache warmed up, serving requests");                                                  \
+            break;                                                                                            \
+        case SHAPE_REQUEST:                                                                                   \
+            len = CALL("request %ld %s took %u us status=%d", i, endpoints[(seed >> 8) % 5], (seed >> 12) % 100000, \
+                       seed % 7 ? 200 : 500);                                                                 \
+            break;                                                                                            \
+        case SHAPE_NUMERIC:                                                                                   \
+            len = CALL("tick %ld: queue=%u load=%.2f p99=%.3f ms drops=%d", i, seed % 1000, (seed % 10000) / 100.0, \
+                       (seed % 100000) / 1000.0, (int)(seed % 3));                                            \
+            break;                                                                                            \
+        default:                                                                                              \
+            len = CALL("user %s opened %s from %s", (seed % 2) ? "alice@example.com" : "bob@example.com",    \
+                       endpoints[seed % 5], (seed % 3) ? "10.0.0.17" : "192.168.1.20");                       \
+            break;                                                                                            \
+    }
+
+static int check_precision(struct Logger *logger) {
+    long page = sysconf(_SC_PAGESIZE);
+    char *pages = (char *)mmap(NULL, (size_t)page * 2, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (pages == MAP_FAILED || mprotect(pages + page, (size_t)page, PROT_NONE) != 0) {
+        fprintf(stderr, "bench_binary: cannot map a guard page\n");
+        return 1;
+    }
+    char *unterminated = pages + page - 4;
+    memcpy(unterminated, "abcd", 4);
+
+    unsigned char record[LOG_BIN_MAX_RECORD];
+    logger->bin.need_segment = 1;
+    int len = encode_binary(logger, 0, record, sizeof(record), "[%.*s|%.2s]", 4, unterminated, unterminated);
+    struct LogBinaryDecoder *d = (struct LogBinaryDecoder *)malloc(sizeof(*d));
+    log_binary_decoder_init(d);
+    char line[LOG_MAX_LINE_LENGTH] = "";
+    size_t pos = 0, used;
+    long n = 0;
+    while (len > 0 && pos < (size_t)len && (n = log_binary_decode(d, record + pos, (size_t)len - pos, line, sizeof(line), &used)) >= 0) {
+        pos += used;
+        if (n > 0)
+            break;
+    }
+    free(d);
+    munmap(pages, (size_t)page * 2);
+
+    const char *expected = " | [abcd|ab]\n";
+    size_t line_len = strlen(line);
+    int ok = n > 0 && line_len >= strlen(expected) && strcmp(line + line_len - strlen(expected), expected) == 0;
+    printf("\nprecision-limited strings: %s\n", ok ? "OK" : "FAIL");
+    return !ok;
+}
+
+int main(int argc, char **argv) {
+    long messages = argc > 1 ? atol(argv[1]) : 1000000;
+    if (messages < 1)
+        messages = 1;
+
+    struct Logger logger;
+    init_logger(&logger, ERROR, DEBUG, "/dev/null", NULL, 0, 1, 0);
+    set_log_prefix(&logger, "[bench]");
+    set_file_format(&logger, LOG_FORMAT_BINARY);
+    char line[LOG_MAX_LINE_LENGTH];
+    unsigned char record[LOG_BIN_MAX_RECORD];
+
+    printf("%-10s %12s %12s %12s %12s %8s\n", "message", "text B/msg", "text ns/msg", "bin B/msg", "bin ns/msg", "ratio");
+    for (int shape = 0; shape < NUM_SHAPES; shape++) {
+        size_t text_bytes = 0;
+        size_t binary_bytes = 0;
+        unsigned int seed = 12345;
+        time_t seconds = time(NULL);
+        double start = now_sec();
+        for (long i = 0; i < messages; i++) {
+            int len;
+            seed = seed * 1103515245U + 12345U;
+#define CALL(...) render_text(&logger, seconds + i / 100000, line, sizeof(line), __VA_ARGS__)
+            BENCH_MESSAGE(CALL, i, seed)
+#undef CALL
+            text_bytes += (size_t)len;
+        }
+        double text_time = now_sec() - start;
+
+        seed = 12345;
+        long long us = (long long)seconds * 1000000;
+        logger.bin.need_segment = 1;
+        start = now_sec();
+        for (long i = 0; i < messages; i++) {
+            int len;
+            seed = seed * 1103515245U + 12345U;
+            us += 10 + seed % 50;
+#define CALL(...) encode_binary(&logger, us, record, sizeof(record), __VA_ARGS__)
+            BENCH_MESSAGE(CALL, i, seed)
+#undef CALL
+            binary_bytes += (size_t)len;
+        }
+        double binary_time = now_sec() - start;
+
+        printf("%-10s %12.1f %12.1f %12.1f %12.1f %7.2fx\n", shape_names[shape], (double)text_bytes / (double)messages,
+               text_time * 1e9 / (double)messages, (double)binary_bytes / (double)messages,
+               binary_time * 1e9 / (double)messages, (double)text_bytes / (double)binary_bytes);
+    }
+
+    int status = check_precision(&logger);
+    close_logger(&logger);
+    return status;
+}
@@ -0,0 +1,86 @@
+#include <stdio.h>
+#include "../include/logger.h"
+
+/*
+ * Measures throughput of the compressed frame pipeline for 1..N workers.
+ *
+ * Usage: bench_compress [megabytes] [max_workers] [level]
+ *
+ * Pre-rendered log text is pushed straight into the pipeline so that the
+ * numbers reflect compression and ordered output rather than formatting.
+ */
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static size_t make_text(char *buf, size_t size) {
+    static const char *endpoints[] = {"/api/v1/items", "/api/v1/users", "/health", "/api/v2/orders", "/metrics"};
+    static const char *levels[] = {"DEBUG", "INFO", "SUCCESS", "WARNING", "ERROR"};
+    size_t len = 0;
+    unsigned int seed = 12345;
+    for (long i = 0; len + 256 < size; i++) {
+        seed = seed * 1103515245U + 12345U;
+        len += (size_t)snprintf(buf + len, size - len,
+                                "2024-05-01 12:%02ld:%02ld | %s [bench]  | Thread ID: %u | request %ld %s took %u us status=%d\n",
+                                (i / 60000) % 60, (i / 1000) % 60, levels[seed % 5], 140000000U + seed % 8,
+                                i, endpoints[(seed >> 8) % 5], (seed >> 12) % 100000, seed % 7 ? 200 : 500);
+    }
+    return len;
+}
+
+int main(int argc, char **argv) {
+    size_t megabytes = argc > 1 ? (size_t)atol(argv[1]) : 256;
+    int max_workers = argc > 2 ? atoi(argv[2]) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int level = argc > 3 ? atoi(argv[3]) : 1;
+    if (max_workers < 1)
+        max_workers = 1;
+
+    size_t size = megabytes << 20;
+    char *text = (char *)malloc(size);
+    if (!text) {
+        fprintf(stderr, "bench_compress: out of memory\n");
+        return 1;
+    }
+    size_t len = make_text(text, size);
+
+    printf("%-8s %12s %10s %8s\n", "workers", "MB/s (raw)", "ratio", "speedup");
+    double base = 0;
+    for (int workers = 1; workers <= max_workers; workers *= 2) {
+        struct Logger logger;
+        init_logger(&logger, ERROR, DEBUG, "/dev/null", NULL, 1, 0, 0);
+        set_file_compression(&logger, level, 0, workers);
+        struct LogLzState *lz = (struct LogLzState *)calloc(1, sizeof(*lz));
+        unsigned char *frame = (unsigned char *)malloc(LOG_FRAME_OVERHEAD + LOG_FRAME_BLOCK_SIZE);
+
+        double start = now_sec();
+        for (size_t pos = 0; pos < len;) {
+            size_t n = len - pos < 4096 ? len - pos : 4096;
+            while (pos + n < len && text[pos + n - 1] != '\n')
+                n--;
+            logger_framer_append(logger.framer, text + pos, n, 0, 0);
+            pos += n;
+        }
+        flush_logger(&logger);
+        double elapsed = now_sec() - start;
+
+        // Compression ratio of the same text, measured outside the timed region
+        size_t compressed = 0;
+        for (size_t pos = 0; pos < len; pos += LOG_FRAME_BLOCK_SIZE) {
+            size_t n = len - pos < LOG_FRAME_BLOCK_SIZE ? len - pos : LOG_FRAME_BLOCK_SIZE;
+            compressed += log_frame_encode(lz, level, text + pos, n, 0, 0, 0, frame);
+        }
+
+        double rate = (double)len / elapsed / 1e6;
+        if (workers == 1)
+            base = rate;
+        printf("%-8d %12.1f %9.2fx %7.2fx\n", workers, rate, (double)len / (double)compressed, rate / base);
+        close_logger(&logger);
+        free(lz);
+        free(frame);
+    }
+    free(text);
+    return 0;
+}
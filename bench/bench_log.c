@@ -0,0 +1,263 @@
+#include <stdio.h>
+#include "../include/logger.h"
+
+/*
+ * Measures what log_message() costs its caller across thread counts and configurations.
+ *
+ * Usage: bench_log [messages] [max_threads] [json_file]
+ *
+ * Every scenario runs 1, 2, 4, ... max_threads threads that each log `messages`
+ * lines, with the console off or on (stdout goes to /dev/null), the file off,
+ * flushed per line, buffered by stdio, or handed to the background frame writer
+ * (async), for a few message sizes. It reports messages per second, counted until
+ * flush_logger() has returned, and the latency of each log_message() call at
+ * p50/p99/p99.9/max from HDR-style histograms. The lines are the same on every
+ * run, so results can be compared between versions; with json_file they are also
+ * written there as JSON.
+ */
+
+/* Histogram with 2^HIST_SUB_BITS linear sub-buckets per power of two (under 1% error). */
+#define HIST_SUB_BITS 7
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_HALF (HIST_SUB_COUNT / 2)
+#define HIST_BUCKETS (HIST_SUB_COUNT + (64 - HIST_SUB_BITS) * HIST_HALF)
+
+struct Histogram {
+    unsigned long long counts[HIST_BUCKETS];
+    unsigned long long total;
+    unsigned long long max;
+};
+
+static int hist_index(unsigned long long v) {
+    if (v < HIST_SUB_COUNT)
+        return (int)v;
+    int shift = 63 - __builtin_clzll(v) - (HIST_SUB_BITS - 1);
+    return HIST_SUB_COUNT + (shift - 1) * HIST_HALF + (int)((v >> shift) - HIST_HALF);
+}
+
+/* Highest value that falls into bucket i. */
+static unsigned long long hist_value(int i) {
+    if (i < HIST_SUB_COUNT)
+        return (unsigned long long)i;
+    int shift = (i - HIST_SUB_COUNT) / HIST_HALF + 1;
+    unsigned long long top = (unsigned long long)((i - HIST_SUB_COUNT) % HIST_HALF + HIST_HALF);
+    return ((top + 1) << shift) - 1;
+}
+
+static void hist_record(struct Histogram *h, unsigned long long v) {
+    h->counts[hist_index(v)]++;
+    h->total++;
+    if (v > h->max)
+        h->max = v;
+}
+
+static void hist_merge(struct Histogram *into, const struct Histogram *h) {
+    for (int i = 0; i < HIST_BUCKETS; i++)
+        into->counts[i] += h->counts[i];
+    into->total += h->total;
+    if (h->max > into->max)
+        into->max = h->max;
+}
+
+static unsigned long long hist_percentile(const struct Histogram *h, double percentile) {
+    unsigned long long rank = (unsigned long long)(percentile / 100.0 * (double)h->total + 0.5);
+    if (rank < 1)
+        rank = 1;
+    unsigned long long seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= rank)
+            return hist_value(i) < h->max ? hist_value(i) : h->max;
+    }
+    return h->max;
+}
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static unsigned long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + (unsigned long long)ts.tv_nsec;
+}
+
+enum FileMode { FILE_NONE, FILE_FLUSH, FILE_BUFFERED, FILE_ASYNC, NUM_FILE_MODES };
+
+static const char *file_mode_names[] = {"none", "flush", "buffered", "async"};
+static const int message_sizes[] = {16, 128, 1024};
+
+#define BENCH_FILE "bench_log.tmp"
+
+struct Run {
+    struct Logger *logger;
+    pthread_barrier_t *start;
+    long messages;
+    int size;
+    int id;
+    struct Histogram *hist;
+    double started;          // When this thread began logging
+    double finished;         // When it logged its last line
+};
+
+static char payload[1024];
+
+static void *producer(void *arg) {
+    struct Run *run = (struct Run *)arg;
+    pthread_barrier_wait(run->start);
+    run->started = now_sec();
+    for (long i = 0; i < run->messages; i++) {
+        unsigned long long t0 = now_ns();
+        log_message(run->logger, INFO, "worker %d msg %ld %.*s", run->id, i, run->size, payload);
+        hist_record(run->hist, now_ns() - t0);
+    }
+    run->finished = now_sec();
+    return NULL;
+}
+
+struct Result {
+    int threads;
+    int console;
+    enum FileMode file;
+    int size;
+    double msgs_per_sec;
+    unsigned long long p50, p99, p999, max;
+};
+
+static void run_scenario(struct Result *res, long messages) {
+    struct Logger logger;
+    remove(BENCH_FILE);
+    remove(BENCH_FILE ".idx");
+    enum LogLevel console_level = res->console ? INFO : ERROR;
+    enum LogLevel file_level = res->file != FILE_NONE ? INFO : ERROR;
+    init_logger(&logger, console_level, file_level, BENCH_FILE, NULL, res->file != FILE_NONE, 1, 0);
+    if (res->file == FILE_BUFFERED)
+        set_file_flush(&logger, 0);
+    if (res->file == FILE_ASYNC)
+        set_file_checksum(&logger, 1); // Stored frames: producers fill blocks, the frame writer does the I/O
+
+    pthread_barrier_t start;
+    pthread_barrier_init(&start, NULL, (unsigned)res->threads + 1);
+    struct Run runs[res->threads];
+    pthread_t tids[res->threads];
+    for (int i = 0; i < res->threads; i++) {
+        runs[i].logger = &logger;
+        runs[i].start = &start;
+        runs[i].messages = messages;
+        runs[i].size = res->size;
+        runs[i].id = i;
+        runs[i].hist = (struct Histogram *)calloc(1, sizeof(struct Histogram));
+        if (!runs[i].hist || pthread_create(&tids[i], NULL, producer, &runs[i]) != 0) {
+            fprintf(stderr, "bench_log: cannot start thread\n");
+            exit(1);
+        }
+    }
+    pthread_barrier_wait(&start);
+    double first = 0, last = 0;
+    for (int i = 0; i < res->threads; i++) {
+        pthread_join(tids[i], NULL);
+        if (i == 0 || runs[i].started < first)
+            first = runs[i].started;
+        if (i == 0 || runs[i].finished > last)
+            last = runs[i].finished;
+    }
+    // Count the time to get everything out, but not the time the main thread took to notice
+    double t0 = now_sec();
+    fflush(stdout);
+    flush_logger(&logger);
+    double elapsed = last - first + (now_sec() - t0);
+
+    struct Histogram *all = (struct Histogram *)calloc(1, sizeof(struct Histogram));
+    for (int i = 0; i < res->threads; i++) {
+        hist_merge(all, runs[i].hist);
+        free(runs[i].hist);
+    }
+    res->msgs_per_sec = (double)all->total / elapsed;
+    res->p50 = hist_percentile(all, 50.0);
+    res->p99 = hist_percentile(all, 99.0);
+    res->p999 = hist_percentile(all, 99.9);
+    res->max = all->max;
+    free(all);
+
+    pthread_barrier_destroy(&start);
+    close_logger(&logger);
+    remove(BENCH_FILE);
+    remove(BENCH_FILE ".idx");
+}
+
+static void write_json(FILE *out, const struct Result *results, int count, long messages) {
+    fprintf(out, "{\n  \"benchmark\": \"bench_log\",\n  \"messages_per_thread\": %ld,\n  \"results\": [\n", messages);
+    for (int i = 0; i < count; i++) {
+        const struct Result *r = &results[i];
+        fprintf(out,
+                "    {\"threads\": %d, \"console\": %s, \"file\": \"%s\", \"message_size\": %d, "
+                "\"msgs_per_sec\": %.0f, \"latency_ns\": {\"p50\": %llu, \"p99\": %llu, \"p99.9\": %llu, \"max\": %llu}}%s\n",
+                r->threads, r->console ? "true" : "false", file_mode_names[r->file], r->size, r->msgs_per_sec,
+                r->p50, r->p99, r->p999, r->max, i + 1 < count ? "," : "");
+    }
+    fprintf(out, "  ]\n}\n");
+}
+
+int main(int argc, char **argv) {
+    long messages = argc > 1 ? atol(argv[1]) : 20000;
+    int max_threads = argc > 2 ? atoi(argv[2]) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    const char *json_path = argc > 3 ? argv[3] : NULL;
+    if (argc <= 2 && max_threads < 4)
+        max_threads = 4; // Contention shows even on small machines
+    if (max_threads < 1)
+        max_threads = 1;
+    if (messages < 1)
+        messages = 1;
+    memset(payload, 'x', sizeof(payload));
+
+    // Keep the real stdout for the report; console output of the runs goes to /dev/null
+    FILE *report = fdopen(dup(STDOUT_FILENO), "w");
+    if (!report || !freopen("/dev/null", "w", stdout)) {
+        fprintf(stderr, "bench_log: cannot redirect stdout\n");
+        return 1;
+    }
+
+    int num_threads = 0;
+    for (int t = 1; t <= max_threads; t *= 2)
+        num_threads++;
+    int capacity = num_threads * 2 * NUM_FILE_MODES * (int)(sizeof(message_sizes) / sizeof(message_sizes[0]));
+    struct Result *results = (struct Result *)calloc((size_t)capacity, sizeof(*results));
+    int count = 0;
+
+    fprintf(report, "%ld messages per thread\n\n", messages);
+    fprintf(report, "%7s %7s %8s %5s  %12s  %8s %8s %8s %10s\n", "threads", "console", "file", "size", "msgs/s",
+            "p50 ns", "p99 ns", "p99.9 ns", "max ns");
+    for (int t = 1; t <= max_threads; t *= 2) {
+        for (int console = 0; console <= 1; console++) {
+            for (int file = 0; file < NUM_FILE_MODES; file++) {
+                for (size_t s = 0; s < sizeof(message_sizes) / sizeof(message_sizes[0]); s++) {
+                    struct Result *r = &results[count++];
+                    r->threads = t;
+                    r->console = console;
+                    r->file = (enum FileMode)file;
+                    r->size = message_sizes[s];
+                    run_scenario(r, messages);
+                    fprintf(report, "%7d %7s %8s %5d  %12.0f  %8llu %8llu %8llu %10llu\n", t, console ? "on" : "off",
+                            file_mode_names[file], r->size, r->msgs_per_sec, r->p50, r->p99, r->p999, r->max);
+                    fflush(report);
+                }
+            }
+        }
+    }
+
+    if (json_path) {
+        FILE *json = fopen(json_path, "w");
+        if (!json) {
+            fprintf(stderr, "bench_log: cannot write %s\n", json_path);
+            return 1;
+        }
+        write_json(json, results, count, messages);
+        fclose(json);
+        fprintf(report, "\nresults written to %s\n", json_path);
+    }
+    free(results);
+    fclose(report);
+    return 0;
+}
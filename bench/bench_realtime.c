@@ -0,0 +1,210 @@
+#include <stdio.h>
+#include <signal.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <stddef.h>
+#include <sys/wait.h>
+#include <linux/audit.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+#include "../include/logger.h"
+
+/*
+ * Checks that real-time mode keeps system calls off the producer path, and
+ * measures what log_message() costs a real-time thread.
+ *
+ * Usage: bench_realtime [messages] [file] [per_cpu]
+ *
+ * A child process starts real-time mode, attaches a producer thread and gives
+ * that thread the syscall allowance of seccomp strict mode: any system call
+ * other than read, write and exit kills the process. (Strict mode itself also
+ * disables the TSC on x86, so the same rule is installed as a seccomp filter.)
+ * The thread then logs `messages` lines (text to the file, or binary if the
+ * file ends in ".bin") and leaves with a raw exit. The parent reports the kill
+ * (SIGSYS) as a failure; otherwise the child checks that every line reached the
+ * file and prints the per-call latency. A nonzero per_cpu runs the same test
+ * with per-CPU rings.
+ */
+
+#define LATENCY_BUCKETS 64 // Calls by cycles: bucket i holds calls under 2^i cycles
+
+struct Producer {
+    struct Logger *logger;
+    long messages;
+    unsigned long long latency[LATENCY_BUCKETS];
+    unsigned long long max_cycles;
+    int attached;
+    int done;
+};
+
+#ifndef SECCOMP_RET_KILL_PROCESS
+#define SECCOMP_RET_KILL_PROCESS 0x80000000U
+#endif
+
+#if defined(__x86_64__)
+#define BENCH_AUDIT_ARCH AUDIT_ARCH_X86_64
+#elif defined(__aarch64__)
+#define BENCH_AUDIT_ARCH AUDIT_ARCH_AARCH64
+#endif
+
+/**
+ * @brief Limits the calling thread to read, write and exit; anything else kills the process.
+ *
+ * @return 0 on success, -1 if the filter could not be installed.
+ */
+static int restrict_syscalls(void) {
+#ifdef BENCH_AUDIT_ARCH
+    struct sock_filter filter[] = {
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, arch)),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, BENCH_AUDIT_ARCH, 1, 0),
+        BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_KILL_PROCESS),
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, nr)),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, SYS_read, 3, 0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, SYS_write, 2, 0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, SYS_exit, 1, 0),
+        BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_KILL_PROCESS),
+        BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW),
+    };
+    struct sock_fprog prog = {(unsigned short)(sizeof(filter) / sizeof(filter[0])), filter};
+    if (prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) != 0)
+        return -1;
+    return prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &prog) == 0 ? 0 : -1;
+#else
+    return prctl(PR_SET_SECCOMP, SECCOMP_MODE_STRICT) == 0 ? 0 : -1;
+#endif
+}
+
+static void *producer(void *arg) {
+    struct Producer *p = (struct Producer *)arg;
+    p->attached = attach_realtime_thread(p->logger) == 0;
+    if (!p->attached || restrict_syscalls() != 0) {
+        __atomic_store_n(&p->done, -1, __ATOMIC_RELEASE);
+        return NULL;
+    }
+    // From here on any system call but read, write and exit is fatal
+    static const char *states[] = {"idle", "armed", "running", "a somewhat longer state description"};
+    for (long i = 0; i < p->messages; i++) {
+        uint64_t t0 = log_cycles();
+        LOG_MESSAGE(p->logger, (enum LogLevel)(i % 5), "block %ld state=%s gain=%.3f mask=%#x", i, states[i % 4],
+                    (double)i / 3.0, (unsigned)i);
+        uint64_t cycles = log_cycles() - t0;
+        p->latency[cycles ? 64 - __builtin_clzll(cycles) - 1 : 0]++;
+        if (cycles > p->max_cycles)
+            p->max_cycles = cycles;
+    }
+    __atomic_store_n(&p->done, 1, __ATOMIC_RELEASE);
+    syscall(SYS_exit, 0); // pthread_exit() would make calls the filter does not allow
+    return NULL;
+}
+
+static unsigned long long percentile(const struct Producer *p, double percent) {
+    unsigned long long total = 0, seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++)
+        total += p->latency[i];
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += p->latency[i];
+        if ((double)seen >= percent / 100.0 * (double)total)
+            return 2ULL << i; // Upper bound of the bucket
+    }
+    return p->max_cycles;
+}
+
+static int run_child(long messages, const char *path, int per_cpu) {
+    struct Logger logger;
+    remove(path);
+    init_logger(&logger, DEBUG, DEBUG, path, NULL, 1, 1, 0);
+    set_log_levels(&logger, (enum LogLevel)(ERROR + 1), DEBUG); // File only
+    size_t len = strlen(path);
+    if (len > 4 && strcmp(path + len - 4, ".bin") == 0)
+        set_file_format(&logger, LOG_FORMAT_BINARY);
+    set_realtime_per_cpu(&logger, per_cpu);
+    set_realtime_mode(&logger, (size_t)messages * 256, 500);
+
+    struct Producer *p = (struct Producer *)calloc(1, sizeof(*p));
+    p->logger = &logger;
+    p->messages = messages;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED); // It never returns through pthread
+    pthread_t tid;
+    if (pthread_create(&tid, &attr, producer, p) != 0) {
+        fprintf(stderr, "bench_realtime: cannot start thread\n");
+        return 1;
+    }
+    uint64_t c0 = log_cycles();
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    while (__atomic_load_n(&p->done, __ATOMIC_ACQUIRE) == 0) {
+        struct timespec pause = {0, 1000000};
+        nanosleep(&pause, NULL);
+    }
+    if (p->done < 0) {
+        fprintf(stderr, "bench_realtime: cannot %s\n", p->attached ? "install the seccomp filter" : "attach the thread");
+        return 1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double ns_per_cycle = ((double)(t1.tv_sec - t0.tv_sec) * 1e9 + (double)(t1.tv_nsec - t0.tv_nsec)) /
+                          (double)(log_cycles() - c0);
+
+    flush_logger(&logger);
+    struct LoggerStats stats;
+    logger_get_stats(&logger, &stats);
+    unsigned long long dropped = 0;
+    for (int level = 0; level < LOG_NUM_LEVELS; level++)
+        dropped += stats.dropped[level];
+    close_logger(&logger);
+
+    printf("%ld messages without a system call, %llu dropped (ring full)\n", messages, dropped);
+    printf("log_message() cycles: p50 < %llu, p99 < %llu, p99.9 < %llu, max %llu (%.1f ns per cycle)\n",
+           percentile(p, 50.0), percentile(p, 99.0), percentile(p, 99.9), p->max_cycles, ns_per_cycle);
+
+    int status = 0;
+    if (len <= 4 || strcmp(path + len - 4, ".bin") != 0) {
+        FILE *in = fopen(path, "r");
+        long lines = 0;
+        int c;
+        while (in && (c = fgetc(in)) != EOF)
+            lines += c == '\n';
+        if (in)
+            fclose(in);
+        printf("%ld lines in %s\n", lines, path);
+        if (lines + (long)dropped != messages)
+            status = 1;
+    }
+    free(p);
+    return status;
+}
+
+int main(int argc, char **argv) {
+    long messages = argc > 1 ? atol(argv[1]) : 100000;
+    const char *path = argc > 2 ? argv[2] : "bench_realtime.tmp";
+    int per_cpu = argc > 3 ? atoi(argv[3]) : 0;
+    if (messages < 1)
+        messages = 1;
+    fflush(stdout);
+
+    pid_t child = fork();
+    if (child < 0) {
+        fprintf(stderr, "bench_realtime: cannot fork\n");
+        return 1;
+    }
+    if (child == 0) {
+        int result = run_child(messages, path, per_cpu);
+        fflush(stdout);
+        _exit(result);
+    }
+    int status;
+    waitpid(child, &status, 0);
+    if (argc <= 2 || strcmp(path, "bench_realtime.tmp") == 0)
+        remove(path); // Keep only a file the caller named
+    if (WIFSIGNALED(status) && (WTERMSIG(status) == SIGSYS || WTERMSIG(status) == SIGKILL)) {
+        printf("FAIL: the producer made a system call (killed by seccomp)\n");
+        return 1;
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        printf("FAIL: lines missing or the run did not complete\n");
+        return 1;
+    }
+    printf("OK: no system calls on the producer path\n");
+    return 0;
+}
@@ -0,0 +1,83 @@
+#include <stdio.h>
+#include "../include/logger.h"
+
+/*
+ * Measures how fast real-time records are rendered and written with 0 to N
+ * render workers.
+ *
+ * Usage: bench_render [messages] [max_workers]
+ *
+ * An attached thread fills its ring with `messages` records while the ring
+ * writer is asleep (a 10 s poll interval), then flush_logger() merges,
+ * renders and writes them all to a file; its duration gives the rate. The
+ * worker count doubles from 1 up to max_workers, after the baseline of 0
+ * (rendering on the ring writer). The output must be identical every time.
+ */
+
+#define BENCH_FILE "bench_render.tmp"
+
+static unsigned long long file_checksum(const char *path, long *lines) {
+    FILE *in = fopen(path, "r");
+    unsigned long long sum = 0;
+    int c;
+    *lines = 0;
+    while (in && (c = fgetc(in)) != EOF) {
+        *lines += c == '\n';
+        sum = sum * 31 + (unsigned char)c;
+    }
+    if (in)
+        fclose(in);
+    return sum;
+}
+
+static double run(long messages, int workers, unsigned long long *sum, long *lines) {
+    struct Logger logger;
+    remove(BENCH_FILE);
+    init_logger(&logger, DEBUG, DEBUG, BENCH_FILE, "%Y-%m-%d", 1, 0, 0); // A fixed date keeps the runs comparable
+    set_log_levels(&logger, (enum LogLevel)(ERROR + 1), DEBUG);          // File only
+    set_file_flush(&logger, 0);
+    set_realtime_render_workers(&logger, workers);
+    set_realtime_mode(&logger, (size_t)messages * 192, 10000000);
+    if (attach_realtime_thread(&logger) != 0) {
+        fprintf(stderr, "bench_render: cannot attach the thread\n");
+        exit(1);
+    }
+    static const char *words[] = {"alpha", "beta", "gamma", "a considerably longer string argument"};
+    for (long i = 0; i < messages; i++)
+        LOG_MESSAGE(&logger, (enum LogLevel)(i % 5), "record %ld %s value=%.4f mask=%#lx %s", i, words[i % 4],
+                    (double)i / 7.0, (unsigned long)i * 2654435761UL, words[(i + 1) % 4]);
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    flush_logger(&logger);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    detach_realtime_thread(&logger);
+    close_logger(&logger);
+    *sum = file_checksum(BENCH_FILE, lines);
+    return (double)(t1.tv_sec - t0.tv_sec) + (double)(t1.tv_nsec - t0.tv_nsec) / 1e9;
+}
+
+int main(int argc, char **argv) {
+    long messages = argc > 1 ? atol(argv[1]) : 200000;
+    int max_workers = argc > 2 ? atoi(argv[2]) : 4;
+    if (messages < 1)
+        messages = 1;
+
+    printf("%ld messages\n\n%-8s %12s %12s\n", messages, "workers", "seconds", "msgs/s");
+    unsigned long long baseline = 0;
+    int status = 0;
+    for (int workers = 0; workers <= max_workers; workers = workers ? workers * 2 : 1) {
+        unsigned long long sum;
+        long lines;
+        double seconds = run(messages, workers, &sum, &lines);
+        printf("%-8d %12.3f %12.0f\n", workers, seconds, (double)messages / seconds);
+        if (workers == 0)
+            baseline = sum;
+        if (sum != baseline || lines != messages) {
+            printf("FAIL: output differs from rendering on the ring writer (%ld lines)\n", lines);
+            status = 1;
+        }
+    }
+    remove(BENCH_FILE);
+    return status;
+}
@@ -0,0 +1,98 @@
+#include <stdio.h>
+#include "../include/logger.h"
+
+/*
+ * Compares the ways the real-time ring writer can wait for work: what each
+ * costs in writer CPU time and how long a message sits in its ring.
+ *
+ * Usage: bench_wakeup [messages] [gap_us]
+ *
+ * An attached thread logs `messages` lines to a file, pausing `gap_us` between
+ * them so the writer goes idle in between. After each call it watches its ring
+ * until the writer has taken the message, which gives the pickup latency. The
+ * writer's CPU time comes from its thread clock. Each row is one
+ * set_realtime_wakeup() setting, with a 1 ms poll interval.
+ */
+
+#define BENCH_FILE "bench_wakeup.tmp"
+#define BENCH_POLL_US 1000
+
+struct Wakeup {
+    const char *name;
+    long spin_us;
+    long yield_us;
+    int producer_wake;
+};
+
+static const struct Wakeup wakeups[] = {
+    {"sleep", 0, 0, 0},
+    {"sleep+wake", 0, 0, 1},
+    {"yield+wake", 0, 200, 1},
+    {"spin+yield+wake", 50, 200, 1},
+    {"spin", 2 * BENCH_POLL_US, 0, 0},
+};
+
+static long long now_ns(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int compare_ll(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char **argv) {
+    long messages = argc > 1 ? atol(argv[1]) : 2000;
+    long gap_us = argc > 2 ? atol(argv[2]) : 200;
+    if (messages < 1)
+        messages = 1;
+    if (gap_us < 0)
+        gap_us = 0;
+    long long *latency = (long long *)malloc((size_t)messages * sizeof(*latency));
+
+    printf("%ld messages, %ld us apart, %d us poll interval\n\n", messages, gap_us, BENCH_POLL_US);
+    printf("%-16s %10s %10s %10s %10s %12s\n", "wakeup", "p50 us", "p99 us", "max us", "writer CPU", "log_message");
+    for (size_t w = 0; w < sizeof(wakeups) / sizeof(wakeups[0]); w++) {
+        struct Logger logger;
+        remove(BENCH_FILE);
+        init_logger(&logger, DEBUG, DEBUG, BENCH_FILE, NULL, 1, 1, 0);
+        set_log_levels(&logger, (enum LogLevel)(ERROR + 1), DEBUG); // File only
+        set_realtime_wakeup(&logger, wakeups[w].spin_us, wakeups[w].yield_us, wakeups[w].producer_wake);
+        set_realtime_mode(&logger, 1 << 20, BENCH_POLL_US);
+        if (attach_realtime_thread(&logger) != 0) {
+            fprintf(stderr, "bench_wakeup: cannot attach the thread\n");
+            return 1;
+        }
+        clockid_t writer_clock;
+        pthread_getcpuclockid(logger.rt_thread, &writer_clock);
+
+        long long call_ns = 0;
+        long long wall0 = now_ns(CLOCK_MONOTONIC), cpu0 = now_ns(writer_clock);
+        for (long i = 0; i < messages; i++) {
+            struct timespec gap = {gap_us / 1000000, (gap_us % 1000000) * 1000};
+            nanosleep(&gap, NULL);
+            long long t0 = now_ns(CLOCK_MONOTONIC);
+            LOG_MESSAGE(&logger, INFO, "sample %ld value=%.3f", i, (double)i / 7.0);
+            long long t1 = now_ns(CLOCK_MONOTONIC);
+            size_t head = __atomic_load_n(&log_rt_ring->head, __ATOMIC_RELAXED);
+            while (__atomic_load_n(&log_rt_ring->tail, __ATOMIC_ACQUIRE) < head)
+                sched_yield();
+            latency[i] = now_ns(CLOCK_MONOTONIC) - t0;
+            call_ns += t1 - t0;
+        }
+        double wall = (double)(now_ns(CLOCK_MONOTONIC) - wall0);
+        double cpu = (double)(now_ns(writer_clock) - cpu0);
+        detach_realtime_thread(&logger);
+        close_logger(&logger);
+
+        qsort(latency, (size_t)messages, sizeof(*latency), compare_ll);
+        printf("%-16s %10.1f %10.1f %10.1f %9.1f%% %9.0f ns\n", wakeups[w].name, latency[messages / 2] / 1e3,
+               latency[messages * 99 / 100] / 1e3, latency[messages - 1] / 1e3, 100.0 * cpu / wall,
+               (double)call_ns / (double)messages);
+    }
+    remove(BENCH_FILE);
+    free(latency);
+    return 0;
+}
@@ -9,9 +9,42 @@
 #include <unistd.h>
 #include <pthread.h>
 #include <sys/time.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <errno.h>
+#include <limits.h>
+#include <sched.h>
+#if defined(__has_include)
+#if __has_include(<stdio_ext.h>)
+#define LOG_HAVE_STDIO_EXT 1 // glibc, musl: __fbufsize() and __flbf() tell how stdout is set up
+#endif
+#elif defined(__GLIBC__)
+#define LOG_HAVE_STDIO_EXT 1
+#endif
+#ifdef LOG_HAVE_STDIO_EXT
+#include <stdio_ext.h>
+#endif
+#include <sys/resource.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <linux/mempolicy.h>
+#if !defined(__cplusplus) && !defined(_GNU_SOURCE)
+int sched_getcpu(void); // <sched.h> only declares it with _GNU_SOURCE
+int sync_file_range(int fd, long long offset, long long nbytes, unsigned int flags); // Likewise <fcntl.h>
+#endif
+#define LOG_SYNC_FILE_RANGE_WRITE 2 // SYNC_FILE_RANGE_WRITE, also hidden without _GNU_SOURCE
+#endif
 
 #define MAX_TAGS 10
 #define MAX_TAG_LENGTH 20
+#define DEFAULT_CACHE_DROP_CHUNK (1L << 20) // Bytes written between page-cache drops
+
+#ifndef LOG_MAX_LINE_LENGTH
+#define LOG_MAX_LINE_LENGTH 4096 // Longest rendered log line, including the newline
+#endif
 
 enum LogLevel {
     DEBUG,
@@ -21,205 +54,5721 @@ enum LogLevel {
     ERROR
 };
 
-struct Logger {
-    enum LogLevel console_level; // Minimum log level for console output
-    enum LogLevel file_level;    // Minimum log level for file output
-    FILE *file;                  // Log file pointer
-    char *file_path;             // Log file path
-    char *date_format;           // Date format for log entries
-    char *prefix;                // Custom log message prefix
-    int log_to_file;             // Flag indicating whether logging to file is enabled (1) or not (0)
-    int include_thread_id;       // Flag indicating whether to include thread ID in log messages (1) or not (0)
-    int include_process_id;      // Flag indicating whether to include process ID in log messages (1) or not (0)
-    char tags[MAX_TAGS][MAX_TAG_LENGTH]; // Array to store tags
-    int num_tags;                // Number of tags currently stored
-};
+enum LogCachePolicy {
+    LOG_CACHE_KEEP, // Leave written log pages in the page cache (default)
+    LOG_CACHE_DROP  // Sync written ranges and drop them from the page cache
+};
+
+#define LOG_NUM_LEVELS (ERROR + 1)
+#define LOG_STATS_SHARDS 16     // Producer counter shards; threads are spread over them round-robin
+#define LOG_LATENCY_BUCKETS 24  // File write latency buckets: bucket i counts writes under 2^i us (slower ones in none)
+#define LOG_METRICS_BUFFER (64 * 1024) // Room for one rendered metrics export
+
+#ifndef LOG_SEQ_SLOTS
+#define LOG_SEQ_SLOTS 1024 // Live threads that can each have a sequence counter of their own per logger
+#endif
+
+/**
+ * @brief Counters that log_message() updates, one shard per group of threads.
+ *
+ * Each thread sticks to one shard, so with up to LOG_STATS_SHARDS logging
+ * threads the atomic adds never touch a cache line another thread writes.
+ */
+struct LogStatsShard {
+    unsigned long long accepted[LOG_NUM_LEVELS]; // Messages that passed the level filters
+    unsigned long long dropped[LOG_NUM_LEVELS];  // Messages the file throttle dropped
+    unsigned long long console_bytes;            // Bytes written to stdout
+    char pad[128 - (2 * LOG_NUM_LEVELS + 1) * sizeof(unsigned long long) % 128];
+};
+
+/**
+ * @brief Counters of the log file sink, updated by whichever thread writes the file.
+ */
+struct LogSinkCounters {
+    size_t deferred_bytes;           // Bytes held back by the throttle (mirrors deferred_len)
+    size_t queued_bytes;             // Bytes in the frame pipeline that are not written yet
+    size_t queue_high_water;         // Largest backlog (deferred plus queued bytes) seen
+    unsigned long long bytes;        // Bytes written to the log file (after compression)
+    unsigned long long writes;       // Writes to the log file
+    unsigned long long flushes;      // fflush() calls on the log file
+    unsigned long long syncs;        // Writebacks started on the log file for page-cache drops
+    unsigned long long write_us;     // Time spent in file writes (us)
+    unsigned long long write_latency[LOG_LATENCY_BUCKETS]; // Writes by duration
+};
+
+/**
+ * @brief Snapshot of a logger's health counters from logger_get_stats().
+ */
+struct LoggerStats {
+    unsigned long long accepted[LOG_NUM_LEVELS]; // Messages that passed the level filters, per level
+    unsigned long long dropped[LOG_NUM_LEVELS];  // Messages dropped by the file throttle, per level
+    size_t queue_depth;              // Bytes accepted for the file and not yet written (deferred or in frames)
+    size_t queue_high_water;         // Largest queue_depth seen
+    unsigned long long console_bytes; // Bytes written to stdout
+    unsigned long long file_bytes;   // Bytes written to the log file (after compression)
+    unsigned long long file_writes;  // Writes to the log file
+    unsigned long long flushes;      // fflush() calls on the log file
+    unsigned long long syncs;        // Writebacks started on the log file (sync_file_range)
+    unsigned long long write_us;     // Time spent in file writes (us)
+    unsigned long long write_latency[LOG_LATENCY_BUCKETS]; // Writes under 2^i us (at least 2^(i-1) us) in bucket i; slower ones only in file_writes
+    unsigned long long merged;       // Real-time records written by the timestamp merge
+    unsigned long long merge_late;   // Of those, records written after a later one (they arrived past the skew window)
+    unsigned long long merge_us;     // Ring writer time spent merging, not counting writing the records (us)
+};
+
+static unsigned log_stats_next_slot;       // Round-robin shard assignment
+static __thread unsigned log_stats_slot;   // Shard of this thread plus one (0 = not assigned yet)
+
+/**
+ * @brief Returns the calling thread's shard of a logger's producer counters.
+ */
+static inline unsigned log_stats_shard_index(void) {
+    if (log_stats_slot == 0)
+        log_stats_slot = __atomic_fetch_add(&log_stats_next_slot, 1, __ATOMIC_RELAXED) % LOG_STATS_SHARDS + 1;
+    return log_stats_slot - 1;
+}
+
+static inline struct LogStatsShard *log_stats_shard(struct LogStatsShard *shards) {
+    return &shards[log_stats_shard_index()];
+}
+
+static inline void log_stats_add(unsigned long long *counter, unsigned long long n) {
+    __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+/*
+ * Windowed message rates. Each counter word holds a bucket number in its top
+ * LOG_RATE_EPOCH_BITS bits and a count below them, so a writer that finds an
+ * older round's bucket number resets the word with one compare-and-swap and
+ * readers skip words from other rounds; nothing ever has to clear the ring.
+ * Bucket numbers count from set_rate_counters(), so the zeroed words it hands
+ * out look like bucket 0 with a count of 0, and a word only aliases a later
+ * round after going untouched for 2^32 buckets (49 days at bucket_ms = 1).
+ */
+#define LOG_RATE_TAG_SLOTS (MAX_TAGS + 1) // Slot 0 counts every message, slot i + 1 the ones logged under tags[i]
+#define LOG_RATE_COUNT_BITS 32
+#define LOG_RATE_COUNT_MASK ((1ULL << LOG_RATE_COUNT_BITS) - 1)
+#define LOG_RATE_EPOCH_BITS (64 - LOG_RATE_COUNT_BITS)
+#define LOG_RATE_EPOCH_MASK ((1ULL << LOG_RATE_EPOCH_BITS) - 1)
+
+/**
+ * @brief Ring-of-buckets message counters, one ring per LogStatsShard slot.
+ */
+struct LogRateCounters {
+    long long origin_ms;       // Wall-clock start of bucket 0, when set_rate_counters() was called
+    long bucket_ms;            // Time covered by one bucket
+    int buckets;               // Buckets in each ring
+    size_t shard_words;        // Counter words per shard, rounded up to a whole number of cache lines
+    uint64_t *words;           // [shard][bucket][level][tag slot]
+};
+
+/**
+ * @brief Counts one message in the bucket of the given epoch.
+ */
+static inline void log_rate_bump(uint64_t *word, uint64_t epoch, int buckets) {
+    uint64_t v = __atomic_load_n(word, __ATOMIC_RELAXED);
+    while ((v >> LOG_RATE_COUNT_BITS) != epoch) {
+        // A newer round in this slot got here first (this thread was preempted for a whole ring): leave it
+        // alone. Anything else is an older round, or a word nothing has counted into yet.
+        uint64_t ahead = ((v >> LOG_RATE_COUNT_BITS) - epoch) & LOG_RATE_EPOCH_MASK;
+        if ((v & LOG_RATE_COUNT_MASK) != 0 && ahead < (uint64_t)buckets)
+            return;
+        if (__atomic_compare_exchange_n(word, &v, (epoch << LOG_RATE_COUNT_BITS) | 1, 1, __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED))
+            return;
+    }
+    __atomic_fetch_add(word, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Reads a fast cycle counter: the TSC on x86, the virtual counter on ARMv8,
+ * and nanoseconds of the monotonic clock elsewhere.
+ */
+static inline uint64_t log_cycles(void) {
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+    return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__) && defined(__GNUC__)
+    uint64_t v;
+    __asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(v));
+    return v;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+/*
+ * Per-stage cost breakdown, compiled in with -DLOG_STAGE_STATS.
+ *
+ * log_message() and the frame workers read the cycle counter at each stage
+ * boundary and add the difference to counters owned by the calling thread, so
+ * threads never share a cache line. A stage that contains others (the file sink
+ * writing and flushing on the caller's thread) is charged only for its own
+ * cycles, so the shares add up. logger_stats_dump() prints the totals. Without
+ * LOG_STAGE_STATS the hooks compile to nothing.
+ */
+enum LogStage {
+    LOG_STAGE_TIMESTAMP, // Clock, thread and process ids
+    LOG_STAGE_FORMAT,    // Rendering the line
+    LOG_STAGE_CONSOLE,   // Writing to stdout, stdio lock included
+    LOG_STAGE_LOCK,      // Waiting for the file lock
+    LOG_STAGE_CAPTURE,   // Capturing arguments for a binary record
+    LOG_STAGE_FILE,      // File sink: throttle, block copy, binary encoding
+    LOG_STAGE_WRITE,     // fwrite() to the log file
+    LOG_STAGE_FLUSH,     // fflush() and page-cache syncs
+    LOG_STAGE_COMPRESS,  // Encoding frames on the frame workers
+    LOG_NUM_STAGES
+};
+
+#ifdef LOG_STAGE_STATS
+struct LogStageCounters {
+    unsigned long long calls[LOG_NUM_STAGES];  // Times each stage was passed
+    unsigned long long cycles[LOG_NUM_STAGES]; // Cycles spent in each stage
+    unsigned long long recorded;               // Sum of cycles, to charge outer stages net of inner ones
+    unsigned long thread;                      // Owning thread
+    struct LogStageCounters *next;             // Next live thread
+};
+
+static pthread_mutex_t log_stage_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct LogStageCounters *log_stage_threads; // Counters of live threads
+static struct LogStageCounters log_stage_retired;  // Totals of threads that have exited
+static pthread_key_t log_stage_key;
+static pthread_once_t log_stage_once = PTHREAD_ONCE_INIT;
+static uint64_t log_stage_start_cycles;            // Counter and clock when counting began, for the rate
+static struct timespec log_stage_start_time;
+static __thread struct LogStageCounters *log_stage_mine;
+
+static inline void log_stage_retire(void *arg) {
+    struct LogStageCounters *c = (struct LogStageCounters *)arg;
+    pthread_mutex_lock(&log_stage_lock);
+    for (struct LogStageCounters **p = &log_stage_threads; *p; p = &(*p)->next) {
+        if (*p == c) {
+            *p = c->next;
+            break;
+        }
+    }
+    for (int i = 0; i < LOG_NUM_STAGES; i++) {
+        log_stage_retired.calls[i] += c->calls[i];
+        log_stage_retired.cycles[i] += c->cycles[i];
+    }
+    pthread_mutex_unlock(&log_stage_lock);
+    free(c);
+}
+
+static inline void log_stage_init(void) {
+    pthread_key_create(&log_stage_key, log_stage_retire);
+    log_stage_start_cycles = log_cycles();
+    clock_gettime(CLOCK_MONOTONIC, &log_stage_start_time);
+}
+
+/**
+ * @brief Returns the calling thread's counters, registering them on first use.
+ */
+static inline struct LogStageCounters *log_stage_counters(void) {
+    if (log_stage_mine)
+        return log_stage_mine;
+    pthread_once(&log_stage_once, log_stage_init);
+    struct LogStageCounters *c = (struct LogStageCounters *)calloc(1, sizeof(*c));
+    if (!c)
+        return NULL;
+    c->thread = (unsigned long)pthread_self();
+    pthread_mutex_lock(&log_stage_lock);
+    c->next = log_stage_threads;
+    log_stage_threads = c;
+    pthread_mutex_unlock(&log_stage_lock);
+    pthread_setspecific(log_stage_key, c);
+    log_stage_mine = c;
+    return c;
+}
+
+/**
+ * @brief Charges the cycles since `since`, less `inner` cycles charged to nested stages, to a stage.
+ *
+ * @return The current cycle count, where the next stage starts.
+ */
+static inline uint64_t log_stage_lap(enum LogStage stage, uint64_t since, uint64_t inner) {
+    uint64_t now = log_cycles();
+    struct LogStageCounters *c = log_stage_counters();
+    if (c) {
+        uint64_t spent = now - since > inner ? now - since - inner : 0;
+        // Only this thread writes; relaxed atomics keep logger_stats_dump() race-free
+        __atomic_store_n(&c->calls[stage], c->calls[stage] + 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&c->cycles[stage], c->cycles[stage] + spent, __ATOMIC_RELAXED);
+        c->recorded += spent;
+    }
+    return now;
+}
+
+static inline uint64_t log_stage_recorded(void) {
+    struct LogStageCounters *c = log_stage_counters();
+    return c ? c->recorded : 0;
+}
+
+#define LOG_STAGE_START(t) uint64_t t = log_cycles()
+#define LOG_STAGE_LAP(t, stage) (t) = log_stage_lap((stage), (t), 0)
+#define LOG_STAGE_MARK(m) uint64_t m = log_stage_recorded()
+#define LOG_STAGE_LAP_OUTER(t, stage, m) (t) = log_stage_lap((stage), (t), log_stage_recorded() - (m))
+#else
+#define LOG_STAGE_START(t) ((void)0)
+#define LOG_STAGE_LAP(t, stage) ((void)0)
+#define LOG_STAGE_MARK(m) ((void)0)
+#define LOG_STAGE_LAP_OUTER(t, stage, m) ((void)0)
+#endif
+
+/**
+ * @brief Prints where log_message() and the frame workers spend their cycles, stage by stage.
+ *
+ * Shows the totals over all threads, including threads that have exited, and a
+ * line per live thread. Needs LOG_STAGE_STATS defined before including logger.h;
+ * otherwise only says so.
+ *
+ * @param out Stream to print to (NULL for stderr).
+ */
+void logger_stats_dump(FILE *out) {
+    if (!out)
+        out = stderr;
+#ifdef LOG_STAGE_STATS
+    static const char *const log_stage_names[LOG_NUM_STAGES] = {
+        "timestamp", "format", "console", "lock", "capture", "file", "write", "flush", "compress"};
+    pthread_once(&log_stage_once, log_stage_init);
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed_ns = (double)(now.tv_sec - log_stage_start_time.tv_sec) * 1e9 +
+                        (double)(now.tv_nsec - log_stage_start_time.tv_nsec);
+    double per_ns = elapsed_ns > 0 ? (double)(log_cycles() - log_stage_start_cycles) / elapsed_ns : 1.0;
+
+    pthread_mutex_lock(&log_stage_lock);
+    struct LogStageCounters total = log_stage_retired;
+    for (struct LogStageCounters *c = log_stage_threads; c; c = c->next) {
+        for (int i = 0; i < LOG_NUM_STAGES; i++) {
+            total.calls[i] += __atomic_load_n(&c->calls[i], __ATOMIC_RELAXED);
+            total.cycles[i] += __atomic_load_n(&c->cycles[i], __ATOMIC_RELAXED);
+        }
+    }
+    unsigned long long all = 0;
+    for (int i = 0; i < LOG_NUM_STAGES; i++)
+        all += total.cycles[i];
+
+    fprintf(out, "Logger stage costs (%.2f cycles/ns)\n", per_ns);
+    fprintf(out, "%-10s %14s %18s %12s %10s %7s\n", "stage", "calls", "cycles", "cycles/call", "ns/call", "share");
+    for (int i = 0; i < LOG_NUM_STAGES; i++) {
+        if (total.calls[i] == 0)
+            continue;
+        double per_call = (double)total.cycles[i] / (double)total.calls[i];
+        fprintf(out, "%-10s %14llu %18llu %12.0f %10.1f %6.1f%%\n", log_stage_names[i], total.calls[i],
+                total.cycles[i], per_call, per_call / per_ns, all ? 100.0 * (double)total.cycles[i] / (double)all : 0.0);
+    }
+    for (struct LogStageCounters *c = log_stage_threads; c; c = c->next) {
+        fprintf(out, "thread %lu:", c->thread);
+        for (int i = 0; i < LOG_NUM_STAGES; i++) {
+            unsigned long long cycles = __atomic_load_n(&c->cycles[i], __ATOMIC_RELAXED);
+            if (cycles)
+                fprintf(out, " %s %llu", log_stage_names[i], cycles);
+        }
+        fprintf(out, "\n");
+    }
+    pthread_mutex_unlock(&log_stage_lock);
+#else
+    fprintf(out, "Logger stage costs are not compiled in (define LOG_STAGE_STATS)\n");
+#endif
+}
+
+/*
+ * Compressed log frames.
+ *
+ * With compression enabled the log file is a sequence of self-delimiting frames:
+ *
+ *   magic "L4CF" | flags (1) | reserved (3) | raw_len (4, LE) | data_len (4, LE)
+ *   [| first_ms (8, LE) | last_ms (8, LE)] | payload [| crc32c (4, LE)]
+ *
+ * Timed frames carry the wall-clock range (milliseconds since the epoch) of the
+ * lines they hold. Each one also gets a 32-byte entry in the side index
+ * "<file>.idx": first_ms (8) | last_ms (8) | offset (8) | frame_len (4) | raw_len (4),
+ * all little-endian, so a reader can jump straight to the frames of a time window.
+ *
+ * The payload is either the raw text (stored) or an LZ block in a simple LZ4-like
+ * format: a token byte holding the literal length and match length - 4 in its
+ * nibbles (15 = more length bytes follow, 255 = keep adding), the literals, and a
+ * 16-bit little-endian match offset. The last sequence carries literals only.
+ * Since every frame stands alone, a crash loses at most the frame being written.
+ *
+ * Checksummed frames end with the CRC32C of the header and payload, so torn or
+ * corrupted blocks are detected rather than decoded into garbage.
+ */
+
+#define LOG_FRAME_MAGIC "L4CF"
+#define LOG_FRAME_HEADER_SIZE 16         // Fixed part of the frame header
+#define LOG_FRAME_TIME_SIZE 16           // first_ms and last_ms of a timed frame
+#define LOG_FRAME_CRC_SIZE 4             // CRC32C trailer of a checksummed frame
+#define LOG_FRAME_OVERHEAD (LOG_FRAME_HEADER_SIZE + LOG_FRAME_TIME_SIZE + LOG_FRAME_CRC_SIZE) // Largest frame size minus payload
+#define LOG_FRAME_COMPRESSED 0x01        // Payload is an LZ block (otherwise stored as is)
+#define LOG_FRAME_TIMED 0x02             // Header carries first_ms and last_ms
+#define LOG_FRAME_CHECKSUM 0x04          // Payload is followed by a CRC32C trailer
+#define LOG_INDEX_ENTRY_SIZE 32          // Bytes per entry in the side index
+#define LOG_FRAME_BLOCK_SIZE (64 * 1024) // Default raw bytes per frame
+#define LOG_FRAME_MAX_BLOCK (16 * 1024 * 1024) // Largest raw_len a reader will accept
+#define LOG_FRAME_MAX_WORKERS 64         // Upper bound on compression worker threads
+#define LOG_FRAME_FLUSH_MS 1000          // Seal a partly filled block after this long
+
+#define LOG_LZ_MIN_MATCH 4
+#define LOG_LZ_HASH_BITS 16
+#define LOG_LZ_WINDOW (1 << 16)
+#define LOG_LZ_MAX_LEVEL 9
+
+struct LogLzState {
+    uint32_t base;                        // Position bias of the current block; older entries are ignored
+    uint32_t head[1 << LOG_LZ_HASH_BITS]; // Most recent position (+ base + 1) for each hash
+    uint32_t chain[LOG_LZ_WINDOW];        // Previous position with the same hash, indexed by position
+};
+
+static inline uint32_t log_lz_read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t log_lz_hash(uint32_t v) {
+    return (v * 2654435761U) >> (32 - LOG_LZ_HASH_BITS);
+}
+
+static inline void log_put_le32(unsigned char *p, uint32_t v) {
+    p[0] = (unsigned char)v;
+    p[1] = (unsigned char)(v >> 8);
+    p[2] = (unsigned char)(v >> 16);
+    p[3] = (unsigned char)(v >> 24);
+}
+
+static inline uint32_t log_get_le32(const unsigned char *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline void log_put_le64(unsigned char *p, uint64_t v) {
+    log_put_le32(p, (uint32_t)v);
+    log_put_le32(p + 4, (uint32_t)(v >> 32));
+}
+
+static inline uint64_t log_get_le64(const unsigned char *p) {
+    return (uint64_t)log_get_le32(p) | (uint64_t)log_get_le32(p + 4) << 32;
+}
+
+static inline uint8_t *log_lz_put_length(uint8_t *op, size_t len) {
+    for (len -= 15; len >= 255; len -= 255)
+        *op++ = 255;
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+/**
+ * @brief Compresses a block with the LZ codec.
+ *
+ * Level 1 checks a single candidate per position; higher levels walk up to
+ * 2^(level-1) hash chain entries and index every matched position for a better ratio.
+ *
+ * @param st Match-finder state, reused across blocks.
+ * @param level Compression level from 1 (fastest) to LOG_LZ_MAX_LEVEL.
+ * @param src Input bytes.
+ * @param n Number of input bytes.
+ * @param dst Output buffer.
+ * @param cap Capacity of the output buffer.
+ * @return Compressed size, or 0 if the result would not fit in cap.
+ */
+static inline size_t log_lz_compress(struct LogLzState *st, int level, const uint8_t *src, size_t n, uint8_t *dst, size_t cap) {
+    if (st->base > 0x7FFFFFFFU - (uint32_t)n) {
+        memset(st, 0, sizeof(*st));
+    }
+    uint32_t base = st->base;
+    st->base += (uint32_t)n + 1;
+
+    int depth = level <= 1 ? 1 : 1 << ((level > LOG_LZ_MAX_LEVEL ? LOG_LZ_MAX_LEVEL : level) - 1);
+    size_t limit = n >= LOG_LZ_MIN_MATCH ? n - LOG_LZ_MIN_MATCH + 1 : 0;
+    uint8_t *op = dst;
+    uint8_t *oend = dst + cap;
+    size_t ip = 0;
+    size_t anchor = 0;
+
+    while (ip < limit) {
+        uint32_t seq = log_lz_read32(src + ip);
+        uint32_t h = log_lz_hash(seq);
+        uint32_t cand = st->head[h];
+        size_t best_len = 0;
+        size_t best_off = 0;
+
+        for (int d = 0; d < depth && cand > base; d++) {
+            size_t c = cand - base - 1;
+            if (ip - c >= LOG_LZ_WINDOW)
+                break;
+            if (log_lz_read32(src + c) == seq) {
+                size_t len = LOG_LZ_MIN_MATCH;
+                while (ip + len < n && src[c + len] == src[ip + len])
+                    len++;
+                if (len > best_len) {
+                    best_len = len;
+                    best_off = ip - c;
+                }
+            }
+            cand = st->chain[c & (LOG_LZ_WINDOW - 1)];
+        }
+        st->chain[ip & (LOG_LZ_WINDOW - 1)] = st->head[h];
+        st->head[h] = base + (uint32_t)ip + 1;
+
+        if (best_len < LOG_LZ_MIN_MATCH) {
+            ip++;
+            continue;
+        }
+
+        size_t lit = ip - anchor;
+        if ((size_t)(oend - op) < 1 + lit / 255 + 1 + lit + 2 + best_len / 255 + 1)
+            return 0;
+        uint8_t *token = op++;
+        *token = (uint8_t)((lit < 15 ? lit : 15) << 4);
+        if (lit >= 15)
+            op = log_lz_put_length(op, lit);
+        memcpy(op, src + anchor, lit);
+        op += lit;
+        *op++ = (uint8_t)best_off;
+        *op++ = (uint8_t)(best_off >> 8);
+        size_t ml = best_len - LOG_LZ_MIN_MATCH;
+        *token |= (uint8_t)(ml < 15 ? ml : 15);
+        if (ml >= 15)
+            op = log_lz_put_length(op, ml);
+
+        if (level > 1) {
+            for (size_t p = ip + 1; p < ip + best_len && p < limit; p++) {
+                uint32_t hp = log_lz_hash(log_lz_read32(src + p));
+                st->chain[p & (LOG_LZ_WINDOW - 1)] = st->head[hp];
+                st->head[hp] = base + (uint32_t)p + 1;
+            }
+        }
+        ip += best_len;
+        anchor = ip;
+    }
+
+    size_t lit = n - anchor;
+    if ((size_t)(oend - op) < 1 + lit / 255 + 1 + lit)
+        return 0;
+    *op++ = (uint8_t)((lit < 15 ? lit : 15) << 4);
+    if (lit >= 15)
+        op = log_lz_put_length(op, lit);
+    memcpy(op, src + anchor, lit);
+    op += lit;
+    return (size_t)(op - dst);
+}
+
+/**
+ * @brief Decompresses an LZ block, checking every length and offset against the buffers.
+ *
+ * @param src Compressed bytes.
+ * @param n Number of compressed bytes.
+ * @param dst Output buffer.
+ * @param cap Capacity of the output buffer.
+ * @return Decompressed size, or -1 if the block is corrupt.
+ */
+static inline long log_lz_decompress(const uint8_t *src, size_t n, uint8_t *dst, size_t cap) {
+    size_t ip = 0;
+    size_t op = 0;
+
+    while (ip < n) {
+        uint8_t token = src[ip++];
+        size_t lit = token >> 4;
+        if (lit == 15) {
+            uint8_t b;
+            do {
+                if (ip >= n)
+                    return -1;
+                b = src[ip++];
+                lit += b;
+            } while (b == 255);
+        }
+        if (lit > n - ip || lit > cap - op)
+            return -1;
+        memcpy(dst + op, src + ip, lit);
+        ip += lit;
+        op += lit;
+        if (ip == n)
+            break;
+
+        if (n - ip < 2)
+            return -1;
+        size_t off = (size_t)src[ip] | (size_t)src[ip + 1] << 8;
+        ip += 2;
+        if (off == 0 || off > op)
+            return -1;
+        size_t ml = (token & 15);
+        if (ml == 15) {
+            uint8_t b;
+            do {
+                if (ip >= n)
+                    return -1;
+                b = src[ip++];
+                ml += b;
+            } while (b == 255);
+        }
+        ml += LOG_LZ_MIN_MATCH;
+        if (ml > cap - op)
+            return -1;
+        if (off >= ml) {
+            memcpy(dst + op, dst + op - off, ml);
+        } else {
+            for (size_t i = 0; i < ml; i++)
+                dst[op + i] = dst[op - off + i];
+        }
+        op += ml;
+    }
+    return (long)op;
+}
+
+/*
+ * CRC32C (Castagnoli), used for frame trailers.
+ *
+ * The SSE4.2 and ARMv8 CRC instructions compute exactly this polynomial, so
+ * log_crc32c() picks them at run time when the CPU has them and falls back to
+ * a slicing-by-8 table otherwise.
+ */
+
+#define LOG_CRC32C_POLY 0x82F63B78U // Reflected Castagnoli polynomial
+
+static uint32_t log_crc32c_table[8][256];
+static uint32_t (*log_crc32c_impl)(uint32_t crc, const unsigned char *p, size_t len);
+static pthread_once_t log_crc32c_once = PTHREAD_ONCE_INIT;
+
+static inline uint32_t log_crc32c_sw(uint32_t crc, const unsigned char *p, size_t len) {
+    while (len > 0 && ((uintptr_t)p & 7) != 0) {
+        crc = log_crc32c_table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+        len--;
+    }
+    while (len >= 8) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        v ^= crc; // Little-endian: the low bytes of the word come first
+        crc = log_crc32c_table[7][v & 0xFF] ^ log_crc32c_table[6][(v >> 8) & 0xFF] ^
+              log_crc32c_table[5][(v >> 16) & 0xFF] ^ log_crc32c_table[4][(v >> 24) & 0xFF] ^
+              log_crc32c_table[3][(v >> 32) & 0xFF] ^ log_crc32c_table[2][(v >> 40) & 0xFF] ^
+              log_crc32c_table[1][(v >> 48) & 0xFF] ^ log_crc32c_table[0][v >> 56];
+        p += 8;
+        len -= 8;
+    }
+    while (len-- > 0)
+        crc = log_crc32c_table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    return crc;
+}
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define LOG_CRC32C_HW 1
+__attribute__((target("sse4.2"))) static inline uint32_t log_crc32c_hw(uint32_t crc, const unsigned char *p, size_t len) {
+    while (len > 0 && ((uintptr_t)p & 7) != 0) {
+        crc = __builtin_ia32_crc32qi(crc, *p++);
+        len--;
+    }
+#ifdef __x86_64__
+    uint64_t crc64 = crc;
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        crc64 = __builtin_ia32_crc32di(crc64, v);
+    }
+    crc = (uint32_t)crc64;
+#endif
+    for (; len >= 4; p += 4, len -= 4) {
+        uint32_t v;
+        memcpy(&v, p, sizeof(v));
+        crc = __builtin_ia32_crc32si(crc, v);
+    }
+    while (len-- > 0)
+        crc = __builtin_ia32_crc32qi(crc, *p++);
+    return crc;
+}
+
+static inline int log_crc32c_hw_available(void) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse4.2");
+}
+#elif defined(__aarch64__) && defined(__GNUC__) && defined(__linux__) && \
+    (defined(__ARM_FEATURE_CRC32) || !defined(__clang__) || __clang_major__ >= 16)
+// The ACLE intrinsics work in GCC and clang alike; before clang 16 they need a build with +crc
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#define LOG_CRC32C_HW 1
+#if defined(__ARM_FEATURE_CRC32)
+#define LOG_CRC32C_TARGET
+#elif defined(__clang__)
+#define LOG_CRC32C_TARGET __attribute__((target("crc")))
+#else
+#define LOG_CRC32C_TARGET __attribute__((target("+crc")))
+#endif
+LOG_CRC32C_TARGET static inline uint32_t log_crc32c_hw(uint32_t crc, const unsigned char *p, size_t len) {
+    while (len > 0 && ((uintptr_t)p & 7) != 0) {
+        crc = __crc32cb(crc, *p++);
+        len--;
+    }
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        crc = __crc32cd(crc, v);
+    }
+    while (len-- > 0)
+        crc = __crc32cb(crc, *p++);
+    return crc;
+}
+
+static inline int log_crc32c_hw_available(void) {
+    return (getauxval(AT_HWCAP) & (1UL << 7)) != 0; // HWCAP_CRC32
+}
+#endif
+
+static inline void log_crc32c_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int k = 0; k < 8; k++)
+            crc = crc & 1 ? (crc >> 1) ^ LOG_CRC32C_POLY : crc >> 1;
+        log_crc32c_table[0][i] = crc;
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+        for (int t = 1; t < 8; t++)
+            log_crc32c_table[t][i] = log_crc32c_table[0][log_crc32c_table[t - 1][i] & 0xFF] ^ (log_crc32c_table[t - 1][i] >> 8);
+    }
+    log_crc32c_impl = log_crc32c_sw;
+#ifdef LOG_CRC32C_HW
+    if (log_crc32c_hw_available())
+        log_crc32c_impl = log_crc32c_hw;
+#endif
+}
+
+/**
+ * @brief Computes the CRC32C of a buffer.
+ *
+ * @param data Bytes to checksum.
+ * @param len Number of bytes.
+ * @return CRC32C of the bytes.
+ */
+static inline uint32_t log_crc32c(const void *data, size_t len) {
+    pthread_once(&log_crc32c_once, log_crc32c_init);
+    return ~log_crc32c_impl(~0U, (const unsigned char *)data, len);
+}
+
+/**
+ * @brief Encodes a block of log text as one frame, storing it raw if it does not compress.
+ *
+ * @param lz Match-finder state.
+ * @param level Compression level (0 stores the block uncompressed).
+ * @param raw Block of log text.
+ * @param raw_len Length of the block.
+ * @param first_ms Time of the oldest line in the block (ms since the epoch).
+ * @param last_ms Time of the newest line in the block (0 for an untimed frame).
+ * @param checksum Append a CRC32C trailer (1) or not (0).
+ * @param out Output buffer of at least LOG_FRAME_OVERHEAD + raw_len bytes.
+ * @return Size of the encoded frame.
+ */
+static inline size_t log_frame_encode(struct LogLzState *lz, int level, const char *raw, size_t raw_len,
+                                      long long first_ms, long long last_ms, int checksum, unsigned char *out) {
+    size_t header_len = LOG_FRAME_HEADER_SIZE + (last_ms ? LOG_FRAME_TIME_SIZE : 0);
+    unsigned char *payload = out + header_len;
+    size_t data_len = 0;
+    unsigned char flags = (last_ms ? LOG_FRAME_TIMED : 0) | (checksum ? LOG_FRAME_CHECKSUM : 0);
+
+    if (level > 0 && raw_len > 0)
+        data_len = log_lz_compress(lz, level, (const uint8_t *)raw, raw_len, payload, raw_len - 1);
+    if (data_len > 0) {
+        flags |= LOG_FRAME_COMPRESSED;
+    } else {
+        memcpy(payload, raw, raw_len);
+        data_len = raw_len;
+    }
+
+    memcpy(out, LOG_FRAME_MAGIC, 4);
+    out[4] = flags;
+    out[5] = out[6] = out[7] = 0;
+    log_put_le32(out + 8, (uint32_t)raw_len);
+    log_put_le32(out + 12, (uint32_t)data_len);
+    if (flags & LOG_FRAME_TIMED) {
+        log_put_le64(out + 16, (uint64_t)first_ms);
+        log_put_le64(out + 24, (uint64_t)last_ms);
+    }
+    if (checksum) {
+        log_put_le32(out + header_len + data_len, log_crc32c(out, header_len + data_len));
+        data_len += LOG_FRAME_CRC_SIZE;
+    }
+    return header_len + data_len;
+}
+
+struct LogFrameHeader {
+    unsigned char flags;   // LOG_FRAME_* flags
+    size_t header_len;     // Bytes before the payload
+    size_t raw_len;        // Uncompressed size of the payload
+    size_t data_len;       // Stored size of the payload
+    size_t frame_len;      // Size of the whole frame, including any trailer
+    long long first_ms;    // Time of the oldest line (timed frames only)
+    long long last_ms;     // Time of the newest line (timed frames only)
+};
+
+/**
+ * @brief Parses a frame header.
+ *
+ * @param p Bytes starting at the frame magic.
+ * @param avail Number of bytes available at p.
+ * @param h Receives the parsed header.
+ * @return 1 if parsed, 0 if more bytes are needed, -1 if this is not a valid frame header.
+ */
+static inline int log_frame_parse_header(const unsigned char *p, size_t avail, struct LogFrameHeader *h) {
+    if (avail < LOG_FRAME_HEADER_SIZE)
+        return avail >= 4 && memcmp(p, LOG_FRAME_MAGIC, 4) != 0 ? -1 : 0;
+    if (memcmp(p, LOG_FRAME_MAGIC, 4) != 0)
+        return -1;
+    h->flags = p[4];
+    h->header_len = LOG_FRAME_HEADER_SIZE + (h->flags & LOG_FRAME_TIMED ? LOG_FRAME_TIME_SIZE : 0);
+    h->raw_len = log_get_le32(p + 8);
+    h->data_len = log_get_le32(p + 12);
+    if (h->raw_len > LOG_FRAME_MAX_BLOCK || h->data_len > LOG_FRAME_MAX_BLOCK)
+        return -1;
+    h->frame_len = h->header_len + h->data_len + (h->flags & LOG_FRAME_CHECKSUM ? LOG_FRAME_CRC_SIZE : 0);
+    if (avail < h->header_len)
+        return 0;
+    h->first_ms = h->flags & LOG_FRAME_TIMED ? (long long)log_get_le64(p + 16) : 0;
+    h->last_ms = h->flags & LOG_FRAME_TIMED ? (long long)log_get_le64(p + 24) : 0;
+    return 1;
+}
+
+/**
+ * @brief Checks the CRC32C trailer of a frame.
+ *
+ * @param h Parsed frame header.
+ * @param frame The whole frame (h->frame_len bytes).
+ * @return 0 if the checksum matches or the frame has none, -1 on a mismatch.
+ */
+static inline int log_frame_verify(const struct LogFrameHeader *h, const unsigned char *frame) {
+    if (!(h->flags & LOG_FRAME_CHECKSUM))
+        return 0;
+    size_t covered = h->header_len + h->data_len;
+    return log_crc32c(frame, covered) == log_get_le32(frame + covered) ? 0 : -1;
+}
+
+/**
+ * @brief Verifies and decodes a frame.
+ *
+ * @param h Parsed frame header.
+ * @param frame The whole frame (h->frame_len bytes).
+ * @param out Output buffer of at least h->raw_len bytes.
+ * @return 0 on success, -1 if the frame is corrupt.
+ */
+static inline int log_frame_decode(const struct LogFrameHeader *h, const unsigned char *frame, char *out) {
+    const unsigned char *payload = frame + h->header_len;
+    if (log_frame_verify(h, frame) != 0)
+        return -1;
+    if (h->flags & LOG_FRAME_COMPRESSED)
+        return log_lz_decompress(payload, h->data_len, (uint8_t *)out, h->raw_len) == (long)h->raw_len ? 0 : -1;
+    if (h->data_len != h->raw_len)
+        return -1;
+    memcpy(out, payload, h->raw_len);
+    return 0;
+}
+
+/**
+ * @brief Serializes one side-index entry.
+ */
+static inline void log_index_encode(unsigned char *p, long long first_ms, long long last_ms, long long offset,
+                                    size_t frame_len, size_t raw_len) {
+    log_put_le64(p, (uint64_t)first_ms);
+    log_put_le64(p + 8, (uint64_t)last_ms);
+    log_put_le64(p + 16, (uint64_t)offset);
+    log_put_le32(p + 24, (uint32_t)frame_len);
+    log_put_le32(p + 28, (uint32_t)raw_len);
+}
+
+/**
+ * @brief Reads log text back from a file that holds frames, plain text, or both.
+ *
+ * Plain text is passed through as is, so a file that was appended to before and
+ * after enabling compression reads back in order.
+ */
+struct LogReader {
+    FILE *in;              // Input stream
+    unsigned char *buf;    // Buffered input
+    size_t cap;            // Capacity of buf
+    size_t pos;            // Next unread byte in buf
+    size_t len;            // Bytes held in buf
+    long long offset;      // File offset of buf[0]
+    int eof;               // Input is exhausted
+    int resync;            // Skip input up to the next frame magic (after a corrupt frame)
+    char *out;             // Decoded text of the last frame
+    size_t out_cap;        // Capacity of out
+    struct LogFrameHeader frame; // Header of the last frame returned
+    int in_frame;          // The last text returned came from a frame (1) or plain text (0)
+    int unframed;          // Pass input through without looking for frames (raw binary records)
+    int stream;            // Return input as soon as it arrives instead of filling the buffer (pipes)
+    int follow;            // At end of input, wait for more to be appended (tail -f)
+};
+
+void log_reader_init(struct LogReader *r, FILE *in) {
+    memset(r, 0, sizeof(*r));
+    r->in = in;
+}
+
+void log_reader_free(struct LogReader *r) {
+    free(r->buf);
+    free(r->out);
+}
+
+/**
+ * @brief Makes at least need unread bytes available in the reader's buffer.
+ *
+ * In stream mode each read takes whatever has arrived; in follow mode the end
+ * of the input is polled for more data instead of being final.
+ *
+ * @return 1 if enough bytes are buffered, 0 if the input ended first.
+ */
+static inline int log_reader_fill(struct LogReader *r, size_t need) {
+    while (r->len - r->pos < need && !r->eof) {
+        if (r->pos > 0) {
+            memmove(r->buf, r->buf + r->pos, r->len - r->pos);
+            r->offset += (long long)r->pos;
+            r->len -= r->pos;
+            r->pos = 0;
+        }
+        if (r->cap - r->len < 65536 || r->cap < need) {
+            size_t cap = r->cap ? r->cap * 2 : 131072;
+            while (cap < need)
+                cap *= 2;
+            unsigned char *buf = (unsigned char *)realloc(r->buf, cap);
+            if (!buf)
+                return 0;
+            r->buf = buf;
+            r->cap = cap;
+        }
+        size_t got;
+        if (r->stream) {
+            ssize_t n = read(fileno(r->in), r->buf + r->len, r->cap - r->len);
+            got = n > 0 ? (size_t)n : 0;
+            if (n < 0 && errno == EINTR)
+                continue;
+        } else {
+            got = fread(r->buf + r->len, 1, r->cap - r->len, r->in);
+            clearerr(r->in); // So a followed file is read again after reaching its end
+        }
+        if (got == 0 && r->follow) {
+            struct timespec pause = {0, 200000000L};
+            nanosleep(&pause, NULL);
+            continue;
+        }
+        if (got == 0)
+            r->eof = 1;
+        r->len += got;
+    }
+    return r->len - r->pos >= need;
+}
+
+/**
+ * @brief Finds the next frame magic in the reader's buffer.
+ *
+ * @return Index of the magic, or r->len if there is none.
+ */
+static inline size_t log_reader_find_magic(struct LogReader *r) {
+    for (size_t i = r->pos; i + 4 <= r->len; i++) {
+        if (r->buf[i] == LOG_FRAME_MAGIC[0] && memcmp(r->buf + i, LOG_FRAME_MAGIC, 4) == 0)
+            return i;
+    }
+    return r->len;
+}
+
+/**
+ * @brief Returns the next run of log text.
+ *
+ * @param r Reader state.
+ * @param text Receives a pointer to the text, valid until the next call.
+ * @return Length of the text, 0 at end of input, or -1 for a corrupt or truncated frame
+ *         (reading may continue; the reader skips ahead to the next frame).
+ */
+long log_reader_next(struct LogReader *r, const char **text) {
+    for (;;) {
+        log_reader_fill(r, r->stream ? 1 : 4096); // Pipes hand over whatever has arrived
+        if (r->pos == r->len)
+            return 0;
+
+        if (r->unframed) {
+            size_t start = r->pos;
+            r->pos = r->len;
+            r->in_frame = 0;
+            *text = (const char *)r->buf + start;
+            return (long)(r->len - start);
+        }
+
+        if (r->len - r->pos >= 4 && memcmp(r->buf + r->pos, LOG_FRAME_MAGIC, 4) == 0) {
+            r->resync = 0;
+            struct LogFrameHeader h;
+            log_reader_fill(r, LOG_FRAME_OVERHEAD);
+            int parsed = log_frame_parse_header(r->buf + r->pos, r->len - r->pos, &h);
+            if (parsed < 0) {
+                r->pos += 4;
+                r->resync = 1;
+                return -1;
+            }
+            if (parsed == 0 || !log_reader_fill(r, h.frame_len)) {
+                r->pos = r->len;
+                return -1;
+            }
+            if (r->out_cap < h.raw_len) {
+                char *out = (char *)realloc(r->out, h.raw_len);
+                if (!out)
+                    return -1;
+                r->out = out;
+                r->out_cap = h.raw_len;
+            }
+            if (log_frame_decode(&h, r->buf + r->pos, r->out) != 0) {
+                r->pos += 4;
+                r->resync = 1;
+                return -1;
+            }
+            r->pos += h.frame_len;
+            r->frame = h;
+            r->in_frame = 1;
+            *text = r->out;
+            return (long)h.raw_len;
+        }
+
+        // Plain text (or garbage after a corrupt frame) up to the next frame magic
+        size_t end = log_reader_find_magic(r);
+        if (end == r->len && !r->eof) {
+            // Hold back a tail that could be the start of a magic straddling the buffer end
+            for (size_t keep = 3; keep > 0; keep--) {
+                if (r->len - r->pos >= keep && memcmp(r->buf + r->len - keep, LOG_FRAME_MAGIC, keep) == 0) {
+                    end = r->len - keep;
+                    break;
+                }
+            }
+        }
+        if (end == r->pos) {
+            if (r->eof) {
+                end = r->len;
+            } else {
+                log_reader_fill(r, r->len - r->pos + 1);
+                continue;
+            }
+        }
+        size_t start = r->pos;
+        r->pos = end;
+        if (r->resync)
+            continue;
+        r->in_frame = 0;
+        *text = (const char *)r->buf + start;
+        return (long)(end - start);
+    }
+}
+
+/*
+ * Binary log records.
+ *
+ * In LOG_FORMAT_BINARY the file holds compact records instead of text lines; the
+ * format string and raw arguments are stored and only rendered when decoded.
+ * A record is:
+ *
+ *   header (1) | ts delta (zigzag varint, us) | [thread id] | [tag mask] | [pid] | [seq] | format ref | arguments
+ *
+ * The header byte packs the level (bits 0-2) with flags saying which of the
+ * optional fields follow; each of them is only written when it differs from the
+ * previous record. The sequence number is only written when it is not the
+ * previous record's plus one, which is the case for consecutive records of one
+ * thread. The timestamp is the difference in microseconds from the
+ * previous record. The format ref is a varint: id + 1 of an entry in the
+ * segment's format table, or 0 followed by the format inline (a varint length
+ * and its bytes) once the table is full. Integer arguments
+ * are zigzag varints (unsigned ones plain varints) and doubles are 8 raw bytes.
+ *
+ * A string argument starts with a varint v: 0 for NULL, otherwise its low two
+ * bits say what follows. A literal (1) is v >> 2 bytes of text; a definition (2)
+ * is the same but also stores the string in the segment's string dictionary; a
+ * reference (3) names dictionary entry v >> 2. The dictionary is direct-mapped:
+ * a string's entry is its FNV-1a hash modulo LOG_BIN_DICT_SIZE, so definitions
+ * need no id and the reader rebuilds the table as it goes. Strings are defined
+ * the second time they are seen, so one-off values are never charged for it.
+ *
+ * A header byte of 0xFF starts a control record: a segment start ("L4CB" and a
+ * version, which resets all delta state), the decoding context (prefix, date
+ * format and which ids are shown), the tag table, or a format table entry (id,
+ * level, source file and line, and the format string) written just before the
+ * first record that uses it. A file thus decodes without the program that
+ * wrote it, and each record costs a few bytes plus its arguments. Every file and every
+ * compressed frame starts with a segment, so frames decode independently.
+ */
+
+#define LOG_BIN_LEVEL_MASK 0x07   // Header bits holding the level
+#define LOG_BIN_THREAD 0x08       // Header flag: thread id follows
+#define LOG_BIN_TAGS 0x10         // Header flag: tag mask follows
+#define LOG_BIN_PROCESS 0x20      // Header flag: process id follows
+#define LOG_BIN_SEQUENCE 0x40     // Header flag: sequence number follows (otherwise it is the previous one plus 1)
+#define LOG_BIN_CONTROL 0xFF      // Header byte of a control record
+#define LOG_BIN_SEGMENT 0x01      // Control: segment start, followed by "L4CB" and a version byte
+#define LOG_BIN_CONTEXT 0x02      // Control: flags, prefix and date format
+#define LOG_BIN_TAG_TABLE 0x03    // Control: tag names
+#define LOG_BIN_FORMAT_DEF 0x04   // Control: format table entry
+#define LOG_BIN_VERSION 1
+#define LOG_BIN_SEGMENT_SIZE 7    // Size of the segment start record
+#define LOG_BIN_SHOW_THREAD 0x01  // Context flag: lines show the thread id
+#define LOG_BIN_SHOW_PROCESS 0x02 // Context flag: lines show the process id
+#define LOG_BIN_SHOW_SEQUENCE 0x04 // Context flag: lines show the sequence number
+#define LOG_BIN_MAX_RECORD (2 * LOG_MAX_LINE_LENGTH) // Space reserved for one record in a frame block
+#define LOG_BIN_STR_LITERAL 1     // String argument: inline text
+#define LOG_BIN_STR_DEFINE 2      // String argument: inline text, added to the dictionary
+#define LOG_BIN_STR_REF 3         // String argument: dictionary entry
+#define LOG_BIN_DICT_SIZE 256     // Entries in the per-segment string dictionary
+#define LOG_BIN_DICT_MAX_STRING 64 // Longest string kept in the dictionary
+#define LOG_BIN_SEEN_SIZE 1024    // Hashes of recent strings, to define only repeated ones
+#define LOG_BIN_MAX_FORMATS 1024  // Entries in the per-segment format table
+#define LOG_BIN_FORMAT_SLOTS 2048 // Hash slots for looking up format table entries
+#define LOG_BIN_FORMAT_ARENA 65536 // Bytes of format strings and file names per segment
+
+enum LogFileFormat {
+    LOG_FORMAT_TEXT,  // Rendered text lines (default)
+    LOG_FORMAT_BINARY // Binary records, rendered by tools/logcat
+};
+
+enum LogArgType {
+    LOG_ARG_NONE,     // No argument (%% or an unknown conversion)
+    LOG_ARG_INT,      // int (also char and short, which are promoted)
+    LOG_ARG_LONG,     // long
+    LOG_ARG_LLONG,    // long long
+    LOG_ARG_SSIZE,    // signed size_t (%zd)
+    LOG_ARG_INTMAX,   // intmax_t
+    LOG_ARG_PTRDIFF,  // ptrdiff_t
+    LOG_ARG_UINT,     // unsigned int
+    LOG_ARG_ULONG,    // unsigned long
+    LOG_ARG_ULLONG,   // unsigned long long
+    LOG_ARG_SIZE,     // size_t
+    LOG_ARG_UINTMAX,  // uintmax_t
+    LOG_ARG_DOUBLE,   // double
+    LOG_ARG_LDOUBLE,  // long double (stored as double)
+    LOG_ARG_STRING,   // const char *
+    LOG_ARG_POINTER,  // void *
+    LOG_ARG_COUNT     // %n; consumed but never written through
+};
+
+struct LogFormatSpec {
+    const char *start;    // The '%' that starts the conversion
+    size_t len;           // Length of the conversion, through its conversion character
+    enum LogArgType type; // Argument the conversion consumes
+    int star_width;       // Width is taken from an int argument
+    int star_precision;   // Precision is taken from an int argument
+    int precision;        // Literal precision, or -1 if there is none (or it is a '*')
+};
+
+/**
+ * @brief Finds the next conversion in a printf format string.
+ *
+ * @param p Position to search from.
+ * @param spec Receives the conversion.
+ * @return Position just past the conversion, or NULL if there are no more.
+ */
+static inline const char *log_format_next(const char *p, struct LogFormatSpec *spec) {
+    p = strchr(p, '%');
+    if (!p)
+        return NULL;
+    const char *q = p + 1;
+    memset(spec, 0, sizeof(*spec));
+    spec->start = p;
+    spec->precision = -1;
+    while (*q && strchr("-+ #0'", *q))
+        q++;
+    if (*q == '*') {
+        spec->star_width = 1;
+        q++;
+    }
+    while (*q >= '0' && *q <= '9')
+        q++;
+    if (*q == '.') {
+        q++;
+        if (*q == '*') {
+            spec->star_precision = 1;
+            q++;
+        } else {
+            spec->precision = 0;
+        }
+        while (*q >= '0' && *q <= '9') {
+            if (spec->precision < INT_MAX / 10)
+                spec->precision = spec->precision * 10 + (*q - '0');
+            q++;
+        }
+    }
+    int size = 0; // -2 hh, -1 h, 0 none, 1 l, 2 ll, 3 z, 4 j, 5 t, 6 L
+    if (q[0] == 'h') {
+        size = q[1] == 'h' ? -2 : -1;
+        q += size == -2 ? 2 : 1;
+    } else if (q[0] == 'l') {
+        size = q[1] == 'l' ? 2 : 1;
+        q += size;
+    } else if (*q == 'q') {
+        size = 2;
+        q++;
+    } else if (*q == 'z' || *q == 'j' || *q == 't' || *q == 'L') {
+        size = *q == 'z' ? 3 : *q == 'j' ? 4 : *q == 't' ? 5 : 6;
+        q++;
+    }
+
+    static const enum LogArgType signed_types[] = {LOG_ARG_INT, LOG_ARG_INT, LOG_ARG_INT, LOG_ARG_LONG, LOG_ARG_LLONG,
+                                                   LOG_ARG_SSIZE, LOG_ARG_INTMAX, LOG_ARG_PTRDIFF, LOG_ARG_LLONG};
+    static const enum LogArgType unsigned_types[] = {LOG_ARG_UINT, LOG_ARG_UINT, LOG_ARG_UINT, LOG_ARG_ULONG, LOG_ARG_ULLONG,
+                                                     LOG_ARG_SIZE, LOG_ARG_UINTMAX, LOG_ARG_SIZE, LOG_ARG_ULLONG};
+    switch (*q) {
+        case 'd':
+        case 'i':
+            spec->type = signed_types[size + 2];
+            break;
+        case 'u':
+        case 'o':
+        case 'x':
+        case 'X':
+            spec->type = unsigned_types[size + 2];
+            break;
+        case 'c':
+            spec->type = size == 1 ? LOG_ARG_UINT : LOG_ARG_INT; // %lc takes a wint_t
+            break;
+        case 'f':
+        case 'F':
+        case 'e':
+        case 'E':
+        case 'g':
+        case 'G':
+        case 'a':
+        case 'A':
+            spec->type = size == 6 ? LOG_ARG_LDOUBLE : LOG_ARG_DOUBLE;
+            break;
+        case 's':
+            spec->type = size == 1 ? LOG_ARG_POINTER : LOG_ARG_STRING; // Wide strings are not captured
+            break;
+        case 'p':
+            spec->type = LOG_ARG_POINTER;
+            break;
+        case 'n':
+            spec->type = LOG_ARG_COUNT;
+            break;
+        default:
+            spec->type = LOG_ARG_NONE; // %% and unknown conversions consume nothing
+            break;
+    }
+    if (*q)
+        q++;
+    spec->len = (size_t)(q - p);
+    return q;
+}
+
+struct LogByteWriter {
+    unsigned char *p;   // Next byte to write
+    unsigned char *end; // End of the buffer
+    int overflow;       // Set once a write did not fit
+};
+
+static inline void log_put_bytes(struct LogByteWriter *w, const void *data, size_t len) {
+    if ((size_t)(w->end - w->p) < len) {
+        w->overflow = 1;
+        w->p = w->end;
+        return;
+    }
+    memcpy(w->p, data, len);
+    w->p += len;
+}
+
+static inline void log_put_byte(struct LogByteWriter *w, unsigned char b) {
+    log_put_bytes(w, &b, 1);
+}
+
+static inline void log_put_varint(struct LogByteWriter *w, uint64_t v) {
+    unsigned char buf[10];
+    size_t n = 0;
+    while (v >= 0x80) {
+        buf[n++] = (unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+    buf[n++] = (unsigned char)v;
+    log_put_bytes(w, buf, n);
+}
+
+static inline uint64_t log_zigzag(int64_t v) {
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static inline int64_t log_unzigzag(uint64_t v) {
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+static inline void log_put_string(struct LogByteWriter *w, const char *s, size_t len) {
+    log_put_varint(w, len);
+    log_put_bytes(w, s, len);
+}
+
+struct LogByteReader {
+    const unsigned char *p;   // Next byte to read
+    const unsigned char *end; // End of the available input
+    int short_read;           // Set once a read ran past the end
+};
+
+static inline uint64_t log_get_varint(struct LogByteReader *r) {
+    uint64_t v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (r->p >= r->end) {
+            r->short_read = 1;
+            return 0;
+        }
+        unsigned char b = *r->p++;
+        v |= (uint64_t)(b & 0x7F) << shift;
+        if (!(b & 0x80))
+            return v;
+    }
+    r->short_read = 1; // Over-long varint: treat like running out of input
+    return 0;
+}
+
+static inline const unsigned char *log_get_bytes(struct LogByteReader *r, size_t len) {
+    if ((size_t)(r->end - r->p) < len) {
+        r->short_read = 1;
+        r->p = r->end;
+        return NULL;
+    }
+    const unsigned char *p = r->p;
+    r->p += len;
+    return p;
+}
+
+/**
+ * @brief Returns the display name of a log level.
+ */
+static inline const char *log_level_name(int level) {
+    switch (level) {
+        case DEBUG:
+            return "DEBUG";
+        case INFO:
+            return "INFO";
+        case SUCCESS:
+            return "SUCCESS";
+        case WARNING:
+            return "WARNING";
+        case ERROR:
+            return "ERROR";
+        default:
+            return "UNKNOWN";
+    }
+}
+
+/**
+ * @brief Renders one conversion of a decoded record.
+ *
+ * The conversion is copied out of the format and handed to snprintf() with the
+ * argument converted back to the type its length modifier expects.
+ */
+static inline int log_render_arg(char *out, size_t room, const struct LogFormatSpec *spec, int width, int precision,
+                                 uint64_t u, double d, const char *s) {
+    char conv[32];
+    size_t n = spec->len < sizeof(conv) - 1 ? spec->len : sizeof(conv) - 1;
+    memcpy(conv, spec->start, n);
+    conv[n] = '\0';
+
+#define LOG_RENDER(value) \
+    (spec->star_width && spec->star_precision ? snprintf(out, room, conv, width, precision, value) \
+     : spec->star_width                       ? snprintf(out, room, conv, width, value)            \
+     : spec->star_precision                   ? snprintf(out, room, conv, precision, value)        \
+                                              : snprintf(out, room, conv, value))
+    switch (spec->type) {
+        case LOG_ARG_INT: return LOG_RENDER((int)(int64_t)u);
+        case LOG_ARG_LONG: return LOG_RENDER((long)(int64_t)u);
+        case LOG_ARG_LLONG: return LOG_RENDER((long long)(int64_t)u);
+        case LOG_ARG_SSIZE: return LOG_RENDER((ssize_t)(int64_t)u);
+        case LOG_ARG_INTMAX: return LOG_RENDER((intmax_t)(int64_t)u);
+        case LOG_ARG_PTRDIFF: return LOG_RENDER((ptrdiff_t)(int64_t)u);
+        case LOG_ARG_UINT: return LOG_RENDER((unsigned int)u);
+        case LOG_ARG_ULONG: return LOG_RENDER((unsigned long)u);
+        case LOG_ARG_ULLONG: return LOG_RENDER((unsigned long long)u);
+        case LOG_ARG_SIZE: return LOG_RENDER((size_t)u);
+        case LOG_ARG_UINTMAX: return LOG_RENDER((uintmax_t)u);
+        case LOG_ARG_DOUBLE: return LOG_RENDER(d);
+        case LOG_ARG_LDOUBLE: return LOG_RENDER((long double)d);
+        case LOG_ARG_STRING: return LOG_RENDER(s);
+        case LOG_ARG_POINTER: return snprintf(out, room, "%p", (void *)(uintptr_t)u); // Also %ls, which is not captured
+        default: return 0;
+    }
+#undef LOG_RENDER
+}
+
+
+/*
+ * Argument capture.
+ *
+ * A capture holds everything needed to render a message later: the format
+ * pointer, time, ids and the arguments serialized as 8-byte values (strings are
+ * copied). Binary records are transcoded from captures when they are written,
+ * so the delta state always matches what is actually in the file.
+ */
+
+struct LogCapture {
+    const char *format;     // Format string (not copied; must outlive the capture)
+    const char *file;       // Source file of the call, or NULL (not copied)
+    int line;               // Source line of the call
+    long long us;           // Wall-clock time in microseconds since the epoch
+    unsigned long thread;   // pthread_self() of the caller
+    int process;            // getpid() of the caller
+    unsigned long long seq; // Sequence number within the calling thread (0 = not numbered)
+    int level;              // Log level
+    unsigned int args_len;  // Bytes of serialized arguments following the header
+};
+
+#define LOG_CAPTURE_NULL 0xFFFFFFFFU // String length marking a NULL %s argument
+
+static inline void log_capture_put64(struct LogByteWriter *w, uint64_t v) {
+    log_put_bytes(w, &v, sizeof(v));
+}
+
+static inline uint64_t log_capture_get64(struct LogByteReader *r) {
+    uint64_t v = 0;
+    const unsigned char *p = log_get_bytes(r, sizeof(v));
+    if (p)
+        memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+/**
+ * @brief Serializes the arguments of a format string.
+ *
+ * @return Number of bytes written, or -1 if they do not fit.
+ */
+static inline int log_capture_args(unsigned char *out, size_t cap, const char *format, va_list args) {
+    struct LogByteWriter w = {out, out + cap, 0};
+    struct LogFormatSpec spec;
+    const char *p = format;
+
+    while ((p = log_format_next(p, &spec)) != NULL) {
+        if (spec.star_width)
+            log_capture_put64(&w, (uint64_t)(int64_t)va_arg(args, int));
+        if (spec.star_precision) {
+            spec.precision = va_arg(args, int); // Negative means none, as in printf
+            log_capture_put64(&w, (uint64_t)(int64_t)spec.precision);
+        }
+        switch (spec.type) {
+            case LOG_ARG_INT: log_capture_put64(&w, (uint64_t)(int64_t)va_arg(args, int)); break;
+            case LOG_ARG_LONG: log_capture_put64(&w, (uint64_t)(int64_t)va_arg(args, long)); break;
+            case LOG_ARG_LLONG: log_capture_put64(&w, (uint64_t)(int64_t)va_arg(args, long long)); break;
+            case LOG_ARG_SSIZE: log_capture_put64(&w, (uint64_t)(int64_t)va_arg(args, ssize_t)); break;
+            case LOG_ARG_INTMAX: log_capture_put64(&w, (uint64_t)(int64_t)va_arg(args, intmax_t)); break;
+            case LOG_ARG_PTRDIFF: log_capture_put64(&w, (uint64_t)(int64_t)va_arg(args, ptrdiff_t)); break;
+            case LOG_ARG_UINT: log_capture_put64(&w, (uint64_t)va_arg(args, unsigned int)); break;
+            case LOG_ARG_ULONG: log_capture_put64(&w, (uint64_t)va_arg(args, unsigned long)); break;
+            case LOG_ARG_ULLONG: log_capture_put64(&w, (uint64_t)va_arg(args, unsigned long long)); break;
+            case LOG_ARG_SIZE: log_capture_put64(&w, (uint64_t)va_arg(args, size_t)); break;
+            case LOG_ARG_UINTMAX: log_capture_put64(&w, (uint64_t)va_arg(args, uintmax_t)); break;
+            case LOG_ARG_POINTER: log_capture_put64(&w, (uint64_t)(uintptr_t)va_arg(args, void *)); break;
+            case LOG_ARG_COUNT: (void)va_arg(args, void *); break;
+            case LOG_ARG_DOUBLE:
+            case LOG_ARG_LDOUBLE: {
+                double d = spec.type == LOG_ARG_DOUBLE ? va_arg(args, double) : (double)va_arg(args, long double);
+                uint64_t bits;
+                memcpy(&bits, &d, sizeof(bits));
+                log_capture_put64(&w, bits);
+                break;
+            }
+            case LOG_ARG_STRING: {
+                const char *s = va_arg(args, const char *);
+                // With a precision the string need not be terminated: read no further than printf would
+                uint32_t len = !s ? LOG_CAPTURE_NULL
+                               : spec.precision >= 0 ? (uint32_t)strnlen(s, (size_t)spec.precision)
+                                                     : (uint32_t)strlen(s);
+                log_put_bytes(&w, &len, sizeof(len));
+                if (s)
+                    log_put_bytes(&w, s, len);
+                break;
+            }
+            default:
+                break;
+        }
+        if (w.overflow)
+            return -1;
+    }
+    return (int)(w.p - out);
+}
+
+/**
+ * @brief Captures a message for rendering or encoding later.
+ *
+ * @param out Buffer receiving the struct LogCapture header followed by the arguments.
+ * @param cap Capacity of out.
+ * @param file Source file of the call, or NULL.
+ * @param line Source line of the call.
+ * @return Size of the capture, or -1 if the arguments do not fit.
+ */
+static inline int log_capture(unsigned char *out, size_t cap, int level, long long us, unsigned long thread, int process,
+                              const char *file, int line, const char *format, va_list args) {
+    if (cap < sizeof(struct LogCapture))
+        return -1;
+    int args_len = log_capture_args(out + sizeof(struct LogCapture), cap - sizeof(struct LogCapture), format, args);
+    if (args_len < 0)
+        return -1;
+    struct LogCapture c;
+    c.format = format;
+    c.file = file;
+    c.line = line;
+    c.us = us;
+    c.thread = thread;
+    c.process = process;
+    c.seq = 0;
+    c.level = level;
+    c.args_len = (unsigned int)args_len;
+    memcpy(out, &c, sizeof(c));
+    return (int)sizeof(c) + args_len;
+}
+
+static inline int log_capturef(unsigned char *out, size_t cap, int level, long long us, unsigned long thread, int process,
+                               const char *file, int line, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    int len = log_capture(out, cap, level, us, thread, process, file, line, format, args);
+    va_end(args);
+    return len;
+}
+
+/**
+ * @brief Renders a captured message (format and arguments) into text.
+ *
+ * @param format Format string.
+ * @param args Serialized arguments.
+ * @param args_len Size of the arguments.
+ * @param out Output buffer.
+ * @param cap Capacity of out.
+ * @return Length of the text (truncated to fit), or -1 if the arguments are malformed.
+ */
+static inline int log_render_message(const char *format, const unsigned char *args, size_t args_len, char *out, size_t cap) {
+    struct LogByteReader r = {args, args + args_len, 0};
+    struct LogFormatSpec spec;
+    const char *p = format;
+    const char *next;
+    size_t len = 0;
+
+    while ((next = log_format_next(p, &spec)) != NULL) {
+        size_t literal = (size_t)(spec.start - p);
+        if (literal > cap - 1 - len)
+            literal = cap - 1 - len;
+        memcpy(out + len, p, literal);
+        len += literal;
+        p = next;
+
+        int width = spec.star_width ? (int)(int64_t)log_capture_get64(&r) : 0;
+        int precision = spec.star_precision ? (int)(int64_t)log_capture_get64(&r) : 0;
+        uint64_t u = 0;
+        double d = 0;
+        const char *s = NULL;
+        char sbuf[LOG_MAX_LINE_LENGTH];
+        if (spec.type == LOG_ARG_NONE) {
+            if (spec.len == 2 && spec.start[1] == '%' && len < cap - 1)
+                out[len++] = '%';
+            continue;
+        } else if (spec.type == LOG_ARG_COUNT) {
+            continue;
+        } else if (spec.type == LOG_ARG_STRING) {
+            uint32_t sl = LOG_CAPTURE_NULL;
+            const unsigned char *b = log_get_bytes(&r, sizeof(sl));
+            if (b)
+                memcpy(&sl, b, sizeof(sl));
+            if (sl != LOG_CAPTURE_NULL && (b = log_get_bytes(&r, sl)) != NULL) {
+                size_t n = sl < sizeof(sbuf) - 1 ? sl : sizeof(sbuf) - 1;
+                memcpy(sbuf, b, n);
+                sbuf[n] = '\0';
+                s = sbuf;
+            }
+        } else {
+            u = log_capture_get64(&r);
+            memcpy(&d, &u, sizeof(d));
+        }
+        if (r.short_read)
+            return -1;
+        int n = log_render_arg(out + len, cap - len, &spec, width, precision, u, d, s);
+        if (n > 0)
+            len = (size_t)n < cap - 1 - len ? len + (size_t)n : cap - 1;
+    }
+    size_t rest = strlen(p);
+    if (rest > cap - 1 - len)
+        rest = cap - 1 - len;
+    memcpy(out + len, p, rest);
+    len += rest;
+    out[len] = '\0';
+    return (int)len;
+}
+
+/**
+ * @brief Per-segment dictionary of repeated string arguments.
+ */
+struct LogStringDict {
+    unsigned char used[LOG_BIN_DICT_SIZE];   // Entry holds a string
+    unsigned char len[LOG_BIN_DICT_SIZE];    // Length of each entry
+    char str[LOG_BIN_DICT_SIZE][LOG_BIN_DICT_MAX_STRING];
+    uint32_t seen[LOG_BIN_SEEN_SIZE];        // Hashes of strings written as literals (writer only)
+};
+
+struct LogFormatEntry {
+    const char *format; // Format pointer the entry was made for
+    const char *file;   // Source file pointer of the call
+    int line;           // Source line of the call
+    unsigned len;       // Length of the format
+    unsigned offset;    // Copy of the format in the table's arena
+};
+
+/**
+ * @brief Per-segment table of format strings (writer side), keyed by call site.
+ */
+struct LogFormatTable {
+    int count;          // Entries defined in this segment
+    size_t arena_len;   // Bytes of the arena charged to entries
+    uint16_t slots[LOG_BIN_FORMAT_SLOTS]; // Entry index + 1, or 0 for an empty slot
+    struct LogFormatEntry entries[LOG_BIN_MAX_FORMATS];
+    char arena[LOG_BIN_FORMAT_ARENA];
+};
+
+/**
+ * @brief Format table entry as seen by the reader.
+ */
+struct LogFormatDef {
+    unsigned format;    // Offset of the format in the decoder's arena
+    unsigned file;      // Offset of the source file name
+    int line;           // Source line
+    int level;          // Level of the first record that used the entry
+};
+
+static inline uint32_t log_string_hash(const unsigned char *s, size_t len) {
+    uint32_t h = 2166136261U;
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ s[i]) * 16777619U;
+    return h;
+}
+
+/**
+ * @brief Writer-side state of the binary format: what the file already established.
+ */
+struct LogBinaryState {
+    int need_segment;          // Next record must be preceded by a segment start
+    long long prev_us;         // Timestamp of the previous record
+    unsigned long prev_thread; // Thread id of the previous record
+    int prev_process;          // Process id of the previous record
+    unsigned prev_tags;        // Tag mask of the previous record
+    unsigned long long prev_seq; // Sequence number of the previous record
+    int tags_sent;             // Number of tags in the last tag table written (-1 = none)
+    unsigned context_sent;     // Logger context version in the last context record
+    int context_valid;         // A context record was written in this segment
+};
+
+/**
+ * @brief Reader-side state of the binary format.
+ */
+struct LogBinaryDecoder {
+    long long prev_us;         // Timestamp of the previous record
+    unsigned long thread;      // Thread id of the previous record
+    int process;               // Process id of the previous record
+    unsigned tags;             // Tag mask of the previous record
+    unsigned long long seq;    // Sequence number of the previous record
+    int num_tags;              // Entries in tag_names
+    char tag_names[MAX_TAGS][MAX_TAG_LENGTH];
+    int flags;                 // LOG_BIN_SHOW_* flags
+    char prefix[256];          // Message prefix
+    char date_format[64];      // strftime() format for the timestamp
+    long long last_us;         // Timestamp of the last record decoded
+    int last_level;            // Level of the last record decoded
+    struct LogStringDict strings; // String dictionary of the current segment
+    int num_formats;           // Entries in the format table of the current segment
+    size_t formats_len;        // Bytes used in format_arena
+    struct LogFormatDef formats[LOG_BIN_MAX_FORMATS];
+    char format_arena[LOG_BIN_FORMAT_ARENA];
+    const char *last_file;     // Source file of the last record decoded ("" if unknown)
+    int last_line;             // Source line of the last record decoded
+    char inline_format[LOG_MAX_LINE_LENGTH]; // Format of the last record that carried it inline
+};
+
+void log_binary_decoder_init(struct LogBinaryDecoder *d) {
+    memset(d, 0, sizeof(*d));
+    strcpy(d->date_format, "%Y-%m-%d %H:%M:%S");
+    d->last_file = "";
+}
+
+/**
+ * @brief Checks whether bytes start with a binary segment start record.
+ */
+static inline int log_binary_is_segment(const unsigned char *p, size_t len) {
+    return len >= LOG_BIN_SEGMENT_SIZE && p[0] == LOG_BIN_CONTROL && p[1] == LOG_BIN_SEGMENT && memcmp(p + 2, "L4CB", 4) == 0;
+}
+
+/**
+ * @brief Finds the first binary segment start in a run of bytes.
+ *
+ * @return Offset of the segment, or len if there is none.
+ */
+static inline size_t log_find_segment(const unsigned char *p, size_t len) {
+    for (size_t i = 0; i + LOG_BIN_SEGMENT_SIZE <= len; i++) {
+        if (p[i] == LOG_BIN_CONTROL && log_binary_is_segment(p + i, len - i))
+            return i;
+    }
+    return len;
+}
+
+static inline void log_get_cstring(struct LogByteReader *r, char *out, size_t cap) {
+    size_t len = (size_t)log_get_varint(r);
+    const unsigned char *s = log_get_bytes(r, len);
+    if (!s) {
+        out[0] = '\0';
+        return;
+    }
+    size_t n = len < cap - 1 ? len : cap - 1;
+    memcpy(out, s, n);
+    out[n] = '\0';
+}
+
+/**
+ * @brief Converts the varint-encoded arguments of a record back into capture form.
+ *
+ * @return Size of the captured arguments, or -1 if the record is incomplete or
+ *         (without r->short_read set) refers to an unknown string.
+ */
+static inline int log_binary_read_args(struct LogBinaryDecoder *d, struct LogByteReader *r, const char *format,
+                                       unsigned char *out, size_t cap) {
+    struct LogByteWriter w = {out, out + cap, 0};
+    struct LogFormatSpec spec;
+    const char *p = format;
+
+    while ((p = log_format_next(p, &spec)) != NULL) {
+        if (spec.star_width)
+            log_capture_put64(&w, (uint64_t)log_unzigzag(log_get_varint(r)));
+        if (spec.star_precision)
+            log_capture_put64(&w, (uint64_t)log_unzigzag(log_get_varint(r)));
+        switch (spec.type) {
+            case LOG_ARG_NONE:
+            case LOG_ARG_COUNT:
+                break;
+            case LOG_ARG_INT: case LOG_ARG_LONG: case LOG_ARG_LLONG:
+            case LOG_ARG_SSIZE: case LOG_ARG_INTMAX: case LOG_ARG_PTRDIFF:
+                log_capture_put64(&w, (uint64_t)log_unzigzag(log_get_varint(r)));
+                break;
+            case LOG_ARG_DOUBLE:
+            case LOG_ARG_LDOUBLE: {
+                const unsigned char *b = log_get_bytes(r, 8);
+                log_capture_put64(&w, b ? log_get_le64(b) : 0);
+                break;
+            }
+            case LOG_ARG_STRING: {
+                uint64_t v = log_get_varint(r);
+                uint32_t len = LOG_CAPTURE_NULL;
+                const unsigned char *b = NULL;
+                if ((v & 3) == LOG_BIN_STR_REF) {
+                    if ((v >> 2) >= LOG_BIN_DICT_SIZE || !d->strings.used[v >> 2])
+                        return -1;
+                    len = d->strings.len[v >> 2];
+                    b = (const unsigned char *)d->strings.str[v >> 2];
+                } else if (v != 0) {
+                    len = (uint32_t)(v >> 2);
+                    b = log_get_bytes(r, len);
+                    if ((v & 3) == LOG_BIN_STR_DEFINE && b && len <= LOG_BIN_DICT_MAX_STRING) {
+                        uint32_t slot = log_string_hash(b, len) % LOG_BIN_DICT_SIZE;
+                        d->strings.used[slot] = 1;
+                        d->strings.len[slot] = (unsigned char)len;
+                        memcpy(d->strings.str[slot], b, len);
+                    }
+                }
+                log_put_bytes(&w, &len, sizeof(len));
+                if (b)
+                    log_put_bytes(&w, b, len);
+                break;
+            }
+            default:
+                log_capture_put64(&w, log_get_varint(r));
+                break;
+        }
+        if (r->short_read)
+            return -1;
+    }
+    return w.overflow ? -1 : (int)(w.p - out);
+}
+
+/**
+ * @brief Decodes one binary record back into a capture, as log_capture() would have made it.
+ *
+ * The capture's format and file point into the decoder and stay valid until the
+ * next record is decoded.
+ *
+ * @param d Decoder state.
+ * @param p Input bytes, starting at a record.
+ * @param n Number of input bytes available.
+ * @param capture Receives the capture.
+ * @param cap Capacity of capture.
+ * @param consumed Receives the number of input bytes used.
+ * @return Size of the capture, 0 for a control record, -1 if the record is
+ *         incomplete, or -2 if it is corrupt.
+ */
+long log_binary_decode_capture(struct LogBinaryDecoder *d, const unsigned char *p, size_t n, unsigned char *capture,
+                               size_t cap, size_t *consumed) {
+    struct LogByteReader r = {p, p + n, 0};
+    if (n == 0)
+        return -1;
+    unsigned char header = *r.p++;
+
+    if (header == LOG_BIN_CONTROL) {
+        if (r.p >= r.end)
+            return -1;
+        unsigned char type = *r.p++;
+        if (type == LOG_BIN_SEGMENT) {
+            const unsigned char *magic = log_get_bytes(&r, 5);
+            if (!magic)
+                return -1;
+            if (memcmp(magic, "L4CB", 4) != 0 || magic[4] != LOG_BIN_VERSION)
+                return -2;
+            log_binary_decoder_init(d);
+        } else if (type == LOG_BIN_CONTEXT) {
+            const unsigned char *flags = log_get_bytes(&r, 1);
+            log_get_cstring(&r, d->prefix, sizeof(d->prefix));
+            log_get_cstring(&r, d->date_format, sizeof(d->date_format));
+            if (flags)
+                d->flags = *flags;
+        } else if (type == LOG_BIN_TAG_TABLE) {
+            uint64_t count = log_get_varint(&r);
+            if (count > MAX_TAGS)
+                return -2;
+            for (uint64_t i = 0; i < count; i++)
+                log_get_cstring(&r, d->tag_names[i], MAX_TAG_LENGTH);
+            d->num_tags = (int)count;
+        } else if (type == LOG_BIN_FORMAT_DEF) {
+            uint64_t id = log_get_varint(&r);
+            const unsigned char *level = log_get_bytes(&r, 1);
+            size_t file_len = (size_t)log_get_varint(&r);
+            const unsigned char *file = log_get_bytes(&r, file_len);
+            int line = (int)log_get_varint(&r);
+            size_t format_len = (size_t)log_get_varint(&r);
+            const unsigned char *format = log_get_bytes(&r, format_len);
+            if (r.short_read)
+                return -1;
+            if (id != (uint64_t)d->num_formats || id >= LOG_BIN_MAX_FORMATS ||
+                d->formats_len + file_len + format_len + 2 > LOG_BIN_FORMAT_ARENA)
+                return -2;
+            struct LogFormatDef *def = &d->formats[d->num_formats++];
+            def->format = (unsigned)d->formats_len;
+            memcpy(d->format_arena + d->formats_len, format, format_len);
+            d->format_arena[d->formats_len + format_len] = '\0';
+            def->file = (unsigned)(d->formats_len + format_len + 1);
+            memcpy(d->format_arena + def->file, file, file_len);
+            d->format_arena[def->file + file_len] = '\0';
+            d->formats_len += file_len + format_len + 2;
+            def->line = line;
+            def->level = *level;
+        } else {
+            return -2;
+        }
+        if (r.short_read)
+            return -1;
+        *consumed = (size_t)(r.p - p);
+        return 0;
+    }
+
+    int level = header & LOG_BIN_LEVEL_MASK;
+    if (level > ERROR || (header & 0x80))
+        return -2;
+    long long us = d->prev_us + log_unzigzag(log_get_varint(&r));
+    unsigned long thread = header & LOG_BIN_THREAD ? (unsigned long)log_get_varint(&r) : d->thread;
+    unsigned tags = header & LOG_BIN_TAGS ? (unsigned)log_get_varint(&r) : d->tags;
+    int process = header & LOG_BIN_PROCESS ? (int)log_get_varint(&r) : d->process;
+    unsigned long long seq = header & LOG_BIN_SEQUENCE ? (unsigned long long)log_get_varint(&r) : d->seq + 1;
+    uint64_t format_ref = log_get_varint(&r);
+    const char *format = d->inline_format;
+    const char *file = "";
+    int line = 0;
+    if (format_ref == 0) {
+        log_get_cstring(&r, d->inline_format, sizeof(d->inline_format));
+    } else if (format_ref <= (uint64_t)d->num_formats) {
+        const struct LogFormatDef *def = &d->formats[format_ref - 1];
+        format = d->format_arena + def->format;
+        file = d->format_arena + def->file;
+        line = def->line;
+    } else if (!r.short_read) {
+        return -2;
+    }
+    if (r.short_read || cap < sizeof(struct LogCapture))
+        return -1;
+
+    int args_len = log_binary_read_args(d, &r, format, capture + sizeof(struct LogCapture), cap - sizeof(struct LogCapture));
+    if (args_len < 0)
+        return r.short_read ? -1 : -2;
+
+    d->prev_us = us;
+    d->thread = thread;
+    d->tags = tags;
+    d->process = process;
+    d->seq = seq;
+    d->last_us = us;
+    d->last_level = level;
+    d->last_file = file;
+    d->last_line = line;
+    *consumed = (size_t)(r.p - p);
+
+    struct LogCapture c;
+    c.format = format;
+    c.file = file;
+    c.line = line;
+    c.us = us;
+    c.thread = thread;
+    c.process = process;
+    c.seq = d->flags & LOG_BIN_SHOW_SEQUENCE ? seq : 0;
+    c.level = level;
+    c.args_len = (unsigned int)args_len;
+    memcpy(capture, &c, sizeof(c));
+    return (long)sizeof(c) + args_len;
+}
+
+/**
+ * @brief Decodes one binary record into a text line formatted like log_message() output.
+ *
+ * @param d Decoder state.
+ * @param p Input bytes, starting at a record.
+ * @param n Number of input bytes available.
+ * @param out Receives the line, including its newline.
+ * @param cap Capacity of out.
+ * @param consumed Receives the number of input bytes used.
+ * @return Length of the line, 0 for a control record (nothing to print), -1 if the
+ *         record is incomplete, or -2 if it is corrupt.
+ */
+long log_binary_decode(struct LogBinaryDecoder *d, const unsigned char *p, size_t n, char *out, size_t cap, size_t *consumed) {
+    unsigned char capture[LOG_MAX_LINE_LENGTH];
+    long captured = log_binary_decode_capture(d, p, n, capture, sizeof(capture), consumed);
+    if (captured <= 0)
+        return captured;
+    struct LogCapture c;
+    memcpy(&c, capture, sizeof(c));
+    char message[LOG_MAX_LINE_LENGTH];
+    if (log_render_message(c.format, capture + sizeof(c), c.args_len, message, sizeof(message)) < 0)
+        return -2;
+
+    time_t seconds = (time_t)(c.us / 1000000);
+    struct tm tm;
+    char time_buffer[64];
+    localtime_r(&seconds, &tm);
+    strftime(time_buffer, sizeof(time_buffer), d->date_format, &tm);
+
+    int len = snprintf(out, cap, "%s | %s %s", time_buffer, log_level_name(c.level), d->prefix);
+    if ((d->flags & LOG_BIN_SHOW_THREAD) && len < (int)cap)
+        len += snprintf(out + len, cap - len, " | Thread ID: %lu", c.thread);
+    if ((d->flags & LOG_BIN_SHOW_PROCESS) && len < (int)cap)
+        len += snprintf(out + len, cap - len, " | Process ID: %d", c.process);
+    if ((d->flags & LOG_BIN_SHOW_SEQUENCE) && len < (int)cap)
+        len += snprintf(out + len, cap - len, " | Seq: %llu", c.seq);
+    if (len < (int)cap)
+        len += snprintf(out + len, cap - len, " | %s", message);
+    if (len > (int)cap - 2)
+        len = (int)cap - 2;
+    out[len++] = '\n';
+    out[len] = '\0';
+    return len;
+}
+
+struct LogFramer;
+
+#define LOG_MAX_CPUS 1024 // CPUs a writer affinity mask can name
+#define LOG_PAGES_HUGE 1  // Back a ring buffer with huge pages where possible
+#define LOG_PAGES_POPULATE 2 // Fault a ring buffer in when it is mapped
+
+struct Logger {
+    enum LogLevel console_level; // Minimum log level for console output
+    enum LogLevel file_level;    // Minimum log level for file output
+    FILE *file;                  // Log file pointer
+    char *file_path;             // Log file path
+    char *date_format;           // Date format for log entries
+    char *prefix;                // Custom log message prefix
+    int log_to_file;             // Flag indicating whether logging to file is enabled (1) or not (0)
+    int include_thread_id;       // Flag indicating whether to include thread ID in log messages (1) or not (0)
+    int include_process_id;      // Flag indicating whether to include process ID in log messages (1) or not (0)
+    int include_sequence;        // Flag indicating whether to include the per-thread sequence number in log messages (1) or not (0)
+    pthread_key_t seq_key;       // Finds the calling thread's sequence counter (created along with seq_slots)
+    struct LogSeqCounter *seq_slots; // LOG_SEQ_SLOTS counters for threads to claim (NULL until sequences are first on)
+    unsigned seq_hint;           // Where the next thread starts looking for a free slot
+    unsigned long long seq_shared; // Fallback sequence counter for threads without one of their own
+    char tags[MAX_TAGS][MAX_TAG_LENGTH]; // Array to store tags
+    int num_tags;                // Number of tags currently stored
+    enum LogCachePolicy cache_policy; // Page-cache policy for the log file
+    long cache_drop_chunk;       // Bytes to accumulate before syncing and dropping a range
+    long long cache_synced_offset; // File offset up to which pages were already dropped
+    long long cache_written_offset; // File offset up to which writeback was started
+    pthread_mutex_t file_lock;   // Serializes writes and sink state for the log file
+    long throttle_rate;          // File bandwidth cap in bytes per second (0 = unlimited)
+    long throttle_burst;         // Token bucket capacity in bytes
+    double throttle_tokens;      // Bytes that may be written right now (negative = debt)
+    struct timespec throttle_refill; // Last time the token bucket was refilled
+    enum LogLevel throttle_keep_level; // Lines at or above this level are never dropped
+    pthread_cond_t throttle_wake; // Signalled when lines start being deferred or the drain thread should stop
+    pthread_t throttle_thread;   // Writes deferred lines out as the budget refills
+    int throttle_running;        // Flag indicating whether the drain thread runs (1) or not (0)
+    char *deferred;              // Lines held back while over budget
+    size_t deferred_len;         // Bytes currently held in deferred
+    size_t deferred_cap;         // Memory cap for deferred lines
+    unsigned long long deferred_messages; // Lines that were deferred at least once
+    unsigned long long dropped_messages;  // Lines dropped because the memory cap was reached
+    unsigned long long dropped_bytes;     // Bytes dropped because the memory cap was reached
+    long long deferred_first_ms; // Time of the oldest line held in deferred
+    long long deferred_last_ms;  // Time of the newest line held in deferred
+    struct LogFramer *framer;    // Compressed frame pipeline (NULL for plain text output)
+    int rotate_level;            // Compression level for rotated segments (0 = leave as is)
+    FILE *index_file;            // Side index of frame times and offsets (framed output only)
+    int frame_checksum;          // Flag indicating whether file frames carry a CRC32C trailer (1) or not (0)
+    enum LogFileFormat file_format; // Text lines or binary records in the log file
+    struct LogBinaryState bin;   // What the binary records in the file have established so far
+    struct LogStringDict *strings; // Dictionary of repeated string arguments (binary format only)
+    struct LogFormatTable *formats; // Format strings already defined in the current segment (binary format only)
+    unsigned context_version;    // Bumped when the prefix, date format or shown ids change
+    int file_flush;              // Flag indicating whether every write to the log file is flushed (1) or left to stdio buffering (0)
+    struct LogStatsShard *stats; // Producer counters, LOG_STATS_SHARDS shards (NULL if they could not be allocated)
+    unsigned long long rt_id;    // Real-time mode instance, matched by attached threads (0 = off)
+    struct LogRtRing *rt_rings;  // Rings of attached real-time threads
+    pthread_mutex_t rt_lock;     // Guards rt_rings and reading them out
+    pthread_t rt_thread;         // Ring writer
+    int rt_stop;                 // Tells the ring writer to write out the rings and exit
+    size_t rt_ring_size;         // Bytes per ring
+    long rt_poll_us;             // Ring writer sleep between polls
+    int rt_process;              // getpid(), cached for attached threads
+    uint64_t rt_base_cycles;     // log_cycles() at rt_base_ns
+    long long rt_base_ns;        // Wall-clock time of the calibration anchor (ns since the epoch)
+    double rt_ns_per_cycle;      // Calibrated cycle counter period
+    long rt_spin_us;             // Idle ring writer spins this long before yielding
+    long rt_yield_us;            // and then yields this long before sleeping
+    int rt_wake;                 // Producers wake a sleeping ring writer (a futex call) rather than let it time out
+    int rt_sleeping;             // Set while the ring writer sleeps; the futex word producers wake
+    unsigned long writer_cpus[LOG_MAX_CPUS / (8 * sizeof(unsigned long))]; // CPUs writer threads are pinned to
+    int writer_cpus_set;         // Flag indicating whether writer_cpus applies (1) or writers run anywhere (0)
+    int writer_nice;             // Nice value of writer threads (0 = unchanged)
+    int writer_sched_idle;       // Flag indicating whether writer threads run under SCHED_IDLE
+    int writer_io_class;         // I/O priority class of writer threads (0 = unchanged)
+    int writer_io_level;         // I/O priority level within writer_io_class
+    int ring_numa;               // Flag indicating whether real-time rings go on their producer's NUMA node
+    int ring_pages;              // LOG_PAGES_* flags for real-time ring buffers
+    int rt_per_cpu;              // Flag indicating whether real-time mode uses one ring per CPU rather than per thread
+    struct LogRtRing **rt_cpu_rings; // The per-CPU rings, rt_num_cpus of them (also on rt_rings)
+    int rt_num_cpus;             // Number of per-CPU rings
+    long rt_window_us;           // Merge skew window: records are written once this old
+    struct LogRtHead *rt_heap;   // Merge heap of the rings' first records
+    size_t rt_heap_cap;          // Entries rt_heap has room for
+    uint64_t rt_merge_last;      // Timestamp of the latest record written
+    int rt_held;                 // Flag indicating whether the last drain held records back for the window
+    unsigned long long rt_merged; // Records written by the merge
+    unsigned long long rt_merge_late; // Records written after a later one (arrived past the window)
+    unsigned long long rt_merge_ns; // Time spent merging, not counting writing the records (ns)
+    int rt_render_workers;       // Render workers for real-time records (0 = the ring writer renders)
+    struct LogRenderPool *rt_render; // Render pipeline (NULL = the ring writer renders)
+    struct LogRateCounters *rates; // Windowed per-level, per-tag message counts (NULL = off)
+    struct LogSinkCounters sink; // Log file counters
+    char *metrics_path;          // Prometheus text file written by the metrics export (NULL = off)
+    char *metrics_buf;           // Export rendered here before it is written, LOG_METRICS_BUFFER bytes
+    FILE *metrics_out;           // Unbuffered stream over metrics_buf
+    long metrics_interval_ms;    // Time between metrics exports
+    long long metrics_next_ms;   // When the next export is due (ms since the epoch)
+    int metrics_busy;            // Set while a thread is exporting or the export is being reconfigured
+    struct LoggerStats metrics_prev; // Counters at the last export, for rates
+    long long metrics_prev_ms;   // Time of the last export
+};
+
+struct LogThrottleStats {
+    size_t deferred_bytes;                // Bytes currently held back in memory
+    unsigned long long deferred_messages; // Lines that were deferred at least once
+    unsigned long long dropped_messages;  // Lines dropped because the memory cap was reached
+    unsigned long long dropped_bytes;     // Bytes dropped because the memory cap was reached
+};
+
+static char log_stdout_buffer[BUFSIZ]; // Stdout buffer installed by init_logger() when stdio has none yet
+
+/**
+ * @brief Gives stdout a buffer now, so the first console line does not allocate one.
+ *
+ * Only done before anything was written to stdout (when setvbuf() is allowed),
+ * keeping the buffering stdio would have picked: by line on a terminal, full
+ * otherwise. Without <stdio_ext.h> (macOS, the BSDs) that cannot be checked, so
+ * only the first init_logger() of the process sets the buffer; their setvbuf()
+ * may be called after output.
+ */
+static inline void logger_prepare_stdout(void) {
+#ifdef LOG_HAVE_STDIO_EXT
+    if (__fbufsize(stdout) != 0)
+        return; // Already has a buffer, or was made unbuffered
+    int line = __flbf(stdout) || isatty(STDOUT_FILENO);
+#else
+    static int prepared;
+    if (__atomic_exchange_n(&prepared, 1, __ATOMIC_RELAXED))
+        return; // Set once; later loggers leave the program's own choice alone
+    int line = isatty(STDOUT_FILENO);
+#endif
+    setvbuf(stdout, log_stdout_buffer, line ? _IOLBF : _IOFBF, sizeof(log_stdout_buffer));
+}
+
+/**
+ * @brief Opens (or reopens) the log file at logger->file_path in append mode.
+ *
+ * @param logger Pointer to the logger structure.
+ */
+static inline void logger_open_file(struct Logger *logger) {
+    logger->file = fopen(logger->file_path, "a");
+    logger->cache_synced_offset = 0;
+    logger->cache_written_offset = 0;
+    logger->bin.need_segment = 1;
+    if (!logger->file) {
+        fprintf(stderr, "Error opening log file %s\n", logger->file_path);
+        return;
+    }
+    setvbuf(logger->file, NULL, _IOFBF, BUFSIZ); // Allocates the stdio buffer now instead of on the first logged line
+}
+
+/**
+ * @brief Opens the side index "<file>.idx" that accompanies compressed output.
+ *
+ * @param logger Pointer to the logger structure.
+ */
+static inline void logger_open_index(struct Logger *logger) {
+    char index_path[strlen(logger->file_path) + 5]; // For ".idx" suffix
+    snprintf(index_path, sizeof(index_path), "%s.idx", logger->file_path);
+    logger->index_file = fopen(index_path, "a");
+    if (!logger->index_file) {
+        fprintf(stderr, "Error opening log index %s\n", index_path);
+        return;
+    }
+    setvbuf(logger->index_file, NULL, _IOFBF, BUFSIZ); // Allocated now, not by the frame writer
+}
+
+/**
+ * @brief Closes the side index, if open.
+ *
+ * @param logger Pointer to the logger structure.
+ */
+static inline void logger_close_index(struct Logger *logger) {
+    if (logger->index_file)
+        fclose(logger->index_file);
+    logger->index_file = NULL;
+}
+
+/**
+ * @brief Starts writeback of the log file range written since the last call and evicts the range before it.
+ *
+ * Logs are write-once, so keeping them cached only pushes the application's own
+ * working set out of RAM. Nothing happens until at least cache_drop_chunk bytes
+ * have accumulated. Then writeback of the new chunk is started without waiting
+ * for it, and the previous chunk, whose writeback had a whole chunk's time to
+ * finish, is dropped. Pages still being written stay cached, so the caller never
+ * blocks on the disk while it holds file_lock.
+ *
+ * @param logger Pointer to the logger structure.
+ */
+static inline void logger_drop_written_pages(struct Logger *logger) {
+    if (logger->cache_policy != LOG_CACHE_DROP || !logger->file)
+        return;
+
+    off_t end = ftello(logger->file);
+    if (end < 0 || end - logger->cache_written_offset < logger->cache_drop_chunk)
+        return;
+
+    fflush(logger->file); // The range must have reached the kernel before its writeback can start
+    log_stats_add(&logger->sink.syncs, 1);
+    int fd = fileno(logger->file);
+    off_t written = (off_t)logger->cache_written_offset;
+#ifdef __linux__
+    sync_file_range(fd, written, end - written, LOG_SYNC_FILE_RANGE_WRITE);
+#endif
+    // Elsewhere the kernel writes the pages back on its own schedule; those it has written by now are dropped
+#ifdef POSIX_FADV_DONTNEED
+    off_t synced = (off_t)logger->cache_synced_offset;
+    if (written > synced)
+        posix_fadvise(fd, synced, written - synced, POSIX_FADV_DONTNEED);
+#endif
+    logger->cache_synced_offset = (long long)written;
+    // The last page is only partially written and stays cached; it goes out with the next chunk
+    long page_size = sysconf(_SC_PAGESIZE);
+    logger->cache_written_offset = (long long)(end - end % page_size);
+}
+
+/**
+ * @brief Writes bytes to the log file and applies the page-cache policy.
+ *
+ * @param logger Pointer to the logger structure.
+ * @param data Bytes to write.
+ * @param len Number of bytes.
+ */
+static inline void logger_file_write_raw(struct Logger *logger, const char *data, size_t len) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    LOG_STAGE_START(t);
+    fwrite(data, 1, len, logger->file);
+    LOG_STAGE_LAP(t, LOG_STAGE_WRITE);
+    if (logger->file_flush) {
+        fflush(logger->file);
+        log_stats_add(&logger->sink.flushes, 1);
+    }
+    logger_drop_written_pages(logger);
+    LOG_STAGE_LAP(t, LOG_STAGE_FLUSH);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    long long us = (long long)(end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000;
+    int bucket = us > 0 ? 64 - __builtin_clzll((unsigned long long)us) : 0;
+    if (bucket < LOG_LATENCY_BUCKETS) // Slower writes only count in writes, the histogram's +Inf bucket
+        log_stats_add(&logger->sink.write_latency[bucket], 1);
+    log_stats_add(&logger->sink.write_us, (unsigned long long)us);
+    log_stats_add(&logger->sink.writes, 1);
+    log_stats_add(&logger->sink.bytes, len);
+}
+
+enum LogSlotState {
+    LOG_SLOT_FREE,   // Empty, or being filled by producers
+    LOG_SLOT_SEALED, // Full and waiting for a compression worker
+    LOG_SLOT_BUSY,   // Being compressed
+    LOG_SLOT_DONE    // Compressed and waiting for its turn to be written
+};
+
+struct LogFrameSlot {
+    char *raw;             // Block of log text
+    size_t raw_len;        // Bytes used in raw
+    unsigned char *frame;  // Encoded frame for raw
+    size_t frame_len;      // Bytes used in frame
+    long long first_ms;    // Time of the oldest line in raw
+    long long last_ms;     // Time of the newest line in raw
+    enum LogSlotState state;
+};
+
+struct LogFramer {
+    struct Logger *logger;      // Logger whose file receives the frames
+    int level;                  // LZ compression level (0 stores blocks uncompressed)
+    int checksum;               // Append a CRC32C trailer to every frame
+    size_t block_size;          // Raw bytes per frame
+    long flush_ms;              // Seal a partly filled block after this many milliseconds
+    struct LogFrameSlot *slots; // Ring of blocks, in file order
+    int num_slots;              // Number of slots in the ring
+    int fill;                   // Slot producers are appending to
+    int claim;                  // Next sealed slot for a worker to compress
+    int next;                   // Next slot to be written to the file
+    int writing;                // A worker is currently writing frames out in order
+    int stop;                   // Set to ask the workers to exit
+    struct timespec fill_start; // When the first line went into the fill slot
+    pthread_mutex_t lock;       // Protects the slot ring
+    pthread_cond_t work;        // Signalled when a slot is sealed or the workers should stop
+    pthread_cond_t space;       // Signalled when a slot is written and freed
+    int num_workers;            // Number of compression workers
+    int started;                // Number of workers that were started
+    pthread_t *threads;         // Compression workers
+    struct LogLzState **lz;     // Match-finder state, one per worker
+};
+
+struct LogFramerWorker {
+    struct LogFramer *framer;
+    int index;
+};
+
+/**
+ * @brief Hands the fill slot to the compression workers and moves on to the next slot.
+ *
+ * Must be called with framer->lock held.
+ *
+ * @param fr Frame pipeline.
+ * @param wait Block until a free slot is available (1) or give up if none is (0).
+ */
+static inline void logger_framer_seal(struct LogFramer *fr, int wait) {
+    for (;;) {
+        if (fr->slots[fr->fill].raw_len == 0)
+            return;
+        int next_fill = (fr->fill + 1) % fr->num_slots;
+        if (fr->slots[next_fill].state == LOG_SLOT_FREE) {
+            fr->slots[fr->fill].state = LOG_SLOT_SEALED;
+            fr->fill = next_fill;
+            pthread_cond_signal(&fr->work);
+            return;
+        }
+        if (!wait)
+            return;
+        pthread_cond_wait(&fr->space, &fr->lock);
+    }
+}
+
+/**
+ * @brief Writes compressed frames to the file in ring order, as far as they are ready.
+ *
+ * Workers finish out of order; whichever one completes the next slot in line
+ * writes it and any ready slots after it, so the file keeps the original order.
+ * Must be called with framer->lock held.
+ *
+ * @param fr Frame pipeline.
+ */
+static inline void logger_framer_write_ready(struct LogFramer *fr) {
+    if (fr->writing)
+        return;
+    fr->writing = 1;
+    while (fr->slots[fr->next].state == LOG_SLOT_DONE) {
+        struct LogFrameSlot *slot = &fr->slots[fr->next];
+        pthread_mutex_unlock(&fr->lock);
+        struct Logger *logger = fr->logger;
+        long long offset = (long long)ftello(logger->file);
+        logger_file_write_raw(logger, (const char *)slot->frame, slot->frame_len);
+        if (logger->index_file && offset >= 0) {
+            unsigned char entry[LOG_INDEX_ENTRY_SIZE];
+            log_index_encode(entry, slot->first_ms, slot->last_ms, offset, slot->frame_len, slot->raw_len);
+            fwrite(entry, 1, sizeof(entry), logger->index_file);
+            fflush(logger->index_file);
+        }
+        pthread_mutex_lock(&fr->lock);
+        __atomic_fetch_sub(&logger->sink.queued_bytes, slot->raw_len, __ATOMIC_RELAXED);
+        slot->raw_len = 0;
+        slot->state = LOG_SLOT_FREE;
+        fr->next = (fr->next + 1) % fr->num_slots;
+        pthread_cond_broadcast(&fr->space);
+    }
+    fr->writing = 0;
+}
+
+#ifndef IOPRIO_WHO_PROCESS
+#define IOPRIO_WHO_PROCESS 1
+#endif
+#define LOG_IOPRIO_CLASS_SHIFT 13
+#ifdef SCHED_IDLE
+#define LOG_SCHED_IDLE SCHED_IDLE
+#else
+#define LOG_SCHED_IDLE 5 // Linux value; <sched.h> only names it with _GNU_SOURCE
+#endif
+
+/**
+ * @brief Applies the writer placement options to the calling thread.
+ *
+ * Every thread the logger starts to do its writing calls this first, so the
+ * options reach the thread itself: its CPU affinity, nice value, scheduling
+ * class and I/O priority. A setting the system refuses, such as a negative
+ * nice value without the privilege for it, is reported and the rest still apply.
+ */
+static inline void logger_place_writer(struct Logger *logger) {
+    int failed = 0;
+#ifdef __linux__
+    if (logger->writer_cpus_set)
+        failed |= syscall(SYS_sched_setaffinity, 0, sizeof(logger->writer_cpus), logger->writer_cpus) != 0;
+    if (logger->writer_sched_idle) {
+        struct sched_param param = {0};
+        failed |= sched_setscheduler(0, LOG_SCHED_IDLE, &param) != 0;
+    } else if (logger->writer_nice) {
+        // Nice values are per thread on Linux
+        failed |= setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), logger->writer_nice) != 0;
+    }
+    if (logger->writer_io_class)
+        failed |= syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+                          (logger->writer_io_class << LOG_IOPRIO_CLASS_SHIFT) | logger->writer_io_level) != 0;
+#else
+    failed = logger->writer_cpus_set || logger->writer_sched_idle || logger->writer_io_class;
+    if (logger->writer_nice)
+        failed |= setpriority(PRIO_PROCESS, 0, logger->writer_nice) != 0;
+#endif
+    if (failed)
+        fprintf(stderr, "Error applying log writer thread placement\n");
+}
+
+/**
+ * @brief Compression worker: claims sealed blocks in order and compresses them in parallel.
+ */
+static inline int logger_metrics_due(struct Logger *logger, long long now_ms);
+static inline void logger_export_metrics(struct Logger *logger, long long now_ms);
+
+static inline void *logger_framer_main(void *arg) {
+    struct LogFramerWorker *worker = (struct LogFramerWorker *)arg;
+    struct LogFramer *fr = worker->framer;
+    struct LogLzState *lz = fr->lz[worker->index];
+    free(worker);
+    logger_place_writer(fr->logger);
+
+    pthread_mutex_lock(&fr->lock);
+    for (;;) {
+        // The frame writer exports metrics, so producers never have to
+        struct timespec wall;
+        clock_gettime(CLOCK_REALTIME, &wall);
+        long long wall_ms = (long long)wall.tv_sec * 1000 + wall.tv_nsec / 1000000;
+        if (logger_metrics_due(fr->logger, wall_ms)) {
+            pthread_mutex_unlock(&fr->lock);
+            logger_export_metrics(fr->logger, wall_ms);
+            pthread_mutex_lock(&fr->lock);
+        }
+
+        struct LogFrameSlot *slot = &fr->slots[fr->claim];
+        if (slot->state == LOG_SLOT_SEALED) {
+            slot->state = LOG_SLOT_BUSY;
+            fr->claim = (fr->claim + 1) % fr->num_slots;
+            pthread_mutex_unlock(&fr->lock);
+            LOG_STAGE_START(t);
+            slot->frame_len = log_frame_encode(lz, fr->level, slot->raw, slot->raw_len,
+                                               slot->first_ms, slot->last_ms, fr->checksum, slot->frame);
+            LOG_STAGE_LAP(t, LOG_STAGE_COMPRESS);
+            pthread_mutex_lock(&fr->lock);
+            slot->state = LOG_SLOT_DONE;
+            logger_framer_write_ready(fr);
+            continue;
+        }
+        if (fr->stop)
+            break;
+
+        // Nothing sealed: sleep until work arrives or the fill slot is due for a flush
+        struct timespec deadline;
+        if (fr->slots[fr->fill].raw_len > 0) {
+            deadline = fr->fill_start;
+        } else {
+            clock_gettime(CLOCK_MONOTONIC, &deadline);
+        }
+        deadline.tv_sec += fr->flush_ms / 1000;
+        deadline.tv_nsec += (fr->flush_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        if (pthread_cond_timedwait(&fr->work, &fr->lock, &deadline) != 0)
+            logger_framer_seal(fr, 0);
+    }
+    pthread_mutex_unlock(&fr->lock);
+    return NULL;
+}
+
+/**
+ * @brief Frees a frame pipeline after its workers have exited.
+ */
+static inline void logger_framer_free(struct LogFramer *fr) {
+    for (int i = 0; fr->slots && i < fr->num_slots; i++) {
+        free(fr->slots[i].raw);
+        free(fr->slots[i].frame);
+    }
+    for (int i = 0; fr->lz && i < fr->num_workers; i++)
+        free(fr->lz[i]);
+    pthread_cond_destroy(&fr->work);
+    pthread_cond_destroy(&fr->space);
+    pthread_mutex_destroy(&fr->lock);
+    free(fr->slots);
+    free(fr->lz);
+    free(fr->threads);
+    free(fr);
+}
+
+/**
+ * @brief Writes out everything queued and stops the workers.
+ *
+ * @param fr Frame pipeline.
+ */
+static inline void logger_framer_stop(struct LogFramer *fr);
+
+/**
+ * @brief Starts a frame pipeline with its compression workers.
+ *
+ * The ring holds two blocks per worker plus the one being filled, which is
+ * enough to keep every worker busy while earlier frames are being written.
+ *
+ * @return The pipeline, or NULL if it could not be set up.
+ */
+static inline struct LogFramer *logger_framer_start(struct Logger *logger, int level, int checksum, size_t block_size, int workers) {
+    struct LogFramer *fr = (struct LogFramer *)calloc(1, sizeof(*fr));
+    if (!fr)
+        return NULL;
+    fr->logger = logger;
+    fr->level = level;
+    fr->checksum = checksum;
+    fr->block_size = block_size;
+    fr->flush_ms = LOG_FRAME_FLUSH_MS;
+    fr->num_workers = workers;
+    fr->num_slots = 2 * workers + 1;
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_mutex_init(&fr->lock, NULL);
+    pthread_cond_init(&fr->work, &attr);
+    pthread_cond_init(&fr->space, &attr);
+    pthread_condattr_destroy(&attr);
+
+    fr->slots = (struct LogFrameSlot *)calloc(fr->num_slots, sizeof(*fr->slots));
+    fr->lz = (struct LogLzState **)calloc(workers, sizeof(*fr->lz));
+    fr->threads = (pthread_t *)calloc(workers, sizeof(*fr->threads));
+    int ok = fr->slots && fr->lz && fr->threads;
+    for (int i = 0; ok && i < fr->num_slots; i++) {
+        fr->slots[i].raw = (char *)malloc(block_size);
+        fr->slots[i].frame = (unsigned char *)malloc(LOG_FRAME_OVERHEAD + block_size);
+        ok = fr->slots[i].raw && fr->slots[i].frame;
+    }
+    for (int i = 0; ok && i < workers; i++) {
+        fr->lz[i] = (struct LogLzState *)calloc(1, sizeof(*fr->lz[i]));
+        ok = fr->lz[i] != NULL;
+    }
+    for (int i = 0; ok && i < workers; i++) {
+        struct LogFramerWorker *worker = (struct LogFramerWorker *)malloc(sizeof(*worker));
+        ok = worker != NULL;
+        if (ok) {
+            worker->framer = fr;
+            worker->index = i;
+            ok = pthread_create(&fr->threads[i], NULL, logger_framer_main, worker) == 0;
+            if (ok)
+                fr->started++;
+            else
+                free(worker);
+        }
+    }
+    if (ok)
+        return fr;
+
+    logger_framer_stop(fr);
+    return NULL;
+}
+
+/**
+ * @brief Appends log text to the current block, sealing blocks as they fill up.
+ *
+ * Text that fits is never split across frames, so each frame holds whole lines.
+ *
+ * @param fr Frame pipeline.
+ * @param data Log text.
+ * @param len Length of the text.
+ * @param first_ms Time of the oldest line in data (ms since the epoch).
+ * @param last_ms Time of the newest line in data.
+ */
+static inline void logger_framer_append(struct LogFramer *fr, const char *data, size_t len, long long first_ms, long long last_ms) {
+    pthread_mutex_lock(&fr->lock);
+    while (len > 0) {
+        struct LogFrameSlot *slot = &fr->slots[fr->fill];
+        if (slot->raw_len > 0 && slot->raw_len + len > fr->block_size && len <= fr->block_size) {
+            logger_framer_seal(fr, 1);
+            continue;
+        }
+        size_t n = fr->block_size - slot->raw_len;
+        if (n > len)
+            n = len;
+        if (slot->raw_len == 0) {
+            clock_gettime(CLOCK_MONOTONIC, &fr->fill_start);
+            slot->first_ms = first_ms;
+            slot->last_ms = last_ms;
+        }
+        if (first_ms < slot->first_ms)
+            slot->first_ms = first_ms;
+        if (last_ms > slot->last_ms)
+            slot->last_ms = last_ms;
+        memcpy(slot->raw + slot->raw_len, data, n);
+        slot->raw_len += n;
+        __atomic_fetch_add(&fr->logger->sink.queued_bytes, n, __ATOMIC_RELAXED);
+        data += n;
+        len -= n;
+        if (slot->raw_len == fr->block_size)
+            logger_framer_seal(fr, 1);
+    }
+    pthread_mutex_unlock(&fr->lock);
+}
+
+/**
+ * @brief Reserves room for one record in the current block, sealing the block first if needed.
+ *
+ * Returns with framer->lock held, so the block cannot be sealed underneath the
+ * caller; finish with logger_framer_commit().
+ *
+ * @param fr Frame pipeline.
+ * @param max_len Largest size the record may have.
+ * @param room Receives the bytes available at the returned position.
+ * @param fresh Receives 1 if the record will be the first in its block.
+ * @return Where to write the record.
+ */
+static inline char *logger_framer_reserve(struct LogFramer *fr, size_t max_len, size_t *room, int *fresh) {
+    pthread_mutex_lock(&fr->lock);
+    if (fr->slots[fr->fill].raw_len + max_len > fr->block_size)
+        logger_framer_seal(fr, 1);
+    struct LogFrameSlot *slot = &fr->slots[fr->fill];
+    *room = fr->block_size - slot->raw_len;
+    *fresh = slot->raw_len == 0;
+    return slot->raw + slot->raw_len;
+}
+
+/**
+ * @brief Adds a record written at the position from logger_framer_reserve() to the block.
+ *
+ * @param fr Frame pipeline.
+ * @param len Length of the record (0 if nothing was written).
+ * @param time_ms Time of the record (ms since the epoch).
+ */
+static inline void logger_framer_commit(struct LogFramer *fr, size_t len, long long time_ms) {
+    struct LogFrameSlot *slot = &fr->slots[fr->fill];
+    if (len > 0) {
+        if (slot->raw_len == 0) {
+            clock_gettime(CLOCK_MONOTONIC, &fr->fill_start);
+            slot->first_ms = time_ms;
+            slot->last_ms = time_ms;
+        }
+        if (time_ms < slot->first_ms)
+            slot->first_ms = time_ms;
+        if (time_ms > slot->last_ms)
+            slot->last_ms = time_ms;
+        slot->raw_len += len;
+        __atomic_fetch_add(&fr->logger->sink.queued_bytes, len, __ATOMIC_RELAXED);
+        if (slot->raw_len == fr->block_size)
+            logger_framer_seal(fr, 1);
+    }
+    pthread_mutex_unlock(&fr->lock);
+}
+
+/**
+ * @brief Seals the current block and waits until every queued frame is on disk.
+ *
+ * @param fr Frame pipeline.
+ */
+static inline void logger_framer_sync(struct LogFramer *fr) {
+    pthread_mutex_lock(&fr->lock);
+    logger_framer_seal(fr, 1);
+    while (fr->next != fr->fill || fr->slots[fr->next].state != LOG_SLOT_FREE)
+        pthread_cond_wait(&fr->space, &fr->lock);
+    pthread_mutex_unlock(&fr->lock);
+}
+
+static inline void logger_framer_stop(struct LogFramer *fr) {
+    if (fr->started == fr->num_workers)
+        logger_framer_sync(fr);
+    pthread_mutex_lock(&fr->lock);
+    fr->stop = 1;
+    pthread_cond_broadcast(&fr->work);
+    pthread_mutex_unlock(&fr->lock);
+    for (int i = 0; i < fr->started; i++)
+        pthread_join(fr->threads[i], NULL);
+    logger_framer_free(fr);
+}
+
+/**
+ * @brief Writes a string argument as a dictionary reference, a definition or a literal.
+ *
+ * @param w Output.
+ * @param dict String dictionary of the segment (NULL to always write literals).
+ * @param s String bytes.
+ * @param len Length of the string.
+ */
+static inline void logger_binary_put_string(struct LogByteWriter *w, struct LogStringDict *dict, const unsigned char *s, uint32_t len) {
+    if (!dict || len > LOG_BIN_DICT_MAX_STRING) {
+        log_put_varint(w, ((uint64_t)len << 2) | LOG_BIN_STR_LITERAL);
+        log_put_bytes(w, s, len);
+        return;
+    }
+    uint32_t hash = log_string_hash(s, len);
+    uint32_t slot = hash % LOG_BIN_DICT_SIZE;
+    if (dict->used[slot] && dict->len[slot] == len && memcmp(dict->str[slot], s, len) == 0) {
+        log_put_varint(w, ((uint64_t)slot << 2) | LOG_BIN_STR_REF);
+        return;
+    }
+    uint32_t *seen = &dict->seen[hash % LOG_BIN_SEEN_SIZE];
+    int define = *seen == hash;
+    *seen = hash;
+    log_put_varint(w, ((uint64_t)len << 2) | (define ? LOG_BIN_STR_DEFINE : LOG_BIN_STR_LITERAL));
+    log_put_bytes(w, s, len);
+    if (define) {
+        dict->used[slot] = 1;
+        dict->len[slot] = (unsigned char)len;
+        memcpy(dict->str[slot], s, len);
+    }
+}
+
+/**
+ * @brief Finds or adds the format table entry for a call site.
+ *
+ * Entries are keyed by the format, file and line pointers of the call; the
+ * format text is compared as well, in case a format buffer was reused.
+ *
+ * @param t Format table of the segment.
+ * @param c Captured message.
+ * @param is_new Set to 1 if the entry was just added and must be defined in the file.
+ * @return Entry id, or -1 if the format has to be written inline.
+ */
+static inline int logger_format_lookup(struct LogFormatTable *t, const struct LogCapture *c, int *is_new) {
+    uint64_t key = (uint64_t)(uintptr_t)c->format ^ ((uint64_t)(uintptr_t)c->file << 7) ^ ((uint64_t)(unsigned)c->line << 32);
+    uint32_t slot = (uint32_t)((key * 0x9E3779B97F4A7C15ULL) >> 32) % LOG_BIN_FORMAT_SLOTS;
+    while (t->slots[slot]) {
+        const struct LogFormatEntry *e = &t->entries[t->slots[slot] - 1];
+        if (e->format == c->format && e->file == c->file && e->line == c->line)
+            return strncmp(t->arena + e->offset, c->format, e->len + 1) == 0 ? t->slots[slot] - 1 : -1;
+        slot = (slot + 1) % LOG_BIN_FORMAT_SLOTS;
+    }
+
+    size_t len = strlen(c->format);
+    size_t file_len = c->file ? strlen(c->file) : 0;
+    if (t->count == LOG_BIN_MAX_FORMATS || t->arena_len + len + file_len + 2 > LOG_BIN_FORMAT_ARENA)
+        return -1;
+    struct LogFormatEntry *e = &t->entries[t->count];
+    e->format = c->format;
+    e->file = c->file;
+    e->line = c->line;
+    e->len = (unsigned)len;
+    e->offset = (unsigned)t->arena_len;
+    memcpy(t->arena + t->arena_len, c->format, len + 1);
+    t->arena_len += len + file_len + 2; // Charged like the reader stores it
+    t->slots[slot] = (uint16_t)(++t->count);
+    *is_new = 1;
+    return t->count - 1;
+}
+
+/**
+ * @brief Encodes a captured message as a binary record, preceded by any control records it needs.
+ *
+ * The delta state is only updated if the record fits. The string dictionary may
+ * already have changed, so after a failure the next record starts a new segment.
+ * Must be called with file_lock held.
+ *
+ * @param logger Pointer to the logger structure.
+ * @param capture Message captured by log_capture().
+ * @param out Output buffer.
+ * @param cap Capacity of out.
+ * @return Length of the record, or -1 if it does not fit.
+ */
+static inline int logger_binary_encode(struct Logger *logger, const unsigned char *capture, unsigned char *out, size_t cap) {
+    struct LogBinaryState st = logger->bin;
+    struct LogByteWriter w = {out, out + cap, 0};
+    struct LogCapture c;
+    memcpy(&c, capture, sizeof(c));
+    struct LogByteReader args = {capture + sizeof(c), capture + sizeof(c) + c.args_len, 0};
+
+    if (st.need_segment) {
+        log_put_byte(&w, LOG_BIN_CONTROL);
+        log_put_byte(&w, LOG_BIN_SEGMENT);
+        log_put_bytes(&w, "L4CB", 4);
+        log_put_byte(&w, LOG_BIN_VERSION);
+        memset(&st, 0, sizeof(st)); // The decoder starts over from its initial state
+        if (logger->strings)
+            memset(logger->strings->used, 0, sizeof(logger->strings->used));
+        if (logger->formats) {
+            logger->formats->count = 0;
+            logger->formats->arena_len = 0;
+            memset(logger->formats->slots, 0, sizeof(logger->formats->slots));
+        }
+    }
+    if (!st.context_valid || st.context_sent != logger->context_version) {
+        log_put_byte(&w, LOG_BIN_CONTROL);
+        log_put_byte(&w, LOG_BIN_CONTEXT);
+        log_put_byte(&w, (unsigned char)((logger->include_thread_id ? LOG_BIN_SHOW_THREAD : 0) |
+                                         (logger->include_process_id ? LOG_BIN_SHOW_PROCESS : 0) |
+                                         (logger->include_sequence ? LOG_BIN_SHOW_SEQUENCE : 0)));
+        log_put_string(&w, logger->prefix, strlen(logger->prefix));
+        log_put_string(&w, logger->date_format, strlen(logger->date_format));
+        st.context_valid = 1;
+        st.context_sent = logger->context_version;
+    }
+    if (st.tags_sent != logger->num_tags) {
+        log_put_byte(&w, LOG_BIN_CONTROL);
+        log_put_byte(&w, LOG_BIN_TAG_TABLE);
+        log_put_varint(&w, (uint64_t)logger->num_tags);
+        for (int i = 0; i < logger->num_tags; i++)
+            log_put_string(&w, logger->tags[i], strlen(logger->tags[i]));
+        st.tags_sent = logger->num_tags;
+    }
+
+    int is_new = 0;
+    int format_id = logger->formats ? logger_format_lookup(logger->formats, &c, &is_new) : -1;
+    if (is_new) {
+        const struct LogFormatEntry *e = &logger->formats->entries[format_id];
+        log_put_byte(&w, LOG_BIN_CONTROL);
+        log_put_byte(&w, LOG_BIN_FORMAT_DEF);
+        log_put_varint(&w, (uint64_t)format_id);
+        log_put_byte(&w, (unsigned char)c.level);
+        log_put_string(&w, c.file ? c.file : "", c.file ? strlen(c.file) : 0);
+        log_put_varint(&w, (uint64_t)(unsigned)c.line);
+        log_put_string(&w, c.format, e->len);
+    }
+
+    unsigned tags = logger->num_tags ? (1U << logger->num_tags) - 1 : 0;
+    unsigned char header = (unsigned char)c.level;
+    if (logger->include_thread_id && c.thread != st.prev_thread)
+        header |= LOG_BIN_THREAD;
+    if (tags != st.prev_tags)
+        header |= LOG_BIN_TAGS;
+    if (logger->include_process_id && c.process != st.prev_process)
+        header |= LOG_BIN_PROCESS;
+    if (logger->include_sequence && c.seq != st.prev_seq + 1)
+        header |= LOG_BIN_SEQUENCE;
+    log_put_byte(&w, header);
+    log_put_varint(&w, log_zigzag(c.us - st.prev_us));
+    if (header & LOG_BIN_THREAD)
+        log_put_varint(&w, (uint64_t)c.thread);
+    if (header & LOG_BIN_TAGS)
+        log_put_varint(&w, (uint64_t)tags);
+    if (header & LOG_BIN_PROCESS)
+        log_put_varint(&w, (uint64_t)c.process);
+    if (header & LOG_BIN_SEQUENCE)
+        log_put_varint(&w, (uint64_t)c.seq);
+    if (format_id >= 0) {
+        log_put_varint(&w, (uint64_t)format_id + 1);
+    } else {
+        log_put_varint(&w, 0);
+        log_put_string(&w, c.format, strlen(c.format));
+    }
+
+    struct LogFormatSpec spec;
+    const char *p = c.format;
+    while ((p = log_format_next(p, &spec)) != NULL) {
+        if (spec.star_width)
+            log_put_varint(&w, log_zigzag((int64_t)log_capture_get64(&args)));
+        if (spec.star_precision)
+            log_put_varint(&w, log_zigzag((int64_t)log_capture_get64(&args)));
+        switch (spec.type) {
+            case LOG_ARG_NONE:
+            case LOG_ARG_COUNT:
+                break;
+            case LOG_ARG_INT: case LOG_ARG_LONG: case LOG_ARG_LLONG:
+            case LOG_ARG_SSIZE: case LOG_ARG_INTMAX: case LOG_ARG_PTRDIFF:
+                log_put_varint(&w, log_zigzag((int64_t)log_capture_get64(&args)));
+                break;
+            case LOG_ARG_DOUBLE:
+            case LOG_ARG_LDOUBLE: {
+                unsigned char bits[8];
+                log_put_le64(bits, log_capture_get64(&args));
+                log_put_bytes(&w, bits, sizeof(bits));
+                break;
+            }
+            case LOG_ARG_STRING: {
+                uint32_t len = LOG_CAPTURE_NULL;
+                const unsigned char *b = log_get_bytes(&args, sizeof(len));
+                if (b)
+                    memcpy(&len, b, sizeof(len));
+                if (len == LOG_CAPTURE_NULL || (b = log_get_bytes(&args, len)) == NULL)
+                    log_put_varint(&w, 0);
+                else
+                    logger_binary_put_string(&w, logger->strings, b, len);
+                break;
+            }
+            default:
+                log_put_varint(&w, log_capture_get64(&args));
+                break;
+        }
+    }
+    if (w.overflow) {
+        logger->bin.need_segment = 1;
+        return -1;
+    }
+
+    st.prev_us = c.us;
+    if (header & LOG_BIN_THREAD)
+        st.prev_thread = c.thread;
+    st.prev_tags = tags;
+    if (header & LOG_BIN_PROCESS)
+        st.prev_process = c.process;
+    st.prev_seq = header & LOG_BIN_SEQUENCE ? c.seq : st.prev_seq + 1; // What the decoder will assume
+    logger->bin = st;
+    return (int)(w.p - out);
+}
+
+/**
+ * @brief Encodes a capture as a binary record, falling back to its rendered text if the record does not fit.
+ *
+ * The text is shortened to half a line so the record fits next to the control
+ * records a segment start needs. A message that still does not fit is counted as
+ * dropped.
+ *
+ * @return Length of the record, or -1 if nothing could be encoded.
+ */
+static inline int logger_binary_encode_or_text(struct Logger *logger, const unsigned char *capture, unsigned char *out,
+                                               size_t cap) {
+    int len = logger_binary_encode(logger, capture, out, cap);
+    if (len > 0)
+        return len;
+    // Too large as a record: keep the rendered message, cut to leave room for the control records
+    struct LogCapture c;
+    memcpy(&c, capture, sizeof(c));
+    char message[LOG_MAX_LINE_LENGTH / 2];
+    if (log_render_message(c.format, capture + sizeof(c), c.args_len, message, sizeof(message)) < 0)
+        message[0] = '\0';
+    unsigned char text[LOG_MAX_LINE_LENGTH];
+    int text_len = log_capturef(text, sizeof(text), c.level, c.us, c.thread, c.process, c.file, c.line, "%s", message);
+    if (text_len > 0) {
+        memcpy(text + offsetof(struct LogCapture, seq), &c.seq, sizeof(c.seq));
+        len = logger_binary_encode(logger, text, out, cap);
+    }
+    if (len <= 0 && logger->stats)
+        log_stats_add(&log_stats_shard(logger->stats)->dropped[c.level], 1);
+    return len;
+}
+
+/**
+ * @brief Writes a captured message to the file as a binary record.
+ *
+ * Each frame block starts a new segment, so every frame can be decoded on its own.
+ *
+ * @param logger Pointer to the logger structure.
+ * @param capture Message captured by log_capture().
+ */
+static inline void logger_file_put_capture(struct Logger *logger, const unsigned char *capture) {
+    struct LogCapture c;
+    memcpy(&c, capture, sizeof(c));
+    if (logger->framer) {
+        size_t room;
+        int fresh;
+        char *p = logger_framer_reserve(logger->framer, LOG_BIN_MAX_RECORD, &room, &fresh);
+        if (fresh)
+            logger->bin.need_segment = 1;
+        int len = logger_binary_encode_or_text(logger, capture, (unsigned char *)p, room);
+        logger_framer_commit(logger->framer, len > 0 ? (size_t)len : 0, c.us / 1000);
+    } else {
+        unsigned char record[LOG_BIN_MAX_RECORD];
+        int len = logger_binary_encode_or_text(logger, capture, record, sizeof(record));
+        if (len > 0)
+            logger_file_write_raw(logger, (const char *)record, (size_t)len);
+    }
+}
+
+/**
+ * @brief Sends log text (or a captured message in binary mode) to the file, either
+ * directly or through the frame pipeline.
+ *
+ * @param logger Pointer to the logger structure.
+ * @param data Log text, or one capture from log_capture() in LOG_FORMAT_BINARY.
+ * @param len Length of the text.
+ * @param first_ms Time of the oldest line in data (ms since the epoch).
+ * @param last_ms Time of the newest line in data.
+ */
+static inline void logger_file_put(struct Logger *logger, const char *data, size_t len, long long first_ms, long long last_ms) {
+    if (logger->file_format == LOG_FORMAT_BINARY)
+        logger_file_put_capture(logger, (const unsigned char *)data);
+    else if (logger->framer)
+        logger_framer_append(logger->framer, data, len, first_ms, last_ms);
+    else
+        logger_file_write_raw(logger, data, len);
+}
+
+/**
+ * @brief Refills the throttle token bucket from the monotonic clock.
+ *
+ * @param logger Pointer to the logger structure.
+ */
+static inline void logger_refill_tokens(struct Logger *logger) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = (double)(now.tv_sec - logger->throttle_refill.tv_sec) +
+                     (double)(now.tv_nsec - logger->throttle_refill.tv_nsec) / 1e9;
+    logger->throttle_refill = now;
+    logger->throttle_tokens += elapsed * (double)logger->throttle_rate;
+    if (logger->throttle_tokens > (double)logger->throttle_burst)
+        logger->throttle_tokens = (double)logger->throttle_burst;
+}
+
+/**
+ * @brief Publishes the throttle backlog for logger_get_stats() and tracks the high-water mark.
+ *
+ * Must be called with file_lock held.
+ *
+ * @param logger Pointer to the logger structure.
+ */
+static inline void logger_note_backlog(struct Logger *logger) {
+    __atomic_store_n(&logger->sink.deferred_bytes, logger->deferred_len, __ATOMIC_RELAXED);
+    size_t depth = logger->deferred_len + __atomic_load_n(&logger->sink.queued_bytes, __ATOMIC_RELAXED);
+    if (depth > logger->sink.queue_high_water)
+        __atomic_store_n(&logger->sink.queue_high_water, depth, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Writes out as much of the deferred buffer as the token budget allows.
+ *
+ * @param logger Pointer to the logger structure.
+ * @param force Write everything regardless of budget (1) or respect the budget (0).
+ */
+static inline void logger_drain_deferred(struct Logger *logger, int force) {
+    if (logger->deferred_len == 0)
+        return;
+    if (logger->file_format == LOG_FORMAT_BINARY) {
+        // Captures are written one by one; each knows its own size and time
+        size_t pos = 0;
+        while (pos < logger->deferred_len) {
+            struct LogCapture c;
+            memcpy(&c, logger->deferred + pos, sizeof(c));
+            size_t n = sizeof(c) + c.args_len;
+            if (!force && logger->throttle_tokens < (double)n)
+                break;
+            logger_file_put(logger, logger->deferred + pos, n, c.us / 1000, c.us / 1000);
+            logger->throttle_tokens -= (double)n;
+            pos += n;
+        }
+        memmove(logger->deferred, logger->deferred + pos, logger->deferred_len - pos);
+        logger->deferred_len -= pos;
+        logger_note_backlog(logger);
+        return;
+    }
+    size_t n = logger->deferred_len;
+    if (!force) {
+        if (logger->throttle_tokens < 1.0)
+            return;
+        if ((double)n > logger->throttle_tokens)
+            n = (size_t)logger->throttle_tokens;
+        // Only release whole lines so they are never split across frames
+        while (n > 0 && logger->deferred[n - 1] != '\n')
+            n--;
+        if (n == 0)
+            return;
+    }
+    logger_file_put(logger, logger->deferred, n, logger->deferred_first_ms, logger->deferred_last_ms);
+    logger->throttle_tokens -= (double)n;
+    memmove(logger->deferred, logger->deferred + n, logger->deferred_len - n);
+    logger->deferred_len -= n;
+    logger_note_backlog(logger);
+}
+
+/**
+ * @brief Sends a rendered line to the log file, subject to the bandwidth throttle.
+ *
+ * Lines over budget are queued in memory behind anything already deferred, so file
+ * order is preserved. Once the memory cap is reached, lines below throttle_keep_level
+ * are dropped; lines at or above it flush the backlog and are written anyway,
+ * putting the bucket into debt. Must be called with file_lock held.
+ *
+ * @param logger Pointer to the logger structure.
+ * @param level Log level of the line.
+ * @param line Rendered line, including the trailing newline (a capture in LOG_FORMAT_BINARY).
+ * @param len Length of the line in bytes.
+ * @param time_ms Time of the line (ms since the epoch).
+ */
+static inline void logger_write_file(struct Logger *logger, enum LogLevel level, const char *line, size_t len, long long time_ms) {
+    if (logger->throttle_rate <= 0) {
+        logger_file_put(logger, line, len, time_ms, time_ms);
+        logger_note_backlog(logger);
+        return;
+    }
+
+    logger_refill_tokens(logger);
+    logger_drain_deferred(logger, 0);
+
+    if (logger->deferred_len == 0 && logger->throttle_tokens >= (double)len) {
+        logger_file_put(logger, line, len, time_ms, time_ms);
+        logger->throttle_tokens -= (double)len;
+    } else if (logger->deferred_len + len <= logger->deferred_cap) {
+        if (logger->deferred_len == 0) {
+            logger->deferred_first_ms = time_ms;
+            pthread_cond_signal(&logger->throttle_wake); // The drain thread sleeps while nothing is held back
+        }
+        logger->deferred_last_ms = time_ms;
+        memcpy(logger->deferred + logger->deferred_len, line, len);
+        logger->deferred_len += len;
+        logger->deferred_messages++;
+    } else if (level >= logger->throttle_keep_level) {
+        logger_drain_deferred(logger, 1);
+        logger_file_put(logger, line, len, time_ms, time_ms);
+        logger->throttle_tokens -= (double)len;
+    } else {
+        logger->dropped_messages++;
+        logger->dropped_bytes += len;
+        if (logger->stats)
+            log_stats_add(&log_stats_shard(logger->stats)->dropped[level], 1);
+    }
+    logger_note_backlog(logger);
+}
+
+/**
+ * @brief Returns the size of the first deferred line (or capture), which the budget must cover before it is written.
+ */
+static inline size_t logger_deferred_next_len(struct Logger *logger) {
+    if (logger->file_format == LOG_FORMAT_BINARY) {
+        struct LogCapture c;
+        memcpy(&c, logger->deferred, sizeof(c));
+        return sizeof(c) + c.args_len;
+    }
+    const char *end = (const char *)memchr(logger->deferred, '\n', logger->deferred_len);
+    return end ? (size_t)(end - logger->deferred) + 1 : logger->deferred_len;
+}
+
+/**
+ * @brief Throttle drain thread: writes deferred lines as soon as the budget covers them.
+ *
+ * Without it, lines held back by a burst would wait in memory for the next
+ * message. It sleeps on throttle_wake while nothing is deferred, and otherwise
+ * until the bucket has refilled enough for the next line.
+ */
+static inline void *logger_throttle_main(void *arg) {
+    struct Logger *logger = (struct Logger *)arg;
+    logger_place_writer(logger);
+
+    pthread_mutex_lock(&logger->file_lock);
+    while (logger->throttle_running) {
+        if (logger->deferred_len > 0 && logger->file) {
+            logger_refill_tokens(logger);
+            logger_drain_deferred(logger, 0);
+        }
+        if (logger->deferred_len == 0 || !logger->file) {
+            pthread_cond_wait(&logger->throttle_wake, &logger->file_lock);
+            continue;
+        }
+        double missing = (double)logger_deferred_next_len(logger) - logger->throttle_tokens;
+        long long wait_ns = missing > 0 ? (long long)(missing * 1e9 / (double)logger->throttle_rate) : 0;
+        if (wait_ns < 1000000)
+            wait_ns = 1000000; // Never spin on a bucket that is just short
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += (time_t)(wait_ns / 1000000000LL);
+        deadline.tv_nsec += (long)(wait_ns % 1000000000LL);
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&logger->throttle_wake, &logger->file_lock, &deadline);
+    }
+    pthread_mutex_unlock(&logger->file_lock);
+    return NULL;
+}
+
+/**
+ * @brief Stops the throttle drain thread, if it runs.
+ *
+ * @param logger Pointer to the logger structure.
+ */
+static inline void logger_throttle_stop(struct Logger *logger) {
+    pthread_mutex_lock(&logger->file_lock);
+    int running = logger->throttle_running;
+    logger->throttle_running = 0;
+    pthread_cond_signal(&logger->throttle_wake);
+    pthread_mutex_unlock(&logger->file_lock);
+    if (running)
+        pthread_join(logger->throttle_thread, NULL);
+}
+
+/**
+ * @brief Prepares binary records for a change of prefix, date format or shown ids.
+ *
+ * Deferred messages are rendered with the context in effect when they are
+ * written, so they are flushed first, and the next record carries the new context.
+ *
+ * @param logger Pointer to the logger structure.
+ */
+static inline void logger_context_changing(struct Logger *logger) {
+    pthread_mutex_lock(&logger->file_lock);
+    if (logger->file_format == LOG_FORMAT_BINARY && logger->file)
+        logger_drain_deferred(logger, 1);
+    logger->context_version++;
+    pthread_mutex_unlock(&logger->file_lock);
+}
+
+/*
+ * Sequence numbers. Each thread numbers the messages it logs to a logger 1, 2,
+ * 3, ... in a counter of its own, so stamping a message touches no shared
+ * memory. A gap in one thread's numbers is a message that was dropped or
+ * filtered out of that output; a number that goes backwards is reordering.
+ * set_include_sequence() allocates LOG_SEQ_SLOTS counters and a thread-specific
+ * key; a thread claims a free slot on its first numbered message (real-time
+ * threads when they attach) and the key's destructor hands it back when the
+ * thread exits, so a pool of short-lived threads reuses the same slots.
+ */
+
+struct LogSeqCounter {
+    unsigned long long last;     // Last number handed out
+    int in_use;                  // Flag indicating whether a live thread owns this slot (1) or not (0)
+    char pad[64 - sizeof(unsigned long long) - sizeof(int)]; // One cache line per thread
+};
+
+static struct LogSeqCounter log_seq_none; // Marks a thread that found every slot taken
+
+/**
+ * @brief Frees an exiting thread's sequence slot (the seq_key destructor).
+ */
+static inline void logger_seq_release(void *counter) {
+    __atomic_store_n(&((struct LogSeqCounter *)counter)->in_use, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Returns the calling thread's sequence counter for a logger, claiming a free slot on first use.
+ *
+ * Never allocates. A thread that finds every slot taken is marked so that it
+ * does not search again.
+ *
+ * @return The counter, or NULL if sequences were never turned on or no slot was free.
+ */
+static inline struct LogSeqCounter *logger_seq_counter(struct Logger *logger) {
+    struct LogSeqCounter *slots = __atomic_load_n(&logger->seq_slots, __ATOMIC_ACQUIRE);
+    if (!slots)
+        return NULL;
+    struct LogSeqCounter *counter = (struct LogSeqCounter *)pthread_getspecific(logger->seq_key);
+    if (counter)
+        return counter != &log_seq_none ? counter : NULL;
+    unsigned start = __atomic_fetch_add(&logger->seq_hint, 1, __ATOMIC_RELAXED);
+    for (unsigned i = 0; i < LOG_SEQ_SLOTS; i++) {
+        counter = &slots[(start + i) % LOG_SEQ_SLOTS];
+        int idle = 0;
+        if (__atomic_load_n(&counter->in_use, __ATOMIC_RELAXED) ||
+            !__atomic_compare_exchange_n(&counter->in_use, &idle, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            continue;
+        counter->last = 0; // A new thread numbers from 1
+        if (pthread_setspecific(logger->seq_key, counter) != 0) {
+            logger_seq_release(counter);
+            return NULL;
+        }
+        return counter;
+    }
+    pthread_setspecific(logger->seq_key, &log_seq_none);
+    return NULL;
+}
+
+/**
+ * @brief Returns the calling thread's next sequence number for a logger.
+ *
+ * If the thread has no counter (more than LOG_SEQ_SLOTS live threads), it
+ * falls back to a counter shared by the whole logger, which still never goes
+ * backwards.
+ */
+static inline unsigned long long log_next_seq(struct Logger *logger) {
+    struct LogSeqCounter *counter = logger_seq_counter(logger);
+    if (counter)
+        return ++counter->last;
+    return __atomic_add_fetch(&logger->seq_shared, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Initializes the logger.
+ * 
+ * @param logger Pointer to the logger structure.
+ * @param console_level Minimum log level for console output.
+ * @param file_level Minimum log level for file output.
+ * @param file_path Path to the log file.
+ * @param date_format Custom date format for log entries (optional, set to NULL for default format).
+ * @param log_to_file Flag indicating whether logging to file is enabled (1) or not (0).
+ * @param include_thread_id Flag indicating whether to include thread ID in log messages (1) or not (0).
+ * @param include_process_id Flag indicating whether to include process ID in log messages (1) or not (0).
+ */
+void init_logger(struct Logger *logger, enum LogLevel console_level, enum LogLevel file_level, const char *file_path, const char *date_format, int log_to_file, int include_thread_id, int include_process_id) {
+    logger->console_level = console_level;
+    logger->file_level = file_level;
+    logger->file_path = strdup(file_path); // Dynamic memory allocation
+    logger->date_format = date_format ? strdup(date_format) : strdup("%Y-%m-%d %H:%M:%S"); // Dynamic memory allocation
+    logger->file = NULL;
+    logger->prefix = strdup("");
+    logger->log_to_file = log_to_file;
+    logger->include_thread_id = include_thread_id;
+    logger->include_process_id = include_process_id;
+    logger->include_sequence = 0;
+    logger->seq_slots = NULL;
+    logger->seq_hint = 0;
+    logger->seq_shared = 0;
+    logger->num_tags = 0;
+    tzset(); // localtime_r() loads the time zone on first use, which allocates
+    logger_prepare_stdout();
+    logger->cache_policy = LOG_CACHE_KEEP;
+    logger->cache_drop_chunk = DEFAULT_CACHE_DROP_CHUNK;
+    logger->cache_synced_offset = 0;
+    logger->cache_written_offset = 0;
+    pthread_mutex_init(&logger->file_lock, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&logger->throttle_wake, &attr);
+    pthread_condattr_destroy(&attr);
+    logger->throttle_running = 0;
+    logger->throttle_rate = 0;
+    logger->throttle_burst = 0;
+    logger->throttle_tokens = 0;
+    logger->throttle_keep_level = WARNING;
+    logger->deferred = NULL;
+    logger->deferred_len = 0;
+    logger->deferred_cap = 0;
+    logger->deferred_messages = 0;
+    logger->dropped_messages = 0;
+    logger->dropped_bytes = 0;
+    logger->deferred_first_ms = 0;
+    logger->deferred_last_ms = 0;
+    logger->framer = NULL;
+    logger->rotate_level = 0;
+    logger->index_file = NULL;
+    logger->frame_checksum = 0;
+    logger->file_format = LOG_FORMAT_TEXT;
+    memset(&logger->bin, 0, sizeof(logger->bin));
+    logger->strings = NULL;
+    logger->formats = NULL;
+    logger->context_version = 0;
+    logger->file_flush = 1;
+    memset(&logger->sink, 0, sizeof(logger->sink));
+    logger->stats = NULL;
+    void *shards;
+    if (posix_memalign(&shards, 64, LOG_STATS_SHARDS * sizeof(struct LogStatsShard)) == 0) {
+        memset(shards, 0, LOG_STATS_SHARDS * sizeof(struct LogStatsShard));
+        logger->stats = (struct LogStatsShard *)shards;
+    }
+    logger->rates = NULL;
+    logger->rt_id = 0;
+    logger->rt_rings = NULL;
+    pthread_mutex_init(&logger->rt_lock, NULL);
+    logger->rt_stop = 0;
+    logger->rt_ring_size = 0;
+    logger->rt_poll_us = 0;
+    logger->rt_process = 0;
+    logger->rt_base_cycles = 0;
+    logger->rt_base_ns = 0;
+    logger->rt_ns_per_cycle = 1.0;
+    logger->rt_spin_us = 0;
+    logger->rt_yield_us = 0;
+    logger->rt_wake = 0;
+    logger->rt_sleeping = 0;
+    memset(logger->writer_cpus, 0, sizeof(logger->writer_cpus));
+    logger->writer_cpus_set = 0;
+    logger->writer_nice = 0;
+    logger->writer_sched_idle = 0;
+    logger->writer_io_class = 0;
+    logger->writer_io_level = 0;
+    logger->ring_numa = 0;
+    logger->ring_pages = 0;
+    logger->rt_per_cpu = 0;
+    logger->rt_cpu_rings = NULL;
+    logger->rt_num_cpus = 0;
+    logger->rt_window_us = 0;
+    logger->rt_heap = NULL;
+    logger->rt_heap_cap = 0;
+    logger->rt_merge_last = 0;
+    logger->rt_held = 0;
+    logger->rt_merged = 0;
+    logger->rt_merge_late = 0;
+    logger->rt_merge_ns = 0;
+    logger->rt_render_workers = 0;
+    logger->rt_render = NULL;
+    logger->metrics_path = NULL;
+    logger->metrics_buf = NULL;
+    logger->metrics_out = NULL;
+    logger->metrics_interval_ms = 0;
+    logger->metrics_next_ms = LLONG_MAX;
+    logger->metrics_busy = 0;
+    memset(&logger->metrics_prev, 0, sizeof(logger->metrics_prev));
+    logger->metrics_prev_ms = 0;
+
+    if (logger->log_to_file) {
+        logger_open_file(logger);
+    }
+}
+
+enum LogIoClass {
+    LOG_IO_DEFAULT,     // Leave the I/O priority alone
+    LOG_IO_REALTIME,    // IOPRIO_CLASS_RT (needs privilege)
+    LOG_IO_BEST_EFFORT, // IOPRIO_CLASS_BE
+    LOG_IO_IDLE         // IOPRIO_CLASS_IDLE: disk time only when nobody else wants it
+};
+
+/**
+ * Everything init_logger() takes, plus where the logger's own threads run.
+ * Fields left zero keep their defaults: no pinning, unchanged priorities.
+ */
+struct LoggerOptions {
+    enum LogLevel console_level;   // Minimum log level for console output
+    enum LogLevel file_level;      // Minimum log level for file output
+    const char *file_path;         // Path to the log file
+    const char *date_format;       // Custom date format (NULL for the default)
+    int log_to_file;               // Flag indicating whether logging to file is enabled
+    int include_thread_id;         // Flag indicating whether to include the thread id
+    int include_process_id;        // Flag indicating whether to include the process id
+    int include_sequence;          // Flag indicating whether to include the per-thread sequence number
+    const char *writer_cpus;       // CPUs for writer threads as a list such as "2,3" or "8-11,14" (NULL = any)
+    int writer_nice;               // Nice value for writer threads (0 = unchanged)
+    int writer_sched_idle;         // Flag indicating whether writer threads run under SCHED_IDLE (overrides writer_nice)
+    enum LogIoClass writer_io_class; // I/O priority class for writer threads
+    int writer_io_level;           // I/O priority level within the class, 0 (highest) to 7
+    int ring_numa;                 // Flag indicating whether real-time rings are placed on the NUMA node of the thread that attaches them
+    int ring_huge_pages;           // Flag indicating whether real-time rings are backed by huge pages where possible
+    int ring_populate;             // Flag indicating whether real-time ring pages are faulted in when the ring is allocated
+};
+
+/**
+ * @brief Parses a CPU list such as "0-3,8" into a mask.
+ *
+ * @return 0 on success, -1 if the list is malformed or names a CPU beyond LOG_MAX_CPUS.
+ */
+static inline int logger_parse_cpus(const char *list, unsigned long *mask) {
+    const size_t bits = 8 * sizeof(unsigned long);
+    int any = 0;
+    memset(mask, 0, LOG_MAX_CPUS / 8);
+    while (*list) {
+        char *end;
+        long first = strtol(list, &end, 10), last = first;
+        if (end == list || first < 0)
+            return -1;
+        if (*end == '-') {
+            list = end + 1;
+            last = strtol(list, &end, 10);
+            if (end == list || last < first)
+                return -1;
+        }
+        if (last >= LOG_MAX_CPUS)
+            return -1;
+        for (long cpu = first; cpu <= last; cpu++)
+            mask[cpu / bits] |= 1UL << (cpu % bits);
+        any = 1;
+        if (*end == ',')
+            end++;
+        else if (*end)
+            return -1;
+        list = end;
+    }
+    return any ? 0 : -1;
+}
+
+void set_include_sequence(struct Logger *logger, int include_sequence);
+
+/**
+ * @brief Initializes the logger from an options structure.
+ *
+ * Does what init_logger() does with the same settings, and also sets where the
+ * threads the logger starts later run: the frame writers of
+ * set_file_compression() and the ring writer of set_realtime_mode() are pinned
+ * to writer_cpus and get the given nice value or SCHED_IDLE and I/O priority.
+ * With ring_numa, each real-time ring is allocated on the NUMA node of the CPU
+ * the attaching thread runs on, so pin producers before they attach.
+ * ring_huge_pages backs the rings with huge pages, cutting the TLB misses of
+ * producers writing across a large ring: explicit ones (MAP_HUGETLB) if the
+ * system has them reserved and the ring is a whole number of them, else
+ * transparent ones (MADV_HUGEPAGE), else normal pages. ring_populate faults a
+ * ring in as it is mapped (MAP_POPULATE), so the first writes to it during a
+ * request take no page faults; per-CPU rings under ring_numa are then faulted
+ * in by the thread that turns real-time mode on, rather than on their CPU.
+ *
+ * @param logger Pointer to the logger structure.
+ * @param options Settings; NULL for the defaults (console and file logging at DEBUG to "log.txt").
+ * @return 0 on success, -1 if writer_cpus could not be parsed (the logger is initialized without pinning).
+ */
+int init_logger_ex(struct Logger *logger, const struct LoggerOptions *options) {
+    struct LoggerOptions defaults;
+    if (!options) {
+        memset(&defaults, 0, sizeof(defaults));
+        defaults.file_path = "log.txt";
+        defaults.log_to_file = 1;
+        options = &defaults;
+    }
+    init_logger(logger, options->console_level, options->file_level, options->file_path ? options->file_path : "",
+                options->date_format, options->log_to_file, options->include_thread_id, options->include_process_id);
+    if (options->include_sequence)
+        set_include_sequence(logger, 1);
+    int result = 0;
+    if (options->writer_cpus) {
+        if (logger_parse_cpus(options->writer_cpus, logger->writer_cpus) == 0)
+            logger->writer_cpus_set = 1;
+        else
+            result = -1;
+    }
+    logger->writer_nice = options->writer_nice;
+    logger->writer_sched_idle = options->writer_sched_idle;
+    logger->writer_io_class = (int)options->writer_io_class;
+    logger->writer_io_level = options->writer_io_level < 0 ? 0 : options->writer_io_level > 7 ? 7 : options->writer_io_level;
+    logger->ring_numa = options->ring_numa;
+    logger->ring_pages = (options->ring_huge_pages ? LOG_PAGES_HUGE : 0) | (options->ring_populate ? LOG_PAGES_POPULATE : 0);
+    return result;
+}
+
+/**
+ * @brief Sets the custom log message prefix.
+ * 
+ * @param logger Pointer to the logger structure.
+ * @param prefix Custom log message prefix.
+ */
+void set_log_prefix(struct Logger *logger, const char *prefix) {
+    logger_context_changing(logger);
+    free(logger->prefix); // Free previous memory
+    logger->prefix = strdup(prefix); // Dynamic memory allocation
+}
+
+/**
+ * @brief Waits for any metrics export in progress and keeps others out until metrics_busy is cleared.
+ *
+ * The exporter labels its samples with file_path and runs without file_lock,
+ * so whatever changes the path or the export settings holds this claim.
+ */
+static inline void logger_metrics_claim(struct Logger *logger) {
+    int idle = 0;
+    while (!__atomic_compare_exchange_n(&logger->metrics_busy, &idle, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        idle = 0;
+        sched_yield(); // An export is being written
+    }
+}
+
+/**
+ * @brief Sets the log file path and opens the log file.
+ * 
+ * @param logger Pointer to the logger structure.
+ * @param file_path Path to the new log file.
+ */
+void set_log_file(struct Logger *logger, const char *file_path) {
+    logger_metrics_claim(logger);
+    pthread_mutex_lock(&logger->file_lock);
+    free(logger->file_path); // Free previous memory
+    logger->file_path = strdup(file_path); // Dynamic memory allocation
+    __atomic_store_n(&logger->metrics_busy, 0, __ATOMIC_RELEASE);
+    if (logger->framer)
+        logger_framer_sync(logger->framer);
+    if (logger->file)
+        fclose(logger->file);
+    logger_open_file(logger);
+    if (logger->index_file) {
+        logger_close_index(logger);
+        logger_open_index(logger);
+    }
+    pthread_mutex_unlock(&logger->file_lock);
+}
+
+/**
+ * @brief Sets the page-cache policy for the log file.
+ *
+ * With LOG_CACHE_DROP, every cache_drop_chunk bytes writeback of the new range is
+ * started with sync_file_range() and the range before it, written back by then,
+ * is evicted with posix_fadvise(POSIX_FADV_DONTNEED). Neither waits for the disk.
+ *
+ * @param logger Pointer to the logger structure.
+ * @param policy LOG_CACHE_KEEP or LOG_CACHE_DROP.
+ * @param drop_chunk Bytes written between drops (0 or less for the default of 1 MiB).
+ */
+void set_file_cache_policy(struct Logger *logger, enum LogCachePolicy policy, long drop_chunk) {
+    logger->cache_policy = policy;
+    logger->cache_drop_chunk = drop_chunk > 0 ? drop_chunk : DEFAULT_CACHE_DROP_CHUNK;
+}
+
+/**
+ * @brief Caps the bandwidth of the log file with a token bucket.
+ *
+ * Lines over budget are held in memory (up to max_deferred bytes) and written as
+ * the budget refills, by a drain thread when no further messages arrive; a flush
+ * writes them at once. Once that memory is full, lines below keep_level are dropped
+ * and counted; see get_throttle_stats().
+ *
+ * @param logger Pointer to the logger structure.
+ * @param bytes_per_sec Sustained file bandwidth in bytes per second (0 to disable throttling).
+ * @param burst Bytes that may be written at once after an idle period.
+ * @param max_deferred Memory cap in bytes for lines held back while over budget.
+ * @param keep_level Lines at or above this level are written even when the memory cap is reached.
+ */
+void set_file_throttle(struct Logger *logger, long bytes_per_sec, long burst, size_t max_deferred, enum LogLevel keep_level) {
+    logger_throttle_stop(logger);
+    pthread_mutex_lock(&logger->file_lock);
+    if (logger->file)
+        logger_drain_deferred(logger, 1);
+    free(logger->deferred);
+    logger->deferred = max_deferred ? (char *)malloc(max_deferred) : NULL; // Preallocated so logging never allocates
+    logger->deferred_cap = logger->deferred ? max_deferred : 0;
+    logger->deferred_len = 0;
+    logger->throttle_rate = bytes_per_sec;
+    logger->throttle_burst = burst > 0 ? burst : bytes_per_sec;
+    logger->throttle_tokens = (double)logger->throttle_burst;
+    logger->throttle_keep_level = keep_level;
+    clock_gettime(CLOCK_MONOTONIC, &logger->throttle_refill);
+    if (bytes_per_sec > 0 && logger->deferred) {
+        logger->throttle_running = 1;
+        if (pthread_create(&logger->throttle_thread, NULL, logger_throttle_main, logger) != 0) {
+            logger->throttle_running = 0;
+            fprintf(stderr, "Error starting log throttle thread; deferred lines wait for the next message\n");
+        }
+    }
+    pthread_mutex_unlock(&logger->file_lock);
+}
+
+/**
+ * @brief Reports what the file bandwidth throttle has held back or dropped.
+ *
+ * @param logger Pointer to the logger structure.
+ * @param stats Receives the counters.
+ */
+void get_throttle_stats(struct Logger *logger, struct LogThrottleStats *stats) {
+    pthread_mutex_lock(&logger->file_lock);
+    stats->deferred_bytes = logger->deferred_len;
+    stats->deferred_messages = logger->deferred_messages;
+    stats->dropped_messages = logger->dropped_messages;
+    stats->dropped_bytes = logger->dropped_bytes;
+    pthread_mutex_unlock(&logger->file_lock);
+}
+
+/**
+ * @brief Takes a snapshot of the logger's health counters.
+ *
+ * Producers count into per-thread shards and the file writer into its own
+ * counters, all with relaxed atomics, so taking a snapshot never takes a lock
+ * that log_message() needs. Counts may be a few messages apart from one another
+ * while threads are logging.
+ *
+ * @param logger Pointer to the logger structure.
+ * @param stats Receives the counters.
+ */
+void logger_get_stats(struct Logger *logger, struct LoggerStats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    for (int i = 0; logger->stats && i < LOG_STATS_SHARDS; i++) {
+        struct LogStatsShard *shard = &logger->stats[i];
+        for (int level = 0; level < LOG_NUM_LEVELS; level++) {
+            stats->accepted[level] += __atomic_load_n(&shard->accepted[level], __ATOMIC_RELAXED);
+            stats->dropped[level] += __atomic_load_n(&shard->dropped[level], __ATOMIC_RELAXED);
+        }
+        stats->console_bytes += __atomic_load_n(&shard->console_bytes, __ATOMIC_RELAXED);
+    }
+    struct LogSinkCounters *sink = &logger->sink;
+    stats->queue_depth = __atomic_load_n(&sink->deferred_bytes, __ATOMIC_RELAXED) +
+                         __atomic_load_n(&sink->queued_bytes, __ATOMIC_RELAXED);
+    stats->queue_high_water = __atomic_load_n(&sink->queue_high_water, __ATOMIC_RELAXED);
+    stats->file_bytes = __atomic_load_n(&sink->bytes, __ATOMIC_RELAXED);
+    stats->file_writes = __atomic_load_n(&sink->writes, __ATOMIC_RELAXED);
+    stats->flushes = __atomic_load_n(&sink->flushes, __ATOMIC_RELAXED);
+    stats->syncs = __atomic_load_n(&sink->syncs, __ATOMIC_RELAXED);
+    stats->write_us = __atomic_load_n(&sink->write_us, __ATOMIC_RELAXED);
+    for (int i = 0; i < LOG_LATENCY_BUCKETS; i++)
+        stats->write_latency[i] = __atomic_load_n(&sink->write_latency[i], __ATOMIC_RELAXED);
+    stats->merged = __atomic_load_n(&logger->rt_merged, __ATOMIC_RELAXED);
+    stats->merge_late = __atomic_load_n(&logger->rt_merge_late, __ATOMIC_RELAXED);
+    stats->merge_us = __atomic_load_n(&logger->rt_merge_ns, __ATOMIC_RELAXED) / 1000;
+}
+
+/**
+ * @brief Writes a label value with the escapes of the Prometheus text format.
+ */
+static inline void logger_prom_label(FILE *out, const char *value) {
+    for (; *value; value++) {
+        if (*value == '\\' || *value == '"')
+            fputc('\\', out);
+        if (*value == '\n')
+            fputs("\\n", out);
+        else
+            fputc(*value, out);
+    }
+}
+
+/**
+ * @brief Writes one metric's HELP and TYPE lines.
+ */
+static inline void logger_prom_header(FILE *out, const char *name, const char *type, const char *help) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/**
+ * @brief Writes one sample; level < 0 leaves out the level label.
+ */
+static inline void logger_prom_sample(FILE *out, const char *name, const char *log, int level, const char *extra,
+                                      double value) {
+    fprintf(out, "%s{log=\"", name);
+    logger_prom_label(out, log);
+    fputc('"', out);
+    if (level >= 0)
+        fprintf(out, ",level=\"%s\"", log_level_name(level));
+    if (extra)
+        fprintf(out, ",%s", extra);
+    fprintf(out, "} %.15g\n", value);
+}
+
+/**
+ * @brief Writes the logger's counters and per-level message rates to metrics_path.
+ *
+ * The text is rendered into metrics_buf, written next to its final name and
+ * renamed over it, so a scraper never sees a partial file. Only the thread that
+ * won the export (see logger_metrics_due()) calls this.
+ *
+ * @param logger Pointer to the logger structure.
+ * @param now_ms Current time (ms since the epoch).
+ */
+static inline void logger_export_metrics(struct Logger *logger, long long now_ms) {
+    struct LoggerStats st;
+    logger_get_stats(logger, &st);
+    const char *log = logger->file_path; // Stable while metrics_busy is held; set_log_file() waits for it
+    FILE *out = logger->metrics_out;
+    rewind(out);
+
+    double seconds = logger->metrics_prev_ms > 0 ? (double)(now_ms - logger->metrics_prev_ms) / 1000.0 : 0.0;
+    logger_prom_header(out, "logger_messages_total", "counter", "Messages that passed the level filters.");
+    for (int level = 0; level < LOG_NUM_LEVELS; level++)
+        logger_prom_sample(out, "logger_messages_total", log, level, NULL, (double)st.accepted[level]);
+    logger_prom_header(out, "logger_dropped_total", "counter", "Messages dropped by the file throttle.");
+    for (int level = 0; level < LOG_NUM_LEVELS; level++)
+        logger_prom_sample(out, "logger_dropped_total", log, level, NULL, (double)st.dropped[level]);
+    logger_prom_header(out, "logger_message_rate", "gauge", "Messages per second since the previous export.");
+    for (int level = 0; level < LOG_NUM_LEVELS; level++) {
+        double rate = seconds > 0 ? (double)(st.accepted[level] - logger->metrics_prev.accepted[level]) / seconds : 0.0;
+        logger_prom_sample(out, "logger_message_rate", log, level, NULL, rate);
+    }
+    logger_prom_header(out, "logger_queue_bytes", "gauge", "Bytes accepted for the log file and not yet written.");
+    logger_prom_sample(out, "logger_queue_bytes", log, -1, NULL, (double)st.queue_depth);
+    logger_prom_header(out, "logger_queue_high_water_bytes", "gauge", "Largest file backlog seen.");
+    logger_prom_sample(out, "logger_queue_high_water_bytes", log, -1, NULL, (double)st.queue_high_water);
+    logger_prom_header(out, "logger_written_bytes_total", "counter", "Bytes written per sink.");
+    logger_prom_sample(out, "logger_written_bytes_total", log, -1, "sink=\"console\"", (double)st.console_bytes);
+    logger_prom_sample(out, "logger_written_bytes_total", log, -1, "sink=\"file\"", (double)st.file_bytes);
+    logger_prom_header(out, "logger_file_flushes_total", "counter", "fflush() calls on the log file.");
+    logger_prom_sample(out, "logger_file_flushes_total", log, -1, NULL, (double)st.flushes);
+    logger_prom_header(out, "logger_file_syncs_total", "counter", "Writebacks started on the log file for page-cache drops.");
+    logger_prom_sample(out, "logger_file_syncs_total", log, -1, NULL, (double)st.syncs);
+    logger_prom_header(out, "logger_file_write_seconds", "histogram", "Time taken by writes to the log file.");
+    unsigned long long cumulative = 0;
+    for (int i = 0; i < LOG_LATENCY_BUCKETS; i++) {
+        char le[32];
+        cumulative += st.write_latency[i];
+        snprintf(le, sizeof(le), "le=\"%g\"", (double)(1ULL << i) / 1e6);
+        logger_prom_sample(out, "logger_file_write_seconds_bucket", log, -1, le, (double)cumulative);
+    }
+    logger_prom_sample(out, "logger_file_write_seconds_bucket", log, -1, "le=\"+Inf\"", (double)st.file_writes);
+    logger_prom_sample(out, "logger_file_write_seconds_sum", log, -1, NULL, (double)st.write_us / 1e6);
+    logger_prom_sample(out, "logger_file_write_seconds_count", log, -1, NULL, (double)st.file_writes);
+    logger_prom_header(out, "logger_merged_total", "counter", "Real-time records written by the timestamp merge.");
+    logger_prom_sample(out, "logger_merged_total", log, -1, NULL, (double)st.merged);
+    logger_prom_header(out, "logger_merge_late_total", "counter", "Real-time records that arrived past the merge window.");
+    logger_prom_sample(out, "logger_merge_late_total", log, -1, NULL, (double)st.merge_late);
+    logger_prom_header(out, "logger_merge_seconds_total", "counter", "Ring writer time spent merging.");
+    logger_prom_sample(out, "logger_merge_seconds_total", log, -1, NULL, (double)st.merge_us / 1e6);
+
+    // Written with plain syscalls: the rendering went to metrics_buf, so the export allocates nothing
+    long len = ftell(out);
+    if (len > 0 && len < LOG_METRICS_BUFFER - 1) {
+        char tmp_path[strlen(logger->metrics_path) + 5]; // For ".tmp" suffix
+        snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", logger->metrics_path);
+        int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd >= 0) {
+            long written = 0;
+            while (written < len) {
+                ssize_t n = write(fd, logger->metrics_buf + written, (size_t)(len - written));
+                if (n <= 0 && errno != EINTR)
+                    break;
+                if (n > 0)
+                    written += n;
+            }
+            if (close(fd) == 0 && written == len)
+                rename(tmp_path, logger->metrics_path);
+            else
+                remove(tmp_path);
+        }
+    }
+    logger->metrics_prev = st;
+    logger->metrics_prev_ms = now_ms;
+    __atomic_store_n(&logger->metrics_busy, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Claims the metrics export if it is due.
+ *
+ * One relaxed load when it is not due. Otherwise the first thread to set
+ * metrics_busy wins and moves the deadline on, and must then call
+ * logger_export_metrics(), which clears the flag.
+ *
+ * @return 1 if the caller won the export, 0 otherwise.
+ */
+static inline int logger_metrics_due(struct Logger *logger, long long now_ms) {
+    if (now_ms < __atomic_load_n(&logger->metrics_next_ms, __ATOMIC_RELAXED))
+        return 0;
+    int idle = 0;
+    if (!__atomic_compare_exchange_n(&logger->metrics_busy, &idle, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return 0;
+    if (!logger->metrics_path || now_ms < logger->metrics_next_ms) {
+        __atomic_store_n(&logger->metrics_busy, 0, __ATOMIC_RELEASE);
+        return 0;
+    }
+    __atomic_store_n(&logger->metrics_next_ms, now_ms + logger->metrics_interval_ms, __ATOMIC_RELAXED);
+    return 1;
+}
+
+/**
+ * @brief Periodically writes the logger's counters to a Prometheus text file.
+ *
+ * Every interval_ms the file gets logger_get_stats() counters, per-level message
+ * rates over the last interval and a file write latency histogram, all labelled
+ * with log="<file path>". It is replaced by rename(), so a textfile collector
+ * never reads a partial file. The export runs on the frame writer when
+ * compression or checksums are on (checked at least every LOG_FRAME_FLUSH_MS).
+ * Without a frame writer it runs inside log_message() on whichever logging
+ * thread first finds it due, after that thread's line and outside file_lock:
+ * that one call pays for the open(), write() and rename() once per interval,
+ * while every other call pays one relaxed load and never waits for it. No
+ * thread is added either way.
+ *
+ * @param logger Pointer to the logger structure.
+ * @param path File to write, usually ending in ".prom" (NULL to stop exporting).
+ * @param interval_ms Time between exports.
+ */
+void set_metrics_export(struct Logger *logger, const char *path, long interval_ms) {
+    logger_metrics_claim(logger);
+    free(logger->metrics_path);
+    logger->metrics_path = NULL;
+    if (path && !logger->metrics_out) {
+        logger->metrics_buf = (char *)malloc(LOG_METRICS_BUFFER);
+        logger->metrics_out = logger->metrics_buf ? fmemopen(logger->metrics_buf, LOG_METRICS_BUFFER, "w") : NULL;
+        if (logger->metrics_out)
+            setvbuf(logger->metrics_out, NULL, _IONBF, 0); // No stdio buffer to allocate on the first export
+    }
+    if (path && logger->metrics_out)
+        logger->metrics_path = strdup(path);
+    logger->metrics_interval_ms = interval_ms > 0 ? interval_ms : 1;
+    __atomic_store_n(&logger->metrics_next_ms, logger->metrics_path ? 0 : LLONG_MAX, __ATOMIC_RELAXED);
+    __atomic_store_n(&logger->metrics_busy, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Starts counting messages per level and tag in a sliding time window.
+ *
+ * Every message that passes the level filters is counted in a ring of buckets of
+ * bucket_ms each, once for its level and once more for each tag of the logger
+ * (add_tag() interns the names, so a tag counts the messages logged after it was
+ * added). Threads count into the shard they use for logger_get_stats(), with a
+ * relaxed atomic per counter and no lock; log_rate_count() and log_rate() read
+ * the last buckets back. Call it before logging threads start: the counters can
+ * not be resized later, so later calls are ignored.
+ *
+ * @param logger Pointer to the logger structure.
+ * @param bucket_ms Time covered by one bucket, the resolution of the windows.
+ * @param buckets Buckets kept, so windows reach back bucket_ms * buckets.
+ */
+void set_rate_counters(struct Logger *logger, long bucket_ms, int buckets) {
+    if (logger->rates || bucket_ms < 1 || buckets < 2)
+        return;
+    struct LogRateCounters *rates = (struct LogRateCounters *)malloc(sizeof(*rates));
+    if (!rates)
+        return;
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    rates->origin_ms = (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+    rates->bucket_ms = bucket_ms;
+    rates->buckets = buckets;
+    size_t words = (size_t)buckets * LOG_NUM_LEVELS * LOG_RATE_TAG_SLOTS;
+    rates->shard_words = (words + 7) & ~(size_t)7; // 64-byte lines, so shards never share one
+    void *mem;
+    if (posix_memalign(&mem, 64, LOG_STATS_SHARDS * rates->shard_words * sizeof(uint64_t)) != 0) {
+        free(rates);
+        return;
+    }
+    memset(mem, 0, LOG_STATS_SHARDS * rates->shard_words * sizeof(uint64_t));
+    rates->words = (uint64_t *)mem;
+    __atomic_store_n(&logger->rates, rates, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Returns the bucket number of a wall-clock time, counted from set_rate_counters().
+ *
+ * Times before that (the clock was stepped back) land in bucket 0.
+ */
+static inline long long logger_rate_epoch(const struct LogRateCounters *rates, long long now_ms) {
+    return now_ms > rates->origin_ms ? (now_ms - rates->origin_ms) / rates->bucket_ms : 0;
+}
+
+/**
+ * @brief Counts a message in the calling thread's rate ring.
+ */
+static inline void logger_count_rate(struct Logger *logger, struct LogRateCounters *rates, enum LogLevel level,
+                                     long long now_ms) {
+    long long epoch = logger_rate_epoch(rates, now_ms);
+    uint64_t *words = rates->words + log_stats_shard_index() * rates->shard_words +
+                      ((size_t)(epoch % rates->buckets) * LOG_NUM_LEVELS + level) * LOG_RATE_TAG_SLOTS;
+    uint64_t stamp = (uint64_t)epoch & LOG_RATE_EPOCH_MASK;
+    log_rate_bump(&words[0], stamp, rates->buckets);
+    int num_tags = __atomic_load_n(&logger->num_tags, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < num_tags; i++)
+        log_rate_bump(&words[i + 1], stamp, rates->buckets);
+}
+
+/**
+ * @brief Sums one level and tag over the buckets of epochs first..last.
+ *
+ * @return The count, or 0 if rate counting is off or the tag is unknown.
+ */
+static inline unsigned long long logger_rate_sum(struct Logger *logger, enum LogLevel level, const char *tag,
+                                                 long long first, long long last) {
+    struct LogRateCounters *rates = __atomic_load_n(&logger->rates, __ATOMIC_ACQUIRE);
+    if (!rates || level < 0 || level >= LOG_NUM_LEVELS)
+        return 0;
+    int slot = 0;
+    if (tag) {
+        int num_tags = __atomic_load_n(&logger->num_tags, __ATOMIC_ACQUIRE);
+        while (slot < num_tags && strcmp(logger->tags[slot], tag) != 0)
+            slot++;
+        if (slot == num_tags)
+            return 0;
+        slot++;
+    }
+    if (first < last - rates->buckets + 1)
+        first = last - rates->buckets + 1;
+    unsigned long long total = 0;
+    for (long long epoch = first >= 0 ? first : 0; epoch <= last; epoch++) {
+        size_t offset = ((size_t)(epoch % rates->buckets) * LOG_NUM_LEVELS + level) * LOG_RATE_TAG_SLOTS + slot;
+        for (int shard = 0; shard < LOG_STATS_SHARDS; shard++) {
+            uint64_t v = __atomic_load_n(&rates->words[shard * rates->shard_words + offset], __ATOMIC_RELAXED);
+            if ((v >> LOG_RATE_COUNT_BITS) == ((uint64_t)epoch & LOG_RATE_EPOCH_MASK))
+                total += v & LOG_RATE_COUNT_MASK;
+        }
+    }
+    return total;
+}
+
+/**
+ * @brief Counts the messages of one level, and optionally one tag, in a recent window.
+ *
+ * The window is rounded up to whole buckets and includes the bucket in
+ * progress, so it holds the newest messages. It reaches back at most as far as
+ * set_rate_counters() keeps buckets.
+ *
+ * @param logger Pointer to the logger structure.
+ * @param level Level to count (exactly this level, not the ones above it).
+ * @param tag Tag to count, or NULL for every message of the level.
+ * @param window_ms Length of the window.
+ * @return Number of messages, or 0 if rate counting is off or the tag is unknown.
+ */
+unsigned long long log_rate_count(struct Logger *logger, enum LogLevel level, const char *tag, long window_ms) {
+    struct LogRateCounters *rates = __atomic_load_n(&logger->rates, __ATOMIC_ACQUIRE);
+    if (!rates)
+        return 0;
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    long long epoch = logger_rate_epoch(rates, (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000);
+    long long span = (window_ms + rates->bucket_ms - 1) / rates->bucket_ms;
+    return logger_rate_sum(logger, level, tag, epoch - (span > 1 ? span : 1) + 1, epoch);
+}
+
+/**
+ * @brief Returns the message rate of one level, and optionally one tag, in messages per second.
+ *
+ * Averages over the whole buckets that ended most recently and cover window_ms,
+ * leaving out the bucket in progress, so the rate does not dip at the start of
+ * every bucket. For "ERRORs per second over the last minute" pass ERROR and 60000.
+ *
+ * @param logger Pointer to the logger structure.
+ * @param level Level to count (exactly this level, not the ones above it).
+ * @param tag Tag to count, or NULL for every message of the level.
+ * @param window_ms Length of the window; at most bucket_ms * (buckets - 1) is covered.
+ * @return Messages per second, or 0 if rate counting is off or the tag is unknown.
+ */
+double log_rate(struct Logger *logger, enum LogLevel level, const char *tag, long window_ms) {
+    struct LogRateCounters *rates = __atomic_load_n(&logger->rates, __ATOMIC_ACQUIRE);
+    if (!rates)
+        return 0;
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    long long epoch = logger_rate_epoch(rates, (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000);
+    long long span = (window_ms + rates->bucket_ms - 1) / rates->bucket_ms;
+    if (span > rates->buckets - 1)
+        span = rates->buckets - 1;
+    if (span < 1)
+        span = 1;
+    unsigned long long count = logger_rate_sum(logger, level, tag, epoch - span, epoch - 1);
+    return (double)count * 1000.0 / (double)(span * rates->bucket_ms);
+}
+
+/**
+ * @brief Replaces the frame pipeline to match the requested settings.
+ *
+ * Frames are used when compressing, checksumming, or both; otherwise the file
+ * goes back to plain text. Must be called with file_lock held.
+ *
+ * @param logger Pointer to the logger structure.
+ * @param level Compression level (0 stores blocks uncompressed).
+ * @param block_size Raw bytes per frame.
+ * @param workers Number of compression threads.
+ */
+static inline void logger_restart_framer(struct Logger *logger, int level, size_t block_size, int workers) {
+    if (logger->framer) {
+        logger_framer_stop(logger->framer);
+        logger->framer = NULL;
+    }
+    logger_close_index(logger);
+    logger->bin.need_segment = 1; // Frames and plain records each start a segment of their own
+    if (level > 0 || logger->frame_checksum) {
+        logger->framer = logger_framer_start(logger, level, logger->frame_checksum, block_size, workers);
+        if (logger->framer)
+            logger_open_index(logger);
+        else
+            fprintf(stderr, "Error starting log frame writer, writing plain text\n");
+    }
+}
+
+/**
+ * @brief Switches the log file to compressed frames written by background workers.
+ *
+ * Lines are collected into blocks; each full block (or one that has waited
+ * LOG_FRAME_FLUSH_MS) is compressed by one of the workers and appended as a
+ * self-delimiting frame, in the order the blocks were filled. A crash loses at
+ * most the frames not yet written. Each frame records the time range of its
+ * lines, indexed in "<file>.idx". Use tools/logcat to read the file.
+ *
+ * @param logger Pointer to the logger structure.
+ * @param level Compression level from 1 (fastest) to LOG_LZ_MAX_LEVEL, or 0 for none (plain text unless checksummed).
+ * @param block_size Raw bytes per frame (0 for LOG_FRAME_BLOCK_SIZE).
+ * @param workers Number of compression threads (1 to LOG_FRAME_MAX_WORKERS).
+ */
+void set_file_compression(struct Logger *logger, int level, size_t block_size, int workers) {
+    if (block_size == 0)
+        block_size = LOG_FRAME_BLOCK_SIZE;
+    if (block_size < LOG_BIN_MAX_RECORD)
+        block_size = LOG_BIN_MAX_RECORD;
+    if (block_size > LOG_FRAME_MAX_BLOCK)
+        block_size = LOG_FRAME_MAX_BLOCK;
+    if (workers < 1)
+        workers = 1;
+    if (workers > LOG_FRAME_MAX_WORKERS)
+        workers = LOG_FRAME_MAX_WORKERS;
+
+    pthread_mutex_lock(&logger->file_lock);
+    logger_restart_framer(logger, level, block_size, workers);
+    pthread_mutex_unlock(&logger->file_lock);
+}
+
+/**
+ * @brief Frames the log file in blocks that each end with a CRC32C checksum.
+ *
+ * Without compression the blocks are stored as is; either way tools/logverify
+ * can then detect torn or corrupted blocks. The CRC uses the SSE4.2 or ARMv8
+ * CRC instructions when the CPU has them.
+ *
+ * @param logger Pointer to the logger structure.
+ * @param checksum Flag indicating whether to checksum file blocks (1) or not (0).
+ */
+void set_file_checksum(struct Logger *logger, int checksum) {
+    pthread_mutex_lock(&logger->file_lock);
+    logger->frame_checksum = checksum;
+    if (logger->framer)
+        logger_restart_framer(logger, logger->framer->level, logger->framer->block_size, logger->framer->num_workers);
+    else
+        logger_restart_framer(logger, 0, LOG_FRAME_BLOCK_SIZE, 1);
+    pthread_mutex_unlock(&logger->file_lock);
+}
+
+/**
+ * @brief Chooses whether every write to the log file is flushed right away.
+ *
+ * Flushing (the default) puts each line in the kernel before log_message()
+ * returns, so a crash of the process loses nothing. Without it lines collect in
+ * the stdio buffer until it fills or flush_logger(), rotate_log() or
+ * close_logger() is called, which saves a write() per line (or per frame with
+ * compressed and checksummed output).
+ *
+ * @param logger Pointer to the logger structure.
+ * @param flush Flag indicating whether to flush every write (1) or not (0).
+ */
+void set_file_flush(struct Logger *logger, int flush) {
+    pthread_mutex_lock(&logger->file_lock);
+    logger->file_flush = flush;
+    if (flush && logger->file)
+        fflush(logger->file);
+    pthread_mutex_unlock(&logger->file_lock);
+}
+
+/**
+ * @brief Chooses between text lines and binary records for the log file.
+ *
+ * Binary records store the format string and raw arguments with delta-encoded
+ * timestamps and ids, and are only rendered when read back with tools/logcat.
+ * The console is unaffected. Switch formats on a fresh file (or right before
+ * set_log_file()): a file that changes from binary back to text does not read back.
+ *
+ * @param logger Pointer to the logger structure.
+ * @param format LOG_FORMAT_TEXT or LOG_FORMAT_BINARY.
+ */
+void set_file_format(struct Logger *logger, enum LogFileFormat format) {
+    pthread_mutex_lock(&logger->file_lock);
+    if (logger->file)
+        logger_drain_deferred(logger, 1); // Deferred entries are in the old format
+    logger->file_format = format;
+    logger->bin.need_segment = 1;
+    if (format == LOG_FORMAT_BINARY && !logger->strings)
+        logger->strings = (struct LogStringDict *)calloc(1, sizeof(*logger->strings)); // Without it strings stay literal
+    if (format == LOG_FORMAT_BINARY && !logger->formats)
+        logger->formats = (struct LogFormatTable *)calloc(1, sizeof(*logger->formats)); // Without it formats stay inline
+    pthread_mutex_unlock(&logger->file_lock);
+}
+
+/**
+ * @brief Sets the compression level that rotate_log() applies to finished segments.
+ *
+ * Rotated segments are rewritten as "<file>.old.l4z" at this level and the
+ * uncompressed ".old" file is removed. Higher levels than the live file are
+ * worthwhile here since the work is done once, off the logging path.
+ *
+ * @param logger Pointer to the logger structure.
+ * @param level Compression level from 1 to LOG_LZ_MAX_LEVEL, or 0 to keep rotated segments as they are.
+ */
+void set_rotate_compression(struct Logger *logger, int level) {
+    logger->rotate_level = level;
+}
+
+static inline size_t logger_rt_drain(struct Logger *logger, int all);
+struct LogRenderPool;
+static inline void logger_render_sync(struct LogRenderPool *pool);
+
+/**
+ * @brief Writes out any log text still buffered for the file.
+ *
+ * Lines held back by the file throttle are written too, even over budget. With
+ * compression enabled this seals the current block and waits until all frames
+ * are on disk.
+ *
+ * @param logger Pointer to the logger structure.
+ */
+void flush_logger(struct Logger *logger) {
+    if (__atomic_load_n(&logger->rt_id, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(&logger->rt_lock);
+        logger_rt_drain(logger, 1);
+        if (logger->rt_render)
+            logger_render_sync(logger->rt_render);
+        pthread_mutex_unlock(&logger->rt_lock);
+    }
+    pthread_mutex_lock(&logger->file_lock);
+    if (logger->file)
+        logger_drain_deferred(logger, 1); // Lines held back by the throttle, budget or not
+    if (logger->framer)
+        logger_framer_sync(logger->framer);
+    if (logger->file) {
+        fflush(logger->file);
+        log_stats_add(&logger->sink.flushes, 1);
+    }
+    pthread_mutex_unlock(&logger->file_lock);
+}
+
+/**
+ * @brief Writes one frame, and its index entry if it is timed.
+ *
+ * @return 0 on success, -1 on a write error.
+ */
+static inline int logger_write_frame(FILE *out, FILE *index, struct LogLzState *lz, int level, const char *raw,
+                                     size_t raw_len, long long first_ms, long long last_ms, unsigned char *frame) {
+    long long offset = (long long)ftello(out);
+    size_t len = log_frame_encode(lz, level, raw, raw_len, first_ms, last_ms, 1, frame);
+    if (fwrite(frame, 1, len, out) != len)
+        return -1;
+    if (last_ms && index) {
+        unsigned char entry[LOG_INDEX_ENTRY_SIZE];
+        log_index_encode(entry, first_ms, last_ms, offset, len, raw_len);
+        if (fwrite(entry, 1, sizeof(entry), index) != sizeof(entry))
+            return -1;
+    }
+    return 0;
+}
+
+void close_logger(struct Logger *logger);
+
+/**
+ * @brief Re-encodes the binary records of a plain run into frames that each start a segment.
+ *
+ * The records are decoded with the reader's running state and encoded again with
+ * a scratch logger, so every output frame decodes on its own. Must be called with
+ * whole or partial input runs in order; incomplete records wait in pending.
+ *
+ * @return 0 on success, -1 on a write error or corrupt record.
+ */
+static inline int logger_transcode_binary(struct Logger *scratch, struct LogBinaryDecoder *dec, unsigned char **pending,
+                                          size_t *pending_len, const unsigned char *data, size_t len, char *block,
+                                          size_t *fill, long long *first_ms, long long *last_ms, FILE *out, FILE *index,
+                                          struct LogLzState *lz, int level, unsigned char *frame) {
+    unsigned char *grown = (unsigned char *)realloc(*pending, *pending_len + len);
+    if (!grown)
+        return -1;
+    *pending = grown;
+    memcpy(*pending + *pending_len, data, len);
+    *pending_len += len;
+
+    size_t pos = 0;
+    int result = 0;
+    while (result == 0 && pos < *pending_len) {
+        unsigned char capture[LOG_MAX_LINE_LENGTH];
+        size_t used = 0;
+        long captured = log_binary_decode_capture(dec, *pending + pos, *pending_len - pos, capture, sizeof(capture), &used);
+        if (captured == -1)
+            break;
+        if (captured < 0) {
+            result = -1;
+            break;
+        }
+        pos += used;
+        if (captured == 0) {
+            // Control record: carry the decoded context over to the scratch logger
+            free(scratch->prefix);
+            free(scratch->date_format);
+            scratch->prefix = strdup(dec->prefix);
+            scratch->date_format = strdup(dec->date_format);
+            scratch->include_thread_id = (dec->flags & LOG_BIN_SHOW_THREAD) != 0;
+            scratch->include_process_id = (dec->flags & LOG_BIN_SHOW_PROCESS) != 0;
+            scratch->include_sequence = (dec->flags & LOG_BIN_SHOW_SEQUENCE) != 0;
+            memcpy(scratch->tags, dec->tag_names, sizeof(scratch->tags));
+            scratch->num_tags = dec->num_tags;
+            scratch->context_version++;
+            if (!scratch->prefix || !scratch->date_format)
+                result = -1;
+            continue;
+        }
+        long long ms = dec->last_us / 1000;
+        int n = logger_binary_encode(scratch, capture, (unsigned char *)block + *fill, LOG_FRAME_BLOCK_SIZE - *fill);
+        if (n < 0 && *fill > 0) {
+            result = logger_write_frame(out, index, lz, level, block, *fill, *first_ms, *last_ms, frame);
+            *fill = 0;
+            scratch->bin.need_segment = 1;
+            n = logger_binary_encode(scratch, capture, (unsigned char *)block, LOG_FRAME_BLOCK_SIZE);
+        }
+        if (n < 0)
+            continue; // Cannot be re-encoded on its own; dropped
+        if (*fill == 0)
+            *first_ms = ms;
+        *last_ms = ms;
+        *fill += (size_t)n;
+    }
+    memmove(*pending, *pending + pos, *pending_len - pos);
+    *pending_len -= pos;
+    return result;
+}
+
+/**
+ * @brief Compresses a log file (plain text or frames) into frames at the given level.
+ *
+ * Frames in the input keep their boundaries and time ranges, and a side index
+ * "<dst_path>.idx" is written for them. Plain text is packed into untimed frames.
+ * Plain binary records are re-encoded into timed frames that each start a
+ * segment, so they can be decoded one frame at a time like live frames.
+ * Every output frame gets a CRC32C trailer, since finished segments are kept longest.
+ *
+ * @param src_path File to read.
+ * @param dst_path File to create.
+ * @param level Compression level from 1 to LOG_LZ_MAX_LEVEL.
+ * @return 0 on success, -1 on error (dst_path is removed).
+ */
+int compress_log_file(const char *src_path, const char *dst_path, int level) {
+    char index_path[strlen(dst_path) + 5]; // For ".idx" suffix
+    snprintf(index_path, sizeof(index_path), "%s.idx", dst_path);
+    FILE *in = fopen(src_path, "rb");
+    if (!in)
+        return -1;
+    FILE *out = fopen(dst_path, "wb");
+    FILE *index = fopen(index_path, "wb");
+    if (!out || !index) {
+        if (out)
+            fclose(out);
+        if (index)
+            fclose(index);
+        fclose(in);
+        return -1;
+    }
+
+    char *block = (char *)malloc(LOG_FRAME_BLOCK_SIZE);
+    unsigned char *frame = (unsigned char *)malloc(LOG_FRAME_OVERHEAD + LOG_FRAME_MAX_BLOCK); // Input frames may be this large
+    struct LogLzState *lz = (struct LogLzState *)calloc(1, sizeof(*lz));
+    struct LogBinaryDecoder *dec = (struct LogBinaryDecoder *)malloc(sizeof(*dec));
+    int result = block && frame && lz && dec ? 0 : -1;
+
+    struct LogReader reader;
+    log_reader_init(&reader, in);
+    struct Logger scratch; // Re-encodes plain binary records
+    init_logger(&scratch, ERROR, ERROR, dst_path, NULL, 0, 0, 0);
+    int binary = 0;
+    unsigned char *pending = NULL;
+    size_t pending_len = 0;
+    long long first_ms = 0;
+    long long last_ms = 0;
+    size_t fill = 0;
+    const char *text;
+    long n = 0;
+    while (result == 0 && (n = log_reader_next(&reader, &text)) != 0) {
+        if (n < 0) {
+            result = -1;
+            break;
+        }
+        if (reader.in_frame) {
+            // Frame boundaries carry the time index; keep them as they are
+            if (fill > 0)
+                result = logger_write_frame(out, index, lz, level, block, fill, binary ? first_ms : 0, binary ? last_ms : 0, frame);
+            fill = 0;
+            binary = 0;
+            pending_len = 0; // An incomplete record cannot continue inside a frame
+            if (result == 0)
+                result = logger_write_frame(out, index, lz, level, text, (size_t)n,
+                                            reader.frame.first_ms, reader.frame.last_ms, frame);
+            continue;
+        }
+        if (!binary) {
+            size_t segment = log_find_segment((const unsigned char *)text, (size_t)n);
+            if (segment < (size_t)n) {
+                // Text up to the segment, then binary records from there on
+                if (segment > 0 && fill + segment <= LOG_FRAME_BLOCK_SIZE) {
+                    memcpy(block + fill, text, segment);
+                    fill += segment;
+                } else if (segment > 0) {
+                    result = logger_write_frame(out, index, lz, level, block, fill, 0, 0, frame);
+                    fill = 0;
+                    if (result == 0)
+                        result = logger_write_frame(out, index, lz, level, text, segment, 0, 0, frame);
+                }
+                if (result == 0 && fill > 0)
+                    result = logger_write_frame(out, index, lz, level, block, fill, 0, 0, frame);
+                fill = 0;
+                binary = 1;
+                reader.unframed = 1; // Raw records may contain anything, including what looks like a frame
+                if (result == 0 && scratch.file_format != LOG_FORMAT_BINARY)
+                    set_file_format(&scratch, LOG_FORMAT_BINARY);
+                scratch.bin.need_segment = 1;
+                text += segment;
+                n -= (long)segment;
+            }
+        }
+        if (binary) {
+            if (result == 0)
+                result = logger_transcode_binary(&scratch, dec, &pending, &pending_len, (const unsigned char *)text, (size_t)n,
+                                                 block, &fill, &first_ms, &last_ms, out, index, lz, level, frame);
+            continue;
+        }
+        while (n > 0 && result == 0) {
+            size_t take = LOG_FRAME_BLOCK_SIZE - fill < (size_t)n ? LOG_FRAME_BLOCK_SIZE - fill : (size_t)n;
+            memcpy(block + fill, text, take);
+            fill += take;
+            text += take;
+            n -= (long)take;
+            if (fill < LOG_FRAME_BLOCK_SIZE)
+                break;
+            // Cut the frame after the last complete line and carry the rest over
+            size_t cut = fill;
+            while (cut > 0 && block[cut - 1] != '\n')
+                cut--;
+            if (cut == 0)
+                cut = fill;
+            result = logger_write_frame(out, index, lz, level, block, cut, 0, 0, frame);
+            memmove(block, block + cut, fill - cut);
+            fill -= cut;
+        }
+    }
+    if (result == 0 && fill > 0)
+        result = logger_write_frame(out, index, lz, level, block, fill, binary ? first_ms : 0, binary ? last_ms : 0, frame);
+
+    log_reader_free(&reader);
+    close_logger(&scratch);
+    free(pending);
+    free(dec);
+    free(block);
+    free(frame);
+    free(lz);
+    fclose(in);
+    if (fclose(out) != 0 || fclose(index) != 0)
+        result = -1;
+    if (result != 0) {
+        remove(dst_path);
+        remove(index_path);
+    }
+    return result;
+}
+
+/**
+ * @brief Sets the log levels for console and file output.
+ * 
+ * @param logger Pointer to the logger structure.
+ * @param console_level Minimum log level for console output.
+ * @param file_level Minimum log level for file output.
+ */
+void set_log_levels(struct Logger *logger, enum LogLevel console_level, enum LogLevel file_level) {
+    logger->console_level = console_level;
+    logger->file_level = file_level;
+}
+
+/**
+ * @brief Sets the date format for log entries.
+ * 
+ * @param logger Pointer to the logger structure.
+ * @param date_format Custom date format for log entries.
+ */
+void set_date_format(struct Logger *logger, const char *date_format) {
+    logger_context_changing(logger);
+    free(logger->date_format); // Free previous memory
+    logger->date_format = strdup(date_format); // Dynamic memory allocation
+}
+
+/**
+ * @brief Sets whether logging to file is enabled or not.
+ * 
+ * @param logger Pointer to the logger structure.
+ * @param log_to_file Flag indicating whether logging to file is enabled (1) or not (0).
+ */
+void set_log_to_file(struct Logger *logger, int log_to_file) {
+    logger->log_to_file = log_to_file;
+}
+
+/**
+ * @brief Sets whether to include thread ID in log messages or not.
+ * 
+ * @param logger Pointer to the logger structure.
+ * @param include_thread_id Flag indicating whether to include thread ID in log messages (1) or not (0).
+ */
+void set_include_thread_id(struct Logger *logger, int include_thread_id) {
+    logger_context_changing(logger);
+    logger->include_thread_id = include_thread_id;
+}
+
+/**
+ * @brief Sets whether to include process ID in log messages or not.
+ * 
+ * @param logger Pointer to the logger structure.
+ * @param include_process_id Flag indicating whether to include process ID in log messages (1) or not (0).
+ */
+void set_include_process_id(struct Logger *logger, int include_process_id) {
+    logger_context_changing(logger);
+    logger->include_process_id = include_process_id;
+}
+
+/**
+ * @brief Sets whether to include the per-thread sequence number in log messages or not.
+ *
+ * Each thread numbers its messages to the logger from 1, counting every message
+ * that passes a level filter, so gaps show what was dropped on the way. Numbering
+ * starts when this is turned on and never restarts while the logger is open. A
+ * thread claims one of LOG_SEQ_SLOTS counters, allocated by the first call that
+ * turns sequences on, on its first numbered message or when it attaches for
+ * real-time logging, and frees it on exit. Threads beyond LOG_SEQ_SLOTS share
+ * one counter instead. Shown as " | Seq: N" after the ids.
+ *
+ * @param logger Pointer to the logger structure.
+ * @param include_sequence Flag indicating whether to include the sequence number in log messages (1) or not (0).
+ */
+void set_include_sequence(struct Logger *logger, int include_sequence) {
+    if (include_sequence && !logger->seq_slots) {
+        void *slots;
+        if (posix_memalign(&slots, 64, LOG_SEQ_SLOTS * sizeof(struct LogSeqCounter)) != 0) {
+            fprintf(stderr, "Error allocating sequence counters, numbering from one shared counter\n");
+        } else if (pthread_key_create(&logger->seq_key, logger_seq_release) != 0) {
+            fprintf(stderr, "Error creating sequence counter key, numbering from one shared counter\n");
+            free(slots);
+        } else {
+            memset(slots, 0, LOG_SEQ_SLOTS * sizeof(struct LogSeqCounter));
+            __atomic_store_n(&logger->seq_slots, (struct LogSeqCounter *)slots, __ATOMIC_RELEASE);
+        }
+    }
+    logger_context_changing(logger);
+    logger->include_sequence = include_sequence;
+}
+
+/**
+ * @brief Renders the start of a log line: timestamp, level, prefix and optional ids.
+ *
+ * @return Length of the header, which may exceed size if it was truncated.
+ */
+static inline int logger_format_header(struct Logger *logger, enum LogLevel level, time_t seconds, unsigned long thread,
+                                       int process, unsigned long long seq, char *line, size_t size) {
+    struct tm timeInfo;
+    char timeBuffer[64]; // Sufficiently large buffer for date/time
+    localtime_r(&seconds, &timeInfo);
+    strftime(timeBuffer, sizeof(timeBuffer), logger->date_format, &timeInfo);
+
+    int len = snprintf(line, size, "%s | %s %s", timeBuffer, log_level_name(level), logger->prefix);
+    if (logger->include_thread_id && len < (int)size) {
+        len += snprintf(line + len, size - len, " | Thread ID: %lu", thread);
+    }
+    if (logger->include_process_id && len < (int)size) {
+        len += snprintf(line + len, size - len, " | Process ID: %d", process);
+    }
+    if (logger->include_sequence && len < (int)size) {
+        len += snprintf(line + len, size - len, " | Seq: %llu", seq);
+    }
+    if (len < (int)size)
+        len += snprintf(line + len, size - len, " | ");
+    return len;
+}
+
+/**
+ * @brief Renders a log line: timestamp, level, prefix, optional ids and the message.
+ *
+ * Long messages are truncated, but the line always ends with a newline.
+ *
+ * @param logger Pointer to the logger structure.
+ * @param level Log level of the message.
+ * @param seconds Time of the message.
+ * @param thread Thread id to show, if enabled.
+ * @param process Process id to show, if enabled.
+ * @param seq Sequence number to show, if enabled.
+ * @param line Output buffer.
+ * @param size Size of line.
+ * @param message_offset Receives the offset of the message text within line.
+ * @param format Format string for the message.
+ * @param args Arguments for the format string.
+ * @return Length of the line, including the newline.
+ */
+static inline int logger_format_line(struct Logger *logger, enum LogLevel level, time_t seconds, unsigned long thread,
+                                     int process, unsigned long long seq, char *line, size_t size, size_t *message_offset,
+                                     const char *format, va_list args) {
+    int len = logger_format_header(logger, level, seconds, thread, process, seq, line, size);
+    *message_offset = len < (int)size ? (size_t)len : size - 1;
+
+    if (len < (int)size - 1)
+        len += vsnprintf(line + len, size - len, format, args);
+
+    // Truncate long messages but always keep the trailing newline
+    if (len > (int)size - 2)
+        len = (int)size - 2;
+    if (*message_offset > (size_t)len)
+        *message_offset = (size_t)len;
+    line[len++] = '\n';
+    line[len] = '\0';
+    return len;
+}
+
+/**
+ * @brief Renders a captured message as the log line log_message() would have written.
+ *
+ * @param logger Pointer to the logger structure.
+ * @param capture Capture from log_capture().
+ * @param line Output buffer.
+ * @param size Size of line.
+ * @return Length of the line, including the newline.
+ */
+static inline int logger_format_capture(struct Logger *logger, const unsigned char *capture, char *line, size_t size) {
+    struct LogCapture c;
+    memcpy(&c, capture, sizeof(c));
+    int len = logger_format_header(logger, (enum LogLevel)c.level, (time_t)(c.us / 1000000), c.thread, c.process, c.seq,
+                                   line, size);
+    if (len < (int)size - 1) {
+        int n = log_render_message(c.format, capture + sizeof(c), c.args_len, line + len, size - len);
+        if (n > 0)
+            len += n;
+    }
+    if (len > (int)size - 2)
+        len = (int)size - 2;
+    line[len++] = '\n';
+    line[len] = '\0';
+    return len;
+}
+
+/*
+ * Real-time mode. A thread that called attach_realtime_thread() logs into a
+ * ring of its own: log_message() captures the arguments, stamps them with
+ * log_cycles() and copies them in, with no lock, allocation or system call. A
+ * writer thread polls the rings, turns cycle stamps into wall-clock time and
+ * renders and writes the lines as log_message() would have.
+ */
+#define LOG_RT_RECORD_HEADER 16       // Capture length, padding and cycle stamp before each capture
+#define LOG_RT_WRAP 0xFFFFFFFFU       // Length marking the unused end of the ring
+#define LOG_RT_MIN_RING (64 * 1024)   // Smallest ring, enough for several of the largest captures
+#define LOG_RT_CALIBRATE_MS 10        // Cycle counter measured against the clock for this long at startup
+
+/**
+ * @brief Single-producer ring of captures owned by one real-time thread.
+ */
+struct LogRtRing {
+    size_t head;                  // Bytes pushed so far; written by the producer only
+    unsigned long long dropped;   // Messages that did not fit; written by producers only
+    unsigned char *buf;           // Record storage
+    size_t capacity;              // Size of buf, a power of two
+    char pad[64 - 2 * sizeof(size_t) - sizeof(unsigned long long) - sizeof(unsigned char *)];
+    size_t tail;                  // Bytes consumed so far; written by the ring writer only
+    int mapped;                   // buf was mapped with mmap() rather than allocated
+    int shared;                   // A per-CPU ring: any thread may push, so records carry a ready flag
+    int detached;                 // The thread is done with the ring; freed once it is empty
+    struct LogRtRing *next;       // Next ring of the logger
+};
+
+struct LogRtHead {
+    struct LogRtRing *ring;       // Ring the record is in
+    size_t pos;                   // Offset of the record in the ring's buffer
+    uint64_t cycles;              // Its timestamp
+    uint32_t len;                 // Size of its capture
+};
+
+static unsigned long long log_rt_next_id;        // Source of Logger.rt_id values
+static __thread struct LogRtRing *log_rt_ring;   // This thread's ring
+static __thread unsigned long long log_rt_owner; // rt_id of the logger the ring belongs to (0 = none)
+
+#define LOG_MAX_NUMA_NODES 1024 // Nodes a ring placement mask can name
+
+enum LogRingPlacement {
+    LOG_RING_HEAP,  // From the heap
+    LOG_RING_MAP,   // Mapped; pages land on the node of whoever touches them first
+    LOG_RING_LOCAL  // Mapped and bound, preferably, to the calling thread's NUMA node
+};
+
+#define LOG_HUGE_PAGE_SIZE (2UL << 20) // Explicit huge pages are used only for buffers a multiple of this
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23 // Linux 5.14
+#endif
+
+/**
+ * @brief Maps an anonymous buffer, with huge pages if asked and available.
+ *
+ * Tries MAP_HUGETLB first, which needs huge pages reserved by the
+ * administrator, then normal pages with MADV_HUGEPAGE so transparent huge
+ * pages can back them.
+ *
+ * @return The mapping, or MAP_FAILED.
+ */
+static inline void *logger_map_buffer(size_t size, int pages) {
+    int populate = 0;
+#ifdef MAP_POPULATE
+    populate = pages & LOG_PAGES_POPULATE ? MAP_POPULATE : 0;
+#endif
+#ifdef MAP_HUGETLB
+    if ((pages & LOG_PAGES_HUGE) && size % LOG_HUGE_PAGE_SIZE == 0) {
+        void *buf = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | populate, -1, 0);
+        if (buf != MAP_FAILED)
+            return buf;
+    }
+#endif
+    void *buf = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+#ifdef MADV_HUGEPAGE
+    if (buf != MAP_FAILED && (pages & LOG_PAGES_HUGE))
+        madvise(buf, size, MADV_HUGEPAGE);
+#endif
+    (void)populate; // Populated after any NUMA binding, below
+    return buf;
+}
+
+/**
+ * @brief Allocates the buffer of a ring.
+ *
+ * Mapped buffers start out zeroed. A mapping that fails falls back to the heap.
+ * Huge pages or populating (LOG_PAGES_* in pages) imply a mapping.
+ *
+ * @return The buffer, or NULL. *mapped tells which way it was allocated.
+ */
+static inline unsigned char *logger_rt_alloc_buffer(size_t size, enum LogRingPlacement placement, int pages, int *mapped) {
+    *mapped = 0;
+#ifdef __linux__
+    if (placement != LOG_RING_HEAP || pages) {
+        void *buf = logger_map_buffer(size, pages);
+        if (buf != MAP_FAILED) {
+            unsigned cpu, node;
+            if (placement == LOG_RING_LOCAL && syscall(SYS_getcpu, &cpu, &node, NULL) == 0 && node < LOG_MAX_NUMA_NODES) {
+                unsigned long nodes[LOG_MAX_NUMA_NODES / (8 * sizeof(unsigned long))] = {0};
+                nodes[node / (8 * sizeof(unsigned long))] = 1UL << (node % (8 * sizeof(unsigned long)));
+                syscall(SYS_mbind, buf, size, MPOL_PREFERRED, nodes, (unsigned long)LOG_MAX_NUMA_NODES, 0);
+            }
+            // MAP_POPULATE would fault the pages in before the binding and the
+            // huge page advice took effect, so populate afterwards (a no-op for
+            // a MAP_HUGETLB mapping already populated)
+            if ((pages & LOG_PAGES_POPULATE) && madvise(buf, size, MADV_POPULATE_WRITE) != 0)
+                memset(buf, 0, size); // Kernel before 5.14
+            *mapped = 1;
+            return (unsigned char *)buf;
+        }
+    }
+#else
+    (void)placement;
+    (void)pages;
+#endif
+    void *buf;
+    return posix_memalign(&buf, 64, size) == 0 ? (unsigned char *)buf : NULL;
+}
+
+/**
+ * @brief Frees a ring and its buffer.
+ */
+static inline void logger_rt_free_ring(struct LogRtRing *ring) {
+    if (ring->mapped)
+        munmap(ring->buf, ring->capacity);
+    else
+        free(ring->buf);
+    free(ring);
+}
+
+/**
+ * @brief Appends a capture to a ring.
+ *
+ * @return 0 on success, -1 if the ring is full.
+ */
+static inline int log_rt_push(struct LogRtRing *ring, uint64_t cycles, const unsigned char *capture, size_t len) {
+    size_t need = LOG_RT_RECORD_HEADER + ((len + 7) & ~(size_t)7);
+    size_t head = ring->head;
+    size_t pos = head & (ring->capacity - 1);
+    size_t skip = ring->capacity - pos < need ? ring->capacity - pos : 0; // Records never wrap
+    if (head + skip + need - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) > ring->capacity)
+        return -1;
+    if (skip) {
+        uint32_t wrap = LOG_RT_WRAP;
+        memcpy(ring->buf + pos, &wrap, sizeof(wrap));
+        pos = 0;
+    }
+    uint32_t header[2] = {(uint32_t)len, 0};
+    memcpy(ring->buf + pos, header, sizeof(header));
+    memcpy(ring->buf + pos + sizeof(header), &cycles, sizeof(cycles));
+    memcpy(ring->buf + pos + LOG_RT_RECORD_HEADER, capture, len);
+    __atomic_store_n(&ring->head, head + skip + need, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/**
+ * @brief Appends a capture to a per-CPU ring, which other threads may push to at the same time.
+ *
+ * Space is claimed by advancing head with a compare-and-swap. Threads on one
+ * CPU rarely collide, since only preemption or migration puts two of them in
+ * here together, so the CAS nearly always succeeds at once. The record is
+ * then filled in and published by setting the ready word of its header (the
+ * marker skipping the end of the buffer gets one too), and the ring writer
+ * stops at the first record that is not ready. It zeroes what it consumes, so
+ * unclaimed space always reads as not ready.
+ *
+ * The record is stamped right before its claim rather than when the message
+ * was logged, which keeps the ring in time order unless a thread is preempted
+ * between those two instructions.
+ *
+ * @return 0 on success, -1 if the ring is full.
+ */
+static inline int log_rt_push_shared(struct LogRtRing *ring, const unsigned char *capture, size_t len) {
+    size_t need = LOG_RT_RECORD_HEADER + ((len + 7) & ~(size_t)7);
+    size_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    size_t pos, skip;
+    uint64_t cycles;
+    do {
+        cycles = log_cycles();
+        pos = head & (ring->capacity - 1);
+        skip = ring->capacity - pos < need ? ring->capacity - pos : 0;
+        if (head + skip + need - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) > ring->capacity)
+            return -1;
+    } while (!__atomic_compare_exchange_n(&ring->head, &head, head + skip + need, 1, __ATOMIC_RELAXED,
+                                          __ATOMIC_RELAXED));
+    if (skip) {
+        uint32_t wrap = LOG_RT_WRAP;
+        memcpy(ring->buf + pos, &wrap, sizeof(wrap));
+        __atomic_store_n((uint32_t *)(ring->buf + pos + sizeof(uint32_t)), 1, __ATOMIC_RELEASE);
+        pos = 0;
+    }
+    uint32_t record_len = (uint32_t)len;
+    memcpy(ring->buf + pos, &record_len, sizeof(record_len));
+    memcpy(ring->buf + pos + 2 * sizeof(uint32_t), &cycles, sizeof(cycles));
+    memcpy(ring->buf + pos + LOG_RT_RECORD_HEADER, capture, len);
+    __atomic_store_n((uint32_t *)(ring->buf + pos + sizeof(uint32_t)), 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/**
+ * @brief CPU the calling thread is running on.
+ *
+ * glibc answers sched_getcpu() from the rseq area the kernel keeps up to date,
+ * or else from the vDSO, so this makes no system call. The answer can be stale
+ * by the time it is used; per-CPU rings take pushes from any thread for that reason.
+ */
+static inline int log_rt_cpu(void) {
+#ifdef __linux__
+    int cpu = sched_getcpu();
+    return cpu < 0 ? 0 : cpu;
+#else
+    return 0;
+#endif
+}
+
+/**
+ * @brief Refines the cycle counter rate against the wall clock. Called with rt_lock held.
+ */
+static inline void logger_rt_calibrate(struct Logger *logger) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    uint64_t cycles = log_cycles();
+    long long ns = (long long)now.tv_sec * 1000000000LL + now.tv_nsec;
+    if (cycles > logger->rt_base_cycles && ns - logger->rt_base_ns >= LOG_RT_CALIBRATE_MS * 1000000LL)
+        logger->rt_ns_per_cycle = (double)(ns - logger->rt_base_ns) / (double)(cycles - logger->rt_base_cycles);
+}
+
+/**
+ * @brief Writes a captured message to the console and the log file, as log_message() would.
+ *
+ * @param logger Pointer to the logger structure.
+ * @param capture Capture from log_capture(), with its time filled in.
+ * @param len Size of the capture.
+ */
+static inline void logger_emit_capture(struct Logger *logger, const unsigned char *capture, size_t len) {
+    struct LogCapture c;
+    memcpy(&c, capture, sizeof(c));
+    enum LogLevel level = (enum LogLevel)c.level;
+    long long time_ms = c.us / 1000;
+    char line[LOG_MAX_LINE_LENGTH];
+    int line_len = -1;
+    if (level >= logger->console_level) {
+        line_len = logger_format_capture(logger, capture, line, sizeof(line));
+        fwrite(line, 1, line_len, stdout);
+        if (logger->stats)
+            log_stats_add(&log_stats_shard(logger->stats)->console_bytes, (unsigned long long)line_len);
+    }
+    if (logger->log_to_file && logger->file && level >= logger->file_level) {
+        if (line_len < 0 && logger->file_format != LOG_FORMAT_BINARY)
+            line_len = logger_format_capture(logger, capture, line, sizeof(line));
+        pthread_mutex_lock(&logger->file_lock);
+        if (logger->file_format == LOG_FORMAT_BINARY)
+            logger_write_file(logger, level, (const char *)capture, len, time_ms);
+        else
+            logger_write_file(logger, level, line, (size_t)line_len, time_ms);
+        pthread_mutex_unlock(&logger->file_lock);
+    }
+}
+
+#define LOG_RENDER_BATCH (64 * 1024) // Capture bytes per render batch
+#define LOG_RENDER_ITEMS 512         // Records per render batch
+
+/*
+ * Render pipeline of the real-time writer. The ring writer merges records into
+ * batches, a pool of workers turns the batches into text in parallel, and the
+ * batches are written out in the order they were filled. The slot ring and its
+ * ordered write-out work as in the frame pipeline (LogFramer).
+ */
+
+struct LogRenderItem {
+    uint32_t capture;    // Offset of the capture in the batch
+    uint32_t len;        // Size of the capture
+    size_t line;         // Offset of its rendered line in the batch's lines
+    int line_len;        // Length of the line (-1 = not rendered)
+};
+
+struct LogRenderSlot {
+    unsigned char *captures;     // Captures of the batch, back to back
+    size_t captures_len;         // Bytes used in captures
+    struct LogRenderItem *items; // The batch's records, in output order
+    int count;                   // Number of records in the batch
+    char *lines;                 // Rendered lines
+    size_t lines_cap;            // Size of lines
+    enum LogSlotState state;
+};
+
+struct LogRenderPool {
+    struct Logger *logger;       // Logger whose sinks receive the lines
+    struct LogRenderSlot *slots; // Ring of batches, in output order
+    int num_slots;               // Number of slots in the ring
+    int fill;                    // Slot the ring writer is adding records to
+    int claim;                   // Next sealed slot for a worker to render
+    int next;                    // Next slot to be written out
+    int writing;                 // A worker is currently writing batches out in order
+    int stop;                    // Set to ask the workers to exit
+    pthread_mutex_t lock;        // Protects the slot ring
+    pthread_cond_t work;         // Signalled when a slot is sealed or the workers should stop
+    pthread_cond_t space;        // Signalled when a slot is written and freed
+    int num_workers;             // Number of render workers
+    int started;                 // Number of workers that were started
+    pthread_t *threads;          // Render workers
+};
+
+/**
+ * @brief Hands the fill slot to the render workers and moves on to the next slot.
+ *
+ * Must be called with pool->lock held.
+ *
+ * @param pool Render pipeline.
+ * @param wait Block until a free slot is available (1) or give up if none is (0).
+ */
+static inline void logger_render_seal(struct LogRenderPool *pool, int wait) {
+    for (;;) {
+        if (pool->slots[pool->fill].count == 0)
+            return;
+        int next_fill = (pool->fill + 1) % pool->num_slots;
+        if (pool->slots[next_fill].state == LOG_SLOT_FREE) {
+            pool->slots[pool->fill].state = LOG_SLOT_SEALED;
+            pool->fill = next_fill;
+            pthread_cond_signal(&pool->work);
+            return;
+        }
+        if (!wait)
+            return;
+        pthread_cond_wait(&pool->space, &pool->lock);
+    }
+}
+
+/**
+ * @brief Adds a record, its time filled in, to the batch being filled. Called by the ring writer.
+ *
+ * Only the ring writer (or a flush, both under rt_lock) fills batches, so the
+ * fill slot is its own until it is sealed.
+ */
+static inline void logger_render_add(struct LogRenderPool *pool, const unsigned char *capture, size_t len) {
+    size_t need = (len + 7) & ~(size_t)7;
+    struct LogRenderSlot *slot = &pool->slots[pool->fill];
+    if (slot->count == LOG_RENDER_ITEMS || slot->captures_len + need > LOG_RENDER_BATCH) {
+        pthread_mutex_lock(&pool->lock);
+        logger_render_seal(pool, 1);
+        pthread_mutex_unlock(&pool->lock);
+        slot = &pool->slots[pool->fill];
+    }
+    struct LogRenderItem *item = &slot->items[slot->count++];
+    item->capture = (uint32_t)slot->captures_len;
+    item->len = (uint32_t)len;
+    memcpy(slot->captures + slot->captures_len, capture, len);
+    slot->captures_len += need;
+}
+
+/**
+ * @brief Renders the lines of a batch that some sink will write.
+ */
+static inline void logger_render_batch(struct Logger *logger, struct LogRenderSlot *slot) {
+    size_t used = 0;
+    int text_file = logger->log_to_file && logger->file_format != LOG_FORMAT_BINARY;
+    for (int i = 0; i < slot->count; i++) {
+        struct LogRenderItem *item = &slot->items[i];
+        struct LogCapture c;
+        memcpy(&c, slot->captures + item->capture, sizeof(c));
+        enum LogLevel level = (enum LogLevel)c.level;
+        item->line_len = -1;
+        if (level < logger->console_level && !(text_file && level >= logger->file_level))
+            continue;
+        if (slot->lines_cap - used < LOG_MAX_LINE_LENGTH) {
+            char *lines = (char *)realloc(slot->lines, slot->lines_cap * 2);
+            if (!lines)
+                continue;
+            slot->lines = lines;
+            slot->lines_cap *= 2;
+        }
+        item->line = used;
+        item->line_len = logger_format_capture(logger, slot->captures + item->capture, slot->lines + used,
+                                               LOG_MAX_LINE_LENGTH);
+        used += (size_t)item->line_len;
+    }
+}
+
+/**
+ * @brief Writes a rendered batch to the console and the log file, in record order.
+ */
+static inline void logger_render_output(struct Logger *logger, struct LogRenderSlot *slot) {
+    unsigned long long console_bytes = 0;
+    for (int i = 0; i < slot->count; i++) {
+        struct LogRenderItem *item = &slot->items[i];
+        int level;
+        memcpy(&level, slot->captures + item->capture + offsetof(struct LogCapture, level), sizeof(level));
+        if (item->line_len >= 0 && (enum LogLevel)level >= logger->console_level) {
+            fwrite(slot->lines + item->line, 1, (size_t)item->line_len, stdout);
+            console_bytes += (unsigned long long)item->line_len;
+        }
+    }
+    if (console_bytes && logger->stats)
+        log_stats_add(&log_stats_shard(logger->stats)->console_bytes, console_bytes);
+    if (!logger->log_to_file || !logger->file)
+        return;
+    pthread_mutex_lock(&logger->file_lock);
+    for (int i = 0; i < slot->count; i++) {
+        struct LogRenderItem *item = &slot->items[i];
+        struct LogCapture c;
+        memcpy(&c, slot->captures + item->capture, sizeof(c));
+        if ((enum LogLevel)c.level < logger->file_level)
+            continue;
+        if (logger->file_format == LOG_FORMAT_BINARY)
+            logger_write_file(logger, (enum LogLevel)c.level, (const char *)slot->captures + item->capture, item->len,
+                              c.us / 1000);
+        else if (item->line_len >= 0)
+            logger_write_file(logger, (enum LogLevel)c.level, slot->lines + item->line, (size_t)item->line_len,
+                              c.us / 1000);
+    }
+    pthread_mutex_unlock(&logger->file_lock);
+}
+
+/**
+ * @brief Writes rendered batches out in ring order, as far as they are ready.
+ *
+ * Workers finish out of order; whichever one completes the next slot in line
+ * writes it and any ready slots after it, so there is a single writer at a
+ * time and the output keeps the merge order. Must be called with pool->lock held.
+ *
+ * @param pool Render pipeline.
+ */
+static inline void logger_render_write_ready(struct LogRenderPool *pool) {
+    if (pool->writing)
+        return;
+    pool->writing = 1;
+    while (pool->slots[pool->next].state == LOG_SLOT_DONE) {
+        struct LogRenderSlot *slot = &pool->slots[pool->next];
+        pthread_mutex_unlock(&pool->lock);
+        logger_render_output(pool->logger, slot);
+        pthread_mutex_lock(&pool->lock);
+        slot->count = 0;
+        slot->captures_len = 0;
+        slot->state = LOG_SLOT_FREE;
+        pool->next = (pool->next + 1) % pool->num_slots;
+        pthread_cond_broadcast(&pool->space);
+    }
+    pool->writing = 0;
+}
+
+/**
+ * @brief Render worker: claims sealed batches in order and renders them in parallel.
+ */
+static inline void *logger_render_main(void *arg) {
+    struct LogRenderPool *pool = (struct LogRenderPool *)arg;
+    logger_place_writer(pool->logger);
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        struct LogRenderSlot *slot = &pool->slots[pool->claim];
+        if (slot->state == LOG_SLOT_SEALED) {
+            slot->state = LOG_SLOT_BUSY;
+            pool->claim = (pool->claim + 1) % pool->num_slots;
+            pthread_mutex_unlock(&pool->lock);
+            logger_render_batch(pool->logger, slot);
+            pthread_mutex_lock(&pool->lock);
+            slot->state = LOG_SLOT_DONE;
+            logger_render_write_ready(pool);
+            continue;
+        }
+        if (pool->stop)
+            break;
+        pthread_cond_wait(&pool->work, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+/**
+ * @brief Seals the current batch and waits until every batch is written out.
+ *
+ * @param pool Render pipeline.
+ */
+static inline void logger_render_sync(struct LogRenderPool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    logger_render_seal(pool, 1);
+    while (pool->next != pool->fill || pool->slots[pool->next].state != LOG_SLOT_FREE)
+        pthread_cond_wait(&pool->space, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+ * @brief Frees a render pipeline after its workers have exited.
+ */
+static inline void logger_render_free(struct LogRenderPool *pool) {
+    for (int i = 0; pool->slots && i < pool->num_slots; i++) {
+        free(pool->slots[i].captures);
+        free(pool->slots[i].items);
+        free(pool->slots[i].lines);
+    }
+    pthread_cond_destroy(&pool->work);
+    pthread_cond_destroy(&pool->space);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->slots);
+    free(pool->threads);
+    free(pool);
+}
+
+/**
+ * @brief Writes out everything queued and stops the workers.
+ *
+ * @param pool Render pipeline.
+ */
+static inline void logger_render_stop(struct LogRenderPool *pool) {
+    if (pool->started == pool->num_workers)
+        logger_render_sync(pool);
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < pool->started; i++)
+        pthread_join(pool->threads[i], NULL);
+    logger_render_free(pool);
+}
+
+/**
+ * @brief Starts a render pipeline with its workers.
+ *
+ * Like the frame pipeline, the ring holds two batches per worker plus the one being filled.
+ *
+ * @return The pipeline, or NULL if it could not be set up.
+ */
+static inline struct LogRenderPool *logger_render_start(struct Logger *logger, int workers) {
+    struct LogRenderPool *pool = (struct LogRenderPool *)calloc(1, sizeof(*pool));
+    if (!pool)
+        return NULL;
+    pool->logger = logger;
+    pool->num_workers = workers;
+    pool->num_slots = 2 * workers + 1;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->space, NULL);
+
+    pool->slots = (struct LogRenderSlot *)calloc(pool->num_slots, sizeof(*pool->slots));
+    pool->threads = (pthread_t *)calloc(workers, sizeof(*pool->threads));
+    int ok = pool->slots && pool->threads;
+    for (int i = 0; ok && i < pool->num_slots; i++) {
+        struct LogRenderSlot *slot = &pool->slots[i];
+        slot->captures = (unsigned char *)malloc(LOG_RENDER_BATCH);
+        slot->items = (struct LogRenderItem *)malloc(LOG_RENDER_ITEMS * sizeof(*slot->items));
+        slot->lines_cap = 2 * LOG_RENDER_BATCH;
+        slot->lines = (char *)malloc(slot->lines_cap);
+        ok = slot->captures && slot->items && slot->lines;
+    }
+    for (int i = 0; ok && i < workers; i++) {
+        ok = pthread_create(&pool->threads[i], NULL, logger_render_main, pool) == 0;
+        if (ok)
+            pool->started++;
+    }
+    if (ok)
+        return pool;
+
+    logger_render_stop(pool);
+    return NULL;
+}
 
 /**
- * @brief Initializes the logger.
- * 
+ * @brief Finds the next record of a ring, skipping the end-of-buffer marker.
+ *
+ * @return 1 with *next describing the record, or 0 if the ring has no record
+ * ready (a per-CPU ring's next record may be claimed but not filled in yet).
+ */
+static inline int logger_rt_peek(struct LogRtRing *ring, struct LogRtHead *next) {
+    for (;;) {
+        size_t tail = ring->tail;
+        if (tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE))
+            return 0;
+        size_t pos = tail & (ring->capacity - 1);
+        if (ring->shared && !__atomic_load_n((uint32_t *)(ring->buf + pos + sizeof(uint32_t)), __ATOMIC_ACQUIRE))
+            return 0;
+        uint32_t len;
+        memcpy(&len, ring->buf + pos, sizeof(len));
+        if (len != LOG_RT_WRAP) {
+            next->ring = ring;
+            next->pos = pos;
+            next->len = len;
+            memcpy(&next->cycles, ring->buf + pos + 2 * sizeof(uint32_t), sizeof(next->cycles));
+            return 1;
+        }
+        if (ring->shared)
+            memset(ring->buf + pos, 0, ring->capacity - pos);
+        __atomic_store_n(&ring->tail, tail + ring->capacity - pos, __ATOMIC_RELEASE);
+    }
+}
+
+/**
+ * @brief Hands a written record's space back to its producers.
+ */
+static inline void logger_rt_consume(const struct LogRtHead *record) {
+    struct LogRtRing *ring = record->ring;
+    size_t need = LOG_RT_RECORD_HEADER + ((record->len + 7) & ~(size_t)7);
+    if (ring->shared)
+        memset(ring->buf + record->pos, 0, need); // Unclaimed space must read as not ready
+    __atomic_store_n(&ring->tail, ring->tail + need, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Sets the wall-clock time of a captured record from its cycle count and writes it out.
+ */
+static inline void logger_rt_emit(struct Logger *logger, unsigned char *capture, uint32_t len, uint64_t cycles) {
+    long long ns = logger->rt_base_ns + (long long)((double)(int64_t)(cycles - logger->rt_base_cycles) *
+                                                    logger->rt_ns_per_cycle);
+    long long us = ns / 1000;
+    memcpy(capture + offsetof(struct LogCapture, us), &us, sizeof(us));
+    struct LogRateCounters *rates = __atomic_load_n(&logger->rates, __ATOMIC_ACQUIRE);
+    if (rates) {
+        int level;
+        memcpy(&level, capture + offsetof(struct LogCapture, level), sizeof(level));
+        logger_count_rate(logger, rates, (enum LogLevel)level, us / 1000);
+    }
+    if (logger->rt_render)
+        logger_render_add(logger->rt_render, capture, len);
+    else
+        logger_emit_capture(logger, capture, len);
+}
+
+/**
+ * @brief Restores the min-heap order (earliest cycle count on top) below entry i.
+ */
+static inline void log_rt_heap_down(struct LogRtHead *heap, size_t n, size_t i) {
+    for (;;) {
+        size_t least = i, left = 2 * i + 1, right = left + 1;
+        if (left < n && (int64_t)(heap[left].cycles - heap[least].cycles) < 0)
+            least = left;
+        if (right < n && (int64_t)(heap[right].cycles - heap[least].cycles) < 0)
+            least = right;
+        if (least == i)
+            return;
+        struct LogRtHead swap = heap[i];
+        heap[i] = heap[least];
+        heap[least] = swap;
+        i = least;
+    }
+}
+
+/**
+ * @brief Writes out the real-time rings merged into timestamp order, and frees
+ * the rings of detached threads once empty. Called with rt_lock held.
+ *
+ * Every ring is in time order (up to the odd preempted producer of a per-CPU
+ * ring), so a k-way merge over the rings' first records, kept in a min-heap,
+ * yields the records in time order at O(log rings) each. A record is only
+ * written once it is rt_window_us old: a producer may still be about to push
+ * one stamped earlier, and holding back for the skew window lets the merge
+ * put it in its place. A record that shows up later than that still gets
+ * written, out of order, and is counted as late. Records stamped after the
+ * drain started are left for the next one, so a drain always ends.
+ *
  * @param logger Pointer to the logger structure.
- * @param console_level Minimum log level for console output.
- * @param file_level Minimum log level for file output.
- * @param file_path Path to the log file.
- * @param date_format Custom date format for log entries (optional, set to NULL for default format).
- * @param log_to_file Flag indicating whether logging to file is enabled (1) or not (0).
- * @param include_thread_id Flag indicating whether to include thread ID in log messages (1) or not (0).
- * @param include_process_id Flag indicating whether to include process ID in log messages (1) or not (0).
+ * @param all Flag indicating whether to write everything up to now, ignoring the window (flush and shutdown).
+ * @return Number of messages written.
  */
-void init_logger(struct Logger *logger, enum LogLevel console_level, enum LogLevel file_level, const char *file_path, const char *date_format, int log_to_file, int include_thread_id, int include_process_id) {
-    logger->console_level = console_level;
-    logger->file_level = file_level;
-    logger->file_path = strdup(file_path); // Dynamic memory allocation
-    logger->date_format = date_format ? strdup(date_format) : strdup("%Y-%m-%d %H:%M:%S"); // Dynamic memory allocation
-    logger->file = NULL;
-    logger->prefix = strdup("");
-    logger->log_to_file = log_to_file;
-    logger->include_thread_id = include_thread_id;
-    logger->include_process_id = include_process_id;
-    logger->num_tags = 0;
+static inline size_t logger_rt_drain(struct Logger *logger, int all) {
+    uint64_t start = log_cycles(), emit_cycles = 0;
+    size_t rings = 0;
+    for (struct LogRtRing *ring = logger->rt_rings; ring; ring = ring->next)
+        rings++;
+    if (rings > logger->rt_heap_cap) {
+        struct LogRtHead *heap = (struct LogRtHead *)realloc(logger->rt_heap, rings * 2 * sizeof(*heap));
+        if (!heap)
+            return 0; // Tried again on the next poll
+        logger->rt_heap = heap;
+        logger->rt_heap_cap = rings * 2;
+    }
 
-    if (logger->log_to_file) {
-        logger->file = fopen(logger->file_path, "a");
-        if (!logger->file) {
-            fprintf(stderr, "Error opening log file %s\n", logger->file_path);
+    struct LogRtHead *heap = logger->rt_heap;
+    size_t n = 0;
+    for (struct LogRtRing *ring = logger->rt_rings; ring; ring = ring->next)
+        n += (size_t)logger_rt_peek(ring, &heap[n]);
+    for (size_t i = n / 2; i-- > 0;)
+        log_rt_heap_down(heap, n, i);
+
+    uint64_t window = all ? 0 : (uint64_t)((double)logger->rt_window_us * 1000.0 / logger->rt_ns_per_cycle);
+    uint64_t horizon = start - window;
+    size_t messages = 0, late = 0;
+    while (n > 0 && (int64_t)(heap[0].cycles - horizon) <= 0) {
+        uint64_t t0 = log_cycles();
+        logger_rt_emit(logger, heap[0].ring->buf + heap[0].pos + LOG_RT_RECORD_HEADER, heap[0].len, heap[0].cycles);
+        emit_cycles += log_cycles() - t0;
+        if ((int64_t)(heap[0].cycles - logger->rt_merge_last) < 0)
+            late++;
+        else
+            logger->rt_merge_last = heap[0].cycles;
+        logger_rt_consume(&heap[0]);
+        messages++;
+        if (!logger_rt_peek(heap[0].ring, &heap[0]))
+            heap[0] = heap[--n];
+        log_rt_heap_down(heap, n, 0);
+    }
+    logger->rt_held = n > 0;
+    if (logger->rt_render) {
+        // Hand over the partial batch too, unless every worker is busy; the next drain retries
+        pthread_mutex_lock(&logger->rt_render->lock);
+        logger_render_seal(logger->rt_render, 0);
+        pthread_mutex_unlock(&logger->rt_render->lock);
+    }
+
+    for (struct LogRtRing **p = &logger->rt_rings; *p;) {
+        struct LogRtRing *ring = *p;
+        // detached is read first: a thread sets it after its last push
+        if (!ring->shared && __atomic_load_n(&ring->detached, __ATOMIC_ACQUIRE) &&
+            ring->tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) {
+            *p = ring->next;
+            logger_rt_free_ring(ring);
+        } else {
+            p = &ring->next;
         }
     }
+
+    uint64_t merge_cycles = log_cycles() - start - emit_cycles;
+    log_stats_add(&logger->rt_merged, messages);
+    log_stats_add(&logger->rt_merge_late, late);
+    log_stats_add(&logger->rt_merge_ns, (unsigned long long)((double)merge_cycles * logger->rt_ns_per_cycle));
+    return messages;
 }
 
 /**
- * @brief Sets the custom log message prefix.
- * 
- * @param logger Pointer to the logger structure.
- * @param prefix Custom log message prefix.
+ * @brief Tells whether any real-time ring holds messages. Called with rt_lock held.
  */
-void set_log_prefix(struct Logger *logger, const char *prefix) {
-    free(logger->prefix); // Free previous memory
-    logger->prefix = strdup(prefix); // Dynamic memory allocation
+static inline int logger_rt_pending(struct Logger *logger) {
+    for (struct LogRtRing *ring = logger->rt_rings; ring; ring = ring->next) {
+        if (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) != ring->tail)
+            return 1;
+    }
+    return 0;
+}
+
+static inline void log_cpu_relax(void) {
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__) && defined(__GNUC__)
+    __asm__ __volatile__("yield");
+#endif
 }
 
 /**
- * @brief Sets the log file path and opens the log file.
- * 
+ * @brief Waits for real-time messages: spins, then yields, then sleeps.
+ *
+ * Spinning for rt_spin_us picks up a message within nanoseconds, yielding for
+ * rt_yield_us lets other threads run while still noticing one within a time
+ * slice, and after that the writer advertises rt_sleeping and sleeps on it for
+ * up to rt_poll_us. Producers with rt_wake set wake it when they see the flag.
+ */
+static inline void logger_rt_wait(struct Logger *logger) {
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    long spin_ns = __atomic_load_n(&logger->rt_spin_us, __ATOMIC_RELAXED) * 1000;
+    long idle_ns = spin_ns + __atomic_load_n(&logger->rt_yield_us, __ATOMIC_RELAXED) * 1000;
+    for (long elapsed = 0; elapsed < idle_ns;) {
+        pthread_mutex_lock(&logger->rt_lock);
+        int pending = logger_rt_pending(logger) || __atomic_load_n(&logger->rt_stop, __ATOMIC_ACQUIRE);
+        pthread_mutex_unlock(&logger->rt_lock);
+        if (pending)
+            return;
+        if (elapsed < spin_ns) {
+            for (int i = 0; i < 64; i++)
+                log_cpu_relax();
+        } else {
+            sched_yield();
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        elapsed = (now.tv_sec - start.tv_sec) * 1000000000L + (now.tv_nsec - start.tv_nsec);
+    }
+
+    struct timespec pause = {logger->rt_poll_us / 1000000, (logger->rt_poll_us % 1000000) * 1000};
+    __atomic_store_n(&logger->rt_sleeping, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_lock(&logger->rt_lock);
+    int pending = logger_rt_pending(logger); // Checked after advertising, so a producer that missed the flag is seen here
+    pthread_mutex_unlock(&logger->rt_lock);
+    if (!pending && !__atomic_load_n(&logger->rt_stop, __ATOMIC_ACQUIRE)) {
+#ifdef __linux__
+        if (__atomic_load_n(&logger->rt_wake, __ATOMIC_RELAXED))
+            syscall(SYS_futex, &logger->rt_sleeping, FUTEX_WAIT_PRIVATE, 1, &pause, NULL, 0);
+        else
+            nanosleep(&pause, NULL);
+#else
+        nanosleep(&pause, NULL);
+#endif
+    }
+    __atomic_store_n(&logger->rt_sleeping, 0, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Ring writer: polls the real-time rings until real-time mode is turned off.
+ */
+static inline void *logger_rt_main(void *arg) {
+    struct Logger *logger = (struct Logger *)arg;
+    logger_place_writer(logger);
+    for (;;) {
+        pthread_mutex_lock(&logger->rt_lock);
+        int stop = __atomic_load_n(&logger->rt_stop, __ATOMIC_ACQUIRE);
+        logger_rt_calibrate(logger);
+        size_t messages = logger_rt_drain(logger, stop);
+        int held = logger->rt_held;
+        pthread_mutex_unlock(&logger->rt_lock);
+
+        struct timespec wall;
+        clock_gettime(CLOCK_REALTIME, &wall);
+        long long wall_ms = (long long)wall.tv_sec * 1000 + wall.tv_nsec / 1000000;
+        if (logger_metrics_due(logger, wall_ms))
+            logger_export_metrics(logger, wall_ms);
+        if (stop)
+            break;
+        if (messages == 0 && held) {
+            // Records are waiting out the merge window; nothing to wake up for
+            long us = logger->rt_window_us < logger->rt_poll_us ? logger->rt_window_us : logger->rt_poll_us;
+            struct timespec pause = {us / 1000000, (us % 1000000) * 1000};
+            nanosleep(&pause, NULL);
+        } else if (messages == 0) {
+            logger_rt_wait(logger);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Allocates one shared ring per configured CPU and puts them on rt_rings.
+ *
+ * With ring_numa the buffers are left untouched (unless ring_populate asks
+ * otherwise), so each page is faulted in on the NUMA node of the CPU whose
+ * producers first write it; otherwise they are faulted in here.
+ *
+ * @return 0 on success, -1 if memory ran out (nothing is left allocated).
+ */
+static inline int logger_rt_add_cpu_rings(struct Logger *logger) {
+    long cpus = sysconf(_SC_NPROCESSORS_CONF);
+    int count = cpus > 0 ? (int)cpus : 1;
+    logger->rt_cpu_rings = (struct LogRtRing **)calloc((size_t)count, sizeof(*logger->rt_cpu_rings));
+    if (!logger->rt_cpu_rings)
+        return -1;
+    for (int i = 0; i < count; i++) {
+        void *ring_mem;
+        int mapped;
+        unsigned char *buf = NULL;
+        if (posix_memalign(&ring_mem, 64, sizeof(struct LogRtRing)) == 0) {
+            // The setup thread's node is the wrong one to bind to; leave placement to the first touch
+            buf = logger_rt_alloc_buffer(logger->rt_ring_size, logger->ring_numa ? LOG_RING_MAP : LOG_RING_HEAP,
+                                         logger->ring_pages, &mapped);
+            if (!buf)
+                free(ring_mem);
+        }
+        if (!buf) {
+            for (int j = 0; j < i; j++)
+                logger_rt_free_ring(logger->rt_cpu_rings[j]);
+            free(logger->rt_cpu_rings);
+            logger->rt_cpu_rings = NULL;
+            return -1;
+        }
+        struct LogRtRing *ring = (struct LogRtRing *)ring_mem;
+        memset(ring, 0, sizeof(*ring));
+        if (!mapped)
+            memset(buf, 0, logger->rt_ring_size); // Records are published by a nonzero ready word
+        ring->buf = buf;
+        ring->capacity = logger->rt_ring_size;
+        ring->mapped = mapped;
+        ring->shared = 1;
+        logger->rt_cpu_rings[i] = ring;
+    }
+    for (int i = count - 1; i >= 0; i--) {
+        logger->rt_cpu_rings[i]->next = logger->rt_rings;
+        logger->rt_rings = logger->rt_cpu_rings[i];
+    }
+    logger->rt_num_cpus = count;
+    return 0;
+}
+
+/**
+ * @brief Frees every ring, the per-CPU ring table and the merge heap once no writer uses them.
+ */
+static inline void logger_rt_free_rings(struct Logger *logger) {
+    for (struct LogRtRing *ring = logger->rt_rings, *next; ring; ring = next) {
+        next = ring->next;
+        logger_rt_free_ring(ring);
+    }
+    logger->rt_rings = NULL;
+    free(logger->rt_cpu_rings);
+    logger->rt_cpu_rings = NULL;
+    logger->rt_num_cpus = 0;
+    free(logger->rt_heap);
+    logger->rt_heap = NULL;
+    logger->rt_heap_cap = 0;
+}
+
+/**
+ * @brief Turns real-time mode on or off.
+ *
+ * In real-time mode, threads that call attach_realtime_thread() log through a
+ * ring of their own, and log_message() does no system call, takes no lock and
+ * allocates nothing on them: the timestamp is the cycle counter (log_cycles()),
+ * the process id is cached, and the arguments are captured rather than
+ * formatted. A writer thread polls the rings every poll_us, converts the cycle
+ * stamps to wall-clock time with a rate it keeps calibrating, and renders and
+ * writes the lines (text or binary, console and file) as log_message() would,
+ * so producers never wake anyone. Messages that do not fit in a full ring are
+ * dropped and counted in logger_get_stats(). Other threads log as before.
+ *
+ * Turning it off (or changing it) stops the writer after it has written out
+ * every ring; attached threads must have stopped logging by then.
+ *
  * @param logger Pointer to the logger structure.
- * @param file_path Path to the new log file.
+ * @param ring_size Bytes of ring per attached thread (or per CPU), rounded up to a power of two (0 turns real-time mode off).
+ * @param poll_us Writer sleep between polls when the rings are empty.
  */
-void set_log_file(struct Logger *logger, const char *file_path) {
-    free(logger->file_path); // Free previous memory
-    logger->file_path = strdup(file_path); // Dynamic memory allocation
-    if (logger->file)
-        fclose(logger->file);
-    logger->file = fopen(logger->file_path, "a");
-    if (!logger->file) {
-        fprintf(stderr, "Error opening log file %s\n", logger->file_path);
+void set_realtime_mode(struct Logger *logger, size_t ring_size, long poll_us) {
+    if (logger->rt_id) {
+        __atomic_store_n(&logger->rt_stop, 1, __ATOMIC_RELEASE);
+#ifdef __linux__
+        if (__atomic_load_n(&logger->rt_wake, __ATOMIC_RELAXED))
+            syscall(SYS_futex, &logger->rt_sleeping, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+#endif
+        pthread_join(logger->rt_thread, NULL);
+        if (logger->rt_render) {
+            logger_render_stop(logger->rt_render);
+            logger->rt_render = NULL;
+        }
+        __atomic_store_n(&logger->rt_id, 0, __ATOMIC_RELAXED);
+        logger_rt_free_rings(logger);
+    }
+    if (ring_size == 0)
+        return;
+
+    size_t capacity = LOG_RT_MIN_RING;
+    while (capacity < ring_size)
+        capacity *= 2;
+    logger->rt_ring_size = capacity;
+    logger->rt_poll_us = poll_us > 0 ? poll_us : 1000;
+    logger->rt_process = getpid();
+    logger->rt_stop = 0;
+
+    // First estimate of the cycle counter rate; the writer keeps refining it
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    logger->rt_base_cycles = log_cycles();
+    logger->rt_base_ns = (long long)now.tv_sec * 1000000000LL + now.tv_nsec;
+    logger->rt_ns_per_cycle = 1.0;
+    struct timespec pause = {0, LOG_RT_CALIBRATE_MS * 1000000L};
+    nanosleep(&pause, NULL);
+    logger_rt_calibrate(logger);
+
+    if (logger->rt_per_cpu && logger_rt_add_cpu_rings(logger) != 0) {
+        fprintf(stderr, "Error allocating per-CPU log rings\n");
+        return;
+    }
+    if (logger->rt_render_workers > 0) {
+        logger->rt_render = logger_render_start(logger, logger->rt_render_workers);
+        if (!logger->rt_render)
+            fprintf(stderr, "Error starting log render workers, rendering on the ring writer\n");
+    }
+
+    unsigned long long id = __atomic_add_fetch(&log_rt_next_id, 1, __ATOMIC_RELAXED);
+    if (pthread_create(&logger->rt_thread, NULL, logger_rt_main, logger) != 0) {
+        fprintf(stderr, "Error starting real-time log writer\n");
+        // Nothing would stop or free these without a writer, so undo the setup above
+        if (logger->rt_render) {
+            logger_render_stop(logger->rt_render);
+            logger->rt_render = NULL;
+        }
+        logger_rt_free_rings(logger);
+        return;
     }
+    __atomic_store_n(&logger->rt_id, id, __ATOMIC_RELEASE);
 }
 
 /**
- * @brief Sets the log levels for console and file output.
- * 
+ * @brief Sets how the real-time ring writer waits when the rings are empty.
+ *
+ * The writer spins for spin_us, burning its core but picking messages up within
+ * nanoseconds, then calls sched_yield() for yield_us, and then sleeps for up to
+ * the poll_us of set_realtime_mode(). Without producer_wake a message that
+ * arrives during the sleep waits for the timeout; with it, an attached thread
+ * that finds the writer asleep wakes it with a futex call. Only then does the
+ * producer make a system call, and never while the writer is awake, but
+ * threads that must not make any should leave producer_wake at 0. The default
+ * is 0, 0, 0: sleep for poll_us between polls.
+ *
  * @param logger Pointer to the logger structure.
- * @param console_level Minimum log level for console output.
- * @param file_level Minimum log level for file output.
+ * @param spin_us Time to spin before yielding.
+ * @param yield_us Time to yield before sleeping.
+ * @param producer_wake Flag indicating whether producers wake a sleeping writer (1) or not (0).
  */
-void set_log_levels(struct Logger *logger, enum LogLevel console_level, enum LogLevel file_level) {
-    logger->console_level = console_level;
-    logger->file_level = file_level;
+void set_realtime_wakeup(struct Logger *logger, long spin_us, long yield_us, int producer_wake) {
+    __atomic_store_n(&logger->rt_spin_us, spin_us > 0 ? spin_us : 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&logger->rt_yield_us, yield_us > 0 ? yield_us : 0, __ATOMIC_RELAXED);
+#ifdef __linux__
+    __atomic_store_n(&logger->rt_wake, producer_wake != 0, __ATOMIC_RELAXED);
+#else
+    (void)producer_wake; // Needs a futex
+#endif
 }
 
 /**
- * @brief Sets the date format for log entries.
- * 
+ * @brief Sets the skew window of the real-time timestamp merge.
+ *
+ * The ring writer merges all rings into timestamp order. With a window it
+ * holds each record back until it is window_us old, so a record that a
+ * producer pushes up to window_us after its timestamp (it was preempted, or
+ * its ring was read just before) still lands in order. Records later than
+ * that are written out of order and counted in logger_get_stats() as
+ * merge_late. The rings must hold window_us worth of messages. flush_logger()
+ * writes everything regardless of the window.
+ *
  * @param logger Pointer to the logger structure.
- * @param date_format Custom date format for log entries.
+ * @param window_us Skew window (0, the default, writes records as soon as the writer sees them).
  */
-void set_date_format(struct Logger *logger, const char *date_format) {
-    free(logger->date_format); // Free previous memory
-    logger->date_format = strdup(date_format); // Dynamic memory allocation
+void set_realtime_merge_window(struct Logger *logger, long window_us) {
+    pthread_mutex_lock(&logger->rt_lock);
+    logger->rt_window_us = window_us > 0 ? window_us : 0;
+    pthread_mutex_unlock(&logger->rt_lock);
 }
 
 /**
- * @brief Sets whether logging to file is enabled or not.
- * 
+ * @brief Sets how many threads render real-time records into text.
+ *
+ * By default the ring writer merges, renders and writes every record itself,
+ * which caps real-time throughput at what one thread can format. With
+ * workers > 0 it only merges: records go out in batches to a pool of render
+ * workers, and each finished batch is written by a single writer in the order
+ * the batches were filled, so the output order (and each thread's order) is
+ * the same as without workers. Takes effect the next time set_realtime_mode()
+ * turns real-time mode on.
+ *
  * @param logger Pointer to the logger structure.
- * @param log_to_file Flag indicating whether logging to file is enabled (1) or not (0).
+ * @param workers Number of render workers (0 renders on the ring writer).
  */
-void set_log_to_file(struct Logger *logger, int log_to_file) {
-    logger->log_to_file = log_to_file;
+void set_realtime_render_workers(struct Logger *logger, int workers) {
+    logger->rt_render_workers = workers > 0 ? workers : 0;
 }
 
 /**
- * @brief Sets whether to include thread ID in log messages or not.
- * 
+ * @brief Chooses between a ring per attached thread and a ring per CPU for real-time mode.
+ *
+ * Per-thread rings take memory for every attached thread. Per-CPU rings take
+ * it for every CPU however many threads attach, at the price of a
+ * compare-and-swap per message (uncontended unless a producer is preempted or
+ * migrated mid-push) and of the ring writer merging the rings by timestamp.
+ * Producers find their ring with sched_getcpu(), which makes no system call.
+ * Takes effect the next time set_realtime_mode() turns real-time mode on.
+ *
  * @param logger Pointer to the logger structure.
- * @param include_thread_id Flag indicating whether to include thread ID in log messages (1) or not (0).
+ * @param per_cpu Flag indicating whether to use a ring per CPU (1) or per thread (0).
  */
-void set_include_thread_id(struct Logger *logger, int include_thread_id) {
-    logger->include_thread_id = include_thread_id;
+void set_realtime_per_cpu(struct Logger *logger, int per_cpu) {
+    logger->rt_per_cpu = per_cpu;
 }
 
 /**
- * @brief Sets whether to include process ID in log messages or not.
- * 
+ * @brief Gives the calling thread its own ring, so its messages take the real-time path.
+ *
+ * Call it from the thread, before its deadlines start: this is where the ring is
+ * allocated and touched. With per-CPU rings (set_realtime_per_cpu()) the thread
+ * only registers; it pushes to the ring of the CPU it runs on. The ring stays with the logger until
+ * detach_realtime_thread() or set_realtime_mode() turns it off.
+ *
  * @param logger Pointer to the logger structure.
- * @param include_process_id Flag indicating whether to include process ID in log messages (1) or not (0).
+ * @return 0 on success, -1 if real-time mode is off or the ring could not be allocated.
  */
-void set_include_process_id(struct Logger *logger, int include_process_id) {
-    logger->include_process_id = include_process_id;
+int attach_realtime_thread(struct Logger *logger) {
+    unsigned long long id = __atomic_load_n(&logger->rt_id, __ATOMIC_ACQUIRE);
+    if (!id)
+        return -1;
+    if (log_rt_owner == id)
+        return 0;
+    if (logger->rt_num_cpus) {
+        // Per-CPU rings: nothing of its own to set up
+        if (logger->stats)
+            log_stats_shard(logger->stats);
+        logger_seq_counter(logger); // Claimed now, so numbering never searches the slots on this thread
+        log_rt_ring = NULL;
+        log_rt_owner = id;
+        return 0;
+    }
+    void *ring_mem;
+    int mapped;
+    if (posix_memalign(&ring_mem, 64, sizeof(struct LogRtRing)) != 0)
+        return -1;
+    unsigned char *buf = logger_rt_alloc_buffer(logger->rt_ring_size, logger->ring_numa ? LOG_RING_LOCAL : LOG_RING_HEAP,
+                                                logger->ring_pages, &mapped);
+    if (!buf) {
+        free(ring_mem);
+        return -1;
+    }
+    struct LogRtRing *ring = (struct LogRtRing *)ring_mem;
+    memset(ring, 0, sizeof(*ring));
+    memset(buf, 0, logger->rt_ring_size); // Fault the pages in now rather than on a deadline
+    ring->buf = buf;
+    ring->capacity = logger->rt_ring_size;
+    ring->mapped = mapped;
+    if (logger->stats)
+        log_stats_shard(logger->stats); // Picks this thread's counter shard
+    logger_seq_counter(logger);         // Claimed now, so numbering never searches the slots on this thread
+    pthread_mutex_lock(&logger->rt_lock);
+    ring->next = logger->rt_rings;
+    logger->rt_rings = ring;
+    pthread_mutex_unlock(&logger->rt_lock);
+    log_rt_ring = ring;
+    log_rt_owner = id;
+    return 0;
 }
 
 /**
- * @brief Logs a message to the console and/or file, depending on log levels and settings.
- * 
+ * @brief Returns the calling thread to normal logging; its ring is freed once written out.
+ *
+ * @param logger Pointer to the logger structure.
+ */
+void detach_realtime_thread(struct Logger *logger) {
+    unsigned long long id = __atomic_load_n(&logger->rt_id, __ATOMIC_ACQUIRE);
+    if (!id || log_rt_owner != id)
+        return;
+    if (log_rt_ring)
+        __atomic_store_n(&log_rt_ring->detached, 1, __ATOMIC_RELEASE);
+    log_rt_ring = NULL;
+    log_rt_owner = 0;
+}
+
+/**
+ * @brief Real-time path of log_message(): capture into the thread's ring, nothing else.
+ */
+static inline void logger_log_realtime(struct Logger *logger, enum LogLevel level, unsigned long long seq,
+                                       const char *file, int source_line, const char *format, va_list args) {
+    uint64_t cycles = log_cycles();
+    struct LogStatsShard *shard = logger->stats ? log_stats_shard(logger->stats) : NULL;
+    if (shard)
+        log_stats_add(&shard->accepted[level], 1);
+    va_list fallback_args;
+    va_copy(fallback_args, args);
+    unsigned char capture[LOG_MAX_LINE_LENGTH];
+    unsigned long thread = (unsigned long)pthread_self();
+    // The time is filled in by the ring writer
+    int len = log_capture(capture, sizeof(capture), level, 0, thread, logger->rt_process, file, source_line, format, args);
+    if (len < 0) {
+        // Too large to capture: keep the rendered message instead
+        char message[sizeof(capture) - sizeof(struct LogCapture) - sizeof(uint32_t) - 1];
+        vsnprintf(message, sizeof(message), format, fallback_args);
+        len = log_capturef(capture, sizeof(capture), level, 0, thread, logger->rt_process, file, source_line, "%s", message);
+    }
+    va_end(fallback_args);
+    if (len >= 0)
+        memcpy(capture + offsetof(struct LogCapture, seq), &seq, sizeof(seq));
+    struct LogRtRing *ring = log_rt_ring;
+    int pushed;
+    if (ring) {
+        pushed = len >= 0 && log_rt_push(ring, cycles, capture, (size_t)len) == 0;
+    } else {
+        ring = logger->rt_cpu_rings[log_rt_cpu() % logger->rt_num_cpus];
+        pushed = len >= 0 && log_rt_push_shared(ring, capture, (size_t)len) == 0;
+    }
+    if (!pushed) {
+        __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+        if (shard)
+            log_stats_add(&shard->dropped[level], 1);
+        return;
+    }
+#ifdef __linux__
+    if (__atomic_load_n(&logger->rt_wake, __ATOMIC_RELAXED)) {
+        __atomic_thread_fence(__ATOMIC_SEQ_CST); // Orders the push before reading the flag, against the writer's store and check
+        if (__atomic_load_n(&logger->rt_sleeping, __ATOMIC_RELAXED) &&
+            __atomic_exchange_n(&logger->rt_sleeping, 0, __ATOMIC_RELAXED))
+            syscall(SYS_futex, &logger->rt_sleeping, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+#endif
+}
+
+/**
+ * @brief Logs a message with its call site; log_message() and log_message_at() share it.
+ *
  * @param logger Pointer to the logger structure.
  * @param level Log level of the message.
+ * @param file Source file of the call, or NULL.
+ * @param source_line Source line of the call.
  * @param format Format string for the message.
- * @param ... Additional arguments for the format string.
+ * @param args Arguments for the format string.
  */
-void log_message(struct Logger *logger, enum LogLevel level, const char *format, ...) {
+static inline void logger_log(struct Logger *logger, enum LogLevel level, const char *file, int source_line,
+                              const char *format, va_list args) {
     if (level < logger->console_level && level < logger->file_level)
         return;
-
-    time_t currentTime;
-    struct tm *timeInfo;
-    char timeBuffer[20]; // Sufficiently large buffer for date/time
-    time(&currentTime);
-    timeInfo = localtime(&currentTime);
-    strftime(timeBuffer, sizeof(timeBuffer), logger->date_format, timeInfo);
-
-    const char *level_name;
-    switch (level) {
-        case DEBUG:
-            level_name = "DEBUG";
-            break;
-        case INFO:
-            level_name = "INFO";
-            break;
-        case SUCCESS:
-            level_name = "SUCCESS";
-            break;
-        case WARNING:
-            level_name = "WARNING";
-            break;
-        case ERROR:
-            level_name = "ERROR";
-            break;
-        default:
-            level_name = "UNKNOWN";
-            break;
+    unsigned long long seq = logger->include_sequence ? log_next_seq(logger) : 0;
+    if (log_rt_owner && log_rt_owner == __atomic_load_n(&logger->rt_id, __ATOMIC_RELAXED)) {
+        logger_log_realtime(logger, level, seq, file, source_line, format, args);
+        return;
     }
 
-    va_list args;
-    va_start(args, format);
+    LOG_STAGE_START(t);
+    struct LogStatsShard *shard = logger->stats ? log_stats_shard(logger->stats) : NULL;
+    if (shard)
+        log_stats_add(&shard->accepted[level], 1);
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    long long now_ms = (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+    struct LogRateCounters *rates = __atomic_load_n(&logger->rates, __ATOMIC_ACQUIRE);
+    if (rates)
+        logger_count_rate(logger, rates, level, now_ms);
+    unsigned long thread = (unsigned long)pthread_self();
+    int process = logger->include_process_id ? getpid() : 0;
+    LOG_STAGE_LAP(t, LOG_STAGE_TIMESTAMP);
 
-    printf("%s | %s %s", timeBuffer, level_name, logger->prefix);
-    if (logger->include_thread_id) {
-        printf(" | Thread ID: %lu", (unsigned long)pthread_self());
-    }
-    if (logger->include_process_id) {
-        printf(" | Process ID: %d", getpid());
+    va_list file_args;
+    va_copy(file_args, args);
+    char line[LOG_MAX_LINE_LENGTH];
+    size_t message_offset;
+    int len = logger_format_line(logger, level, now.tv_sec, thread, process, seq, line, sizeof(line), &message_offset,
+                                 format, args);
+    LOG_STAGE_LAP(t, LOG_STAGE_FORMAT);
+
+    if (level >= logger->console_level) {
+        fwrite(line, 1, len, stdout);
+        if (shard)
+            log_stats_add(&shard->console_bytes, (unsigned long long)len);
+        LOG_STAGE_LAP(t, LOG_STAGE_CONSOLE);
     }
-    printf(" | ");
-    vprintf(format, args);
-    printf("\n");
 
+    // The frame writer exports metrics when there is one; otherwise any logging thread does, whether or not
+    // this line reaches the file, so the export does not go stale while the file level filters everything out
+    int export_here = !__atomic_load_n(&logger->framer, __ATOMIC_RELAXED);
     if (logger->log_to_file && logger->file && level >= logger->file_level) {
-        fprintf(logger->file, "%s | %s %s", timeBuffer, level_name, logger->prefix);
-        if (logger->include_thread_id) {
-            fprintf(logger->file, " | Thread ID: %lu", (unsigned long)pthread_self());
-        }
-        if (logger->include_process_id) {
-            fprintf(logger->file, " | Process ID: %d", getpid());
+        pthread_mutex_lock(&logger->file_lock);
+        LOG_STAGE_LAP(t, LOG_STAGE_LOCK);
+        LOG_STAGE_MARK(inner);
+        if (logger->file_format == LOG_FORMAT_BINARY) {
+            unsigned char capture[LOG_MAX_LINE_LENGTH];
+            long long now_us = (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+            int capture_len = log_capture(capture, sizeof(capture), level, now_us, thread, process, file, source_line,
+                                          format, file_args);
+            if (capture_len < 0) {
+                // Too large to capture: keep the rendered message instead
+                size_t room = sizeof(capture) - sizeof(struct LogCapture) - sizeof(uint32_t) - 1;
+                line[len - 1] = '\0';
+                if (strlen(line + message_offset) > room)
+                    line[message_offset + room] = '\0';
+                capture_len = log_capturef(capture, sizeof(capture), level, now_us, thread, process, file, source_line,
+                                           "%s", line + message_offset);
+            }
+            memcpy(capture + offsetof(struct LogCapture, seq), &seq, sizeof(seq));
+            LOG_STAGE_LAP(t, LOG_STAGE_CAPTURE);
+            LOG_STAGE_MARK(capture_inner);
+            logger_write_file(logger, level, (const char *)capture, (size_t)capture_len, now_ms);
+            LOG_STAGE_LAP_OUTER(t, LOG_STAGE_FILE, capture_inner);
+        } else {
+            logger_write_file(logger, level, line, len, now_ms);
+            LOG_STAGE_LAP_OUTER(t, LOG_STAGE_FILE, inner);
         }
-        fprintf(logger->file, " | ");
-        vfprintf(logger->file, format, args);
-        fprintf(logger->file, "\n");
-        fflush(logger->file);
+        pthread_mutex_unlock(&logger->file_lock);
     }
+    va_end(file_args);
+    if (export_here && logger_metrics_due(logger, now_ms))
+        logger_export_metrics(logger, now_ms);
+}
+
+/**
+ * @brief Logs a message to the console and/or file, depending on log levels and settings.
+ *
+ * Never allocates: everything it needs is allocated by init_logger() and the
+ * setters (stdio buffers, throttle memory, frame blocks, dictionaries, counters,
+ * the metrics buffer). Formats that make printf() itself allocate are the
+ * exception: positional arguments (%1$d), wide strings and very large widths or
+ * precisions. So is a build with LOG_STAGE_STATS, which allocates a thread's
+ * counters on its first message. bench/bench_alloc checks this.
+ *
+ * @param logger Pointer to the logger structure.
+ * @param level Log level of the message.
+ * @param format Format string for the message.
+ * @param ... Additional arguments for the format string.
+ */
+void log_message(struct Logger *logger, enum LogLevel level, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    logger_log(logger, level, NULL, 0, format, args);
+    va_end(args);
+}
 
+/**
+ * @brief Logs a message like log_message(), recording where it was logged from.
+ *
+ * The call site goes into the format table of binary log files; text lines are
+ * unchanged. LOG_MESSAGE() fills in the current file and line.
+ *
+ * @param logger Pointer to the logger structure.
+ * @param level Log level of the message.
+ * @param file Source file of the call (must outlive the logger, like __FILE__).
+ * @param line Source line of the call.
+ * @param format Format string for the message.
+ * @param ... Additional arguments for the format string.
+ */
+void log_message_at(struct Logger *logger, enum LogLevel level, const char *file, int line, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    logger_log(logger, level, file, line, format, args);
     va_end(args);
 }
 
+#define LOG_MESSAGE(logger, level, ...) log_message_at((logger), (level), __FILE__, __LINE__, __VA_ARGS__)
+
 /**
  * @brief Adds a tag to the logger.
  * 
@@ -229,9 +5778,10 @@ void log_message(struct Logger *logger, enum LogLevel level, const char *format,
 void add_tag(struct Logger *logger, const char *tag) {
     // Check if the number of tags exceeds the maximum allowed
     if (logger->num_tags < MAX_TAGS) {
+        logger_context_changing(logger);
         strncpy(logger->tags[logger->num_tags], tag, MAX_TAG_LENGTH - 1);
         logger->tags[logger->num_tags][MAX_TAG_LENGTH - 1] = '\0';
-        logger->num_tags++;
+        __atomic_store_n(&logger->num_tags, logger->num_tags + 1, __ATOMIC_RELEASE); // Rate counters read it unlocked
     }
 }
 
@@ -249,6 +5799,114 @@ void log_timestamp(struct Logger *logger, const char *tag) {
     log_message(logger, DEBUG, "[%s] Timestamp: %lld ms", tag, milliseconds);
 }
 
+/*
+ * Scope timers. LOG_SCOPE_TIMER(logger, "db_query") at the top of a block reads
+ * the monotonic clock, and when the block is left, by any path, logs one record
+ * with the elapsed time from the line that declared it. In C the timer is a
+ * variable with a GCC cleanup attribute; in C++ it is an RAII guard, so
+ * exceptions end it too. A timer whose level neither output would show never
+ * reads the clock.
+ */
+
+struct LogScopeTimer {
+    struct Logger *logger;   // Logger to report to (NULL once ended or when the level is filtered out)
+    enum LogLevel level;     // Level of the record
+    const char *name;        // Name shown in the record (not copied)
+    const char *file;        // Source file of the timer
+    int line;                // Source line of the timer
+    long long threshold_ns;  // Only scopes lasting at least this long are logged
+    struct timespec start;   // Monotonic time the scope began
+};
+
+/**
+ * @brief Starts timing a scope; LOG_SCOPE_TIMER() and LOG_SCOPE_TIMER_EX() call it.
+ *
+ * @param logger Pointer to the logger structure.
+ * @param level Log level of the record written when the scope ends.
+ * @param name Name of the scope (must outlive the timer, like a string literal).
+ * @param file Source file of the timer.
+ * @param line Source line of the timer.
+ * @param threshold_us Minimum duration in microseconds worth a record (0 = always log).
+ * @return The running timer, to be passed to log_scope_end().
+ */
+struct LogScopeTimer log_scope_begin(struct Logger *logger, enum LogLevel level, const char *name, const char *file,
+                                     int line, long threshold_us) {
+    struct LogScopeTimer timer;
+    memset(&timer, 0, sizeof(timer));
+    if (level < logger->console_level && level < logger->file_level)
+        return timer;
+    timer.logger = logger;
+    timer.level = level;
+    timer.name = name;
+    timer.file = file;
+    timer.line = line;
+    timer.threshold_ns = threshold_us > 0 ? (long long)threshold_us * 1000 : 0;
+    clock_gettime(CLOCK_MONOTONIC, &timer.start);
+    return timer;
+}
+
+/**
+ * @brief Ends a scope timer, logging the elapsed time unless it is under the threshold.
+ *
+ * Ending a timer twice logs once, so a scope may end it early.
+ *
+ * @param timer Timer from log_scope_begin().
+ * @return Elapsed time in nanoseconds, or -1 if the timer was not running.
+ */
+long long log_scope_end(struct LogScopeTimer *timer) {
+    if (!timer->logger)
+        return -1;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long long elapsed_ns = (long long)(now.tv_sec - timer->start.tv_sec) * 1000000000LL + (now.tv_nsec - timer->start.tv_nsec);
+    if (elapsed_ns >= timer->threshold_ns)
+        log_message_at(timer->logger, timer->level, timer->file, timer->line, "[%s] Elapsed: %.3f ms", timer->name,
+                       (double)elapsed_ns / 1e6);
+    timer->logger = NULL;
+    return elapsed_ns;
+}
+
+#define LOG_SCOPE_CONCAT_(a, b) a##b
+#define LOG_SCOPE_CONCAT(a, b) LOG_SCOPE_CONCAT_(a, b)
+
+#ifdef __cplusplus
+/**
+ * @brief RAII guard around a scope timer: logs the elapsed time when it goes out of scope.
+ */
+class LogScopeGuard {
+public:
+    LogScopeGuard(struct Logger *logger, enum LogLevel level, const char *name, const char *file, int line,
+                  long threshold_us)
+        : timer(log_scope_begin(logger, level, name, file, line, threshold_us)) {}
+    ~LogScopeGuard() { log_scope_end(&timer); }
+    long long end() { return log_scope_end(&timer); }
+    LogScopeGuard(const LogScopeGuard &) = delete;
+    LogScopeGuard &operator=(const LogScopeGuard &) = delete;
+
+private:
+    struct LogScopeTimer timer;
+};
+
+#define LOG_SCOPE_TIMER_EX(logger, level, name, threshold_us)                                                     \
+    LogScopeGuard LOG_SCOPE_CONCAT(log_scope_timer_, __LINE__)((logger), (level), (name), __FILE__, __LINE__, \
+                                                               (threshold_us))
+#else
+static inline void log_scope_cleanup(struct LogScopeTimer *timer) {
+    log_scope_end(timer);
+}
+
+#define LOG_SCOPE_TIMER_EX(logger, level, name, threshold_us)                                                 \
+    struct LogScopeTimer LOG_SCOPE_CONCAT(log_scope_timer_, __LINE__) __attribute__((cleanup(log_scope_cleanup))) = \
+        log_scope_begin((logger), (level), (name), __FILE__, __LINE__, (threshold_us))
+#endif
+
+/**
+ * Times the rest of the enclosing block and logs "[name] Elapsed: N ms" at DEBUG
+ * when it ends. LOG_SCOPE_TIMER_EX() also takes the level and a threshold in
+ * microseconds below which nothing is logged.
+ */
+#define LOG_SCOPE_TIMER(logger, name) LOG_SCOPE_TIMER_EX((logger), DEBUG, (name), 0)
+
 /**
  * @brief Rotates the log file if it exceeds a specified maximum size.
  * 
@@ -256,20 +5914,44 @@ void log_timestamp(struct Logger *logger, const char *tag) {
  * @param max_size Maximum size of the log file before rotation (in bytes).
  */
 void rotate_log(struct Logger *logger, long max_size) {
+    char new_file_path[strlen(logger->file_path) + 5]; // For ".old" suffix
+    char index_path[strlen(logger->file_path) + 5];    // For ".idx" suffix
+    char new_index_path[sizeof(new_file_path) + 4];    // For ".old.idx" suffix
+    int rotated = 0;
+
+    pthread_mutex_lock(&logger->file_lock);
     if (logger->file) {
+        if (logger->framer)
+            logger_framer_sync(logger->framer);
         fseek(logger->file, 0, SEEK_END);
         long file_size = ftell(logger->file);
         if (file_size >= max_size) {
             fclose(logger->file);
-            char new_file_path[strlen(logger->file_path) + 5]; // For ".old" suffix
             snprintf(new_file_path, sizeof(new_file_path), "%s.old", logger->file_path);
             rename(logger->file_path, new_file_path);
-            logger->file = fopen(logger->file_path, "a");
-            if (!logger->file) {
-                fprintf(stderr, "Error opening log file %s\n", logger->file_path);
-            }
+            logger_open_file(logger);
+            snprintf(index_path, sizeof(index_path), "%s.idx", logger->file_path);
+            snprintf(new_index_path, sizeof(new_index_path), "%s.idx", new_file_path);
+            int indexed = logger->index_file != NULL;
+            logger_close_index(logger);
+            rename(index_path, new_index_path);
+            if (indexed)
+                logger_open_index(logger);
+            rotated = 1;
         }
     }
+    pthread_mutex_unlock(&logger->file_lock);
+
+    // Recompress the finished segment without holding up other logging threads
+    if (rotated && logger->rotate_level > 0) {
+        char compressed_path[sizeof(new_file_path) + 4]; // For ".l4z" suffix
+        snprintf(compressed_path, sizeof(compressed_path), "%s.l4z", new_file_path);
+        if (compress_log_file(new_file_path, compressed_path, logger->rotate_level) == 0) {
+            remove(new_file_path);
+            remove(new_index_path);
+        } else
+            fprintf(stderr, "Error compressing rotated log file %s\n", new_file_path);
+    }
 }
 
 /**
@@ -278,8 +5960,43 @@ void rotate_log(struct Logger *logger, long max_size) {
  * @param logger Pointer to the logger structure.
  */
 void close_logger(struct Logger *logger) {
+    set_realtime_mode(logger, 0, 0);
+    logger_throttle_stop(logger);
+    if (logger->file)
+        logger_drain_deferred(logger, 1);
+    if (logger->framer)
+        logger_framer_stop(logger->framer);
+    if (logger->metrics_path) {
+        // Leave the final counts behind for the last scrape
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        long long now_ms = (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+        __atomic_store_n(&logger->metrics_next_ms, 0, __ATOMIC_RELAXED);
+        if (logger_metrics_due(logger, now_ms))
+            logger_export_metrics(logger, now_ms);
+    }
+    logger_close_index(logger);
     if (logger->file)
         fclose(logger->file);
+    free(logger->deferred);
+    free(logger->strings);
+    free(logger->formats);
+    free(logger->stats);
+    if (logger->rates) {
+        free(logger->rates->words);
+        free(logger->rates);
+    }
+    free(logger->metrics_path);
+    if (logger->metrics_out)
+        fclose(logger->metrics_out);
+    free(logger->metrics_buf);
+    pthread_mutex_destroy(&logger->rt_lock);
+    pthread_cond_destroy(&logger->throttle_wake);
+    pthread_mutex_destroy(&logger->file_lock);
+    if (logger->seq_slots) {
+        pthread_key_delete(logger->seq_key); // Live threads' slots are freed with the rest
+        free(logger->seq_slots);
+    }
     free(logger->file_path);
     free(logger->date_format);
     free(logger->prefix);
@@ -0,0 +1,773 @@
+#define _GNU_SOURCE // open_memstream(), memmem()
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "../include/logger.h"
+
+/*
+ * Prints log files written by the logger, plain or compressed, text or binary.
+ *
+ * Usage: logcat [-l] [-c] [-f] [-j THREADS] [-s START] [-e END] [file...]
+ *
+ * With -s and/or -e only frames whose time range overlaps the window are read and
+ * decompressed, using the side index "<file>.idx" and walking frame headers past
+ * its end. START and END are seconds since the epoch, "YYYY-MM-DD HH:MM[:SS]" in
+ * local time, or relative to now such as -30s, -5m, -2h or -1d. Output is whole
+ * frames, so it may include a few lines on either side of the window.
+ *
+ * Binary records (LOG_FORMAT_BINARY) are recognized by their segment start and
+ * rendered back into the same lines the text format would have written. With -l,
+ * lines logged through LOG_MESSAGE() are preceded by their "file:line: ".
+ *
+ * Standard input is read as a stream: whatever arrives is decoded and printed
+ * at once, so `tail -f app.log | logcat` keeps up with the writer. -f follows
+ * the named files the same way. -c colors each line by its level. -j decodes
+ * the frames of a file on several threads and prints them in order; files with
+ * plain binary records between frames are decoded sequentially, since those
+ * records depend on everything before them.
+ */
+
+struct FrameRef {
+    long long first_ms;
+    long long last_ms;
+    long long offset;
+    size_t frame_len;
+};
+
+struct FrameList {
+    struct FrameRef *items;
+    size_t count;
+    size_t cap;
+};
+
+static void frame_list_add(struct FrameList *list, long long first_ms, long long last_ms, long long offset, size_t frame_len) {
+    if (list->count == list->cap) {
+        list->cap = list->cap ? list->cap * 2 : 1024;
+        list->items = (struct FrameRef *)realloc(list->items, list->cap * sizeof(*list->items));
+        if (!list->items) {
+            fprintf(stderr, "logcat: out of memory\n");
+            exit(1);
+        }
+    }
+    struct FrameRef *ref = &list->items[list->count++];
+    ref->first_ms = first_ms;
+    ref->last_ms = last_ms;
+    ref->offset = offset;
+    ref->frame_len = frame_len;
+}
+
+/**
+ * @brief Log content on its way to stdout: text is copied, binary records are decoded.
+ */
+struct Output {
+    FILE *sink;                   // Where the text goes
+    int binary;                   // Decoding binary records (1) or passing text through (0)
+    int show_location;            // Prefix decoded lines with their source location
+    int color;                    // Color lines by level
+    struct LogBinaryDecoder decoder;
+    unsigned char *pending;       // Start of a record split across reads, or a tail that may start a segment
+    size_t pending_len;
+    size_t pending_cap;
+    char *line;                   // Text line split across reads (color only)
+    size_t line_len;
+    size_t line_cap;
+};
+
+static int show_location; // Set by -l
+static int color;         // Set by -c
+
+static const unsigned char segment_start[] = {LOG_BIN_CONTROL, LOG_BIN_SEGMENT, 'L', '4', 'C', 'B', LOG_BIN_VERSION};
+
+static void *grow(void *p, size_t *cap, size_t need) {
+    if (need <= *cap)
+        return p;
+    *cap = need * 2;
+    p = realloc(p, *cap);
+    if (!p) {
+        fprintf(stderr, "logcat: out of memory\n");
+        exit(1);
+    }
+    return p;
+}
+
+/**
+ * @brief Returns the ANSI color of a line from the level after its first " | ".
+ */
+static const char *level_color(const char *line, size_t len) {
+    const char *bar = (const char *)memmem(line, len, " | ", 3);
+    if (!bar)
+        return NULL;
+    const char *level = bar + 3;
+    size_t left = len - (size_t)(level - line);
+    if (left >= 5 && memcmp(level, "DEBUG", 5) == 0)
+        return "\033[36m";
+    if (left >= 4 && memcmp(level, "INFO", 4) == 0)
+        return "\033[34m";
+    if (left >= 7 && memcmp(level, "SUCCESS", 7) == 0)
+        return "\033[32m";
+    if (left >= 7 && memcmp(level, "WARNING", 7) == 0)
+        return "\033[33m";
+    if (left >= 5 && memcmp(level, "ERROR", 5) == 0)
+        return "\033[31m";
+    return NULL;
+}
+
+/**
+ * @brief Writes one whole line, colored by its level with -c.
+ */
+static void write_line(struct Output *out, const char *line, size_t len) {
+    const char *code = out->color ? level_color(line, len) : NULL;
+    if (!code) {
+        fwrite(line, 1, len, out->sink);
+        return;
+    }
+    size_t body = len > 0 && line[len - 1] == '\n' ? len - 1 : len;
+    fputs(code, out->sink);
+    fwrite(line, 1, body, out->sink);
+    fputs("\033[0m", out->sink);
+    fwrite(line + body, 1, len - body, out->sink);
+}
+
+/**
+ * @brief Writes plain text; with -c it is cut into lines, keeping a partial last line for later.
+ */
+static void write_text(struct Output *out, const char *p, size_t n) {
+    if (!out->color) {
+        fwrite(p, 1, n, out->sink);
+        return;
+    }
+    while (n > 0) {
+        const char *nl = (const char *)memchr(p, '\n', n);
+        size_t len = nl ? (size_t)(nl - p) + 1 : n;
+        if (!nl || out->line_len > 0) {
+            out->line = (char *)grow(out->line, &out->line_cap, out->line_len + len);
+            memcpy(out->line + out->line_len, p, len);
+            out->line_len += len;
+            if (nl) {
+                write_line(out, out->line, out->line_len);
+                out->line_len = 0;
+            }
+        } else {
+            write_line(out, p, len);
+        }
+        p += len;
+        n -= len;
+    }
+}
+
+/**
+ * @brief Returns the length of a tail of p that may be the start of a segment cut off by a read.
+ */
+static size_t segment_tail(const unsigned char *p, size_t n) {
+    size_t from = n > sizeof(segment_start) - 1 ? n - (sizeof(segment_start) - 1) : 0;
+    for (size_t i = from; i < n; i++) {
+        if (p[i] == LOG_BIN_CONTROL && memcmp(p + i, segment_start, n - i) == 0)
+            return n - i;
+    }
+    return 0;
+}
+
+/**
+ * @brief Decodes as many whole binary records as are available, keeping the rest for later.
+ *
+ * @return 0 on success, -1 if a corrupt record was found (the rest of the data is skipped).
+ */
+static int decode_records(struct Output *out, const unsigned char *p, size_t n) {
+    out->pending = (unsigned char *)grow(out->pending, &out->pending_cap, out->pending_len + n);
+    memmove(out->pending + out->pending_len, p, n); // p may be a held-back tail in pending itself
+    out->pending_len += n;
+
+    char line[LOG_MAX_LINE_LENGTH];
+    size_t pos = 0;
+    int status = 0;
+    while (pos < out->pending_len) {
+        size_t used = 0;
+        long len = log_binary_decode(&out->decoder, out->pending + pos, out->pending_len - pos, line, sizeof(line), &used);
+        if (len == -1)
+            break;
+        if (len == -2) {
+            pos = out->pending_len;
+            status = -1;
+            break;
+        }
+        if (len > 0 && out->show_location && out->decoder.last_file[0])
+            fprintf(out->sink, "%s:%d: ", out->decoder.last_file, out->decoder.last_line);
+        write_line(out, line, (size_t)len);
+        pos += used;
+    }
+    memmove(out->pending, out->pending + pos, out->pending_len - pos);
+    out->pending_len -= pos;
+    return status;
+}
+
+/**
+ * @brief Writes one run of log content, switching to binary decoding where a segment starts.
+ *
+ * @param out Output state.
+ * @param p Content.
+ * @param n Length of the content.
+ * @param frame_start The content is a whole frame, which starts fresh if it begins a segment.
+ * @return 0 on success, -1 if a corrupt record was found.
+ */
+static int output_write(struct Output *out, const char *text, size_t n, int frame_start) {
+    const unsigned char *p = (const unsigned char *)text;
+    if (frame_start) {
+        // Every binary frame starts a segment, so any other frame is text
+        if (!out->binary && out->pending_len > 0)
+            write_text(out, (const char *)out->pending, out->pending_len);
+        out->binary = log_binary_is_segment(p, n);
+        out->pending_len = 0;
+    }
+    if (out->binary)
+        return decode_records(out, p, n);
+
+    if (out->pending_len > 0) {
+        // The tail held back last time may start a segment together with this text
+        out->pending = (unsigned char *)grow(out->pending, &out->pending_cap, out->pending_len + n);
+        memcpy(out->pending + out->pending_len, p, n);
+        p = out->pending;
+        n += out->pending_len;
+        out->pending_len = 0;
+    }
+    size_t segment = log_find_segment(p, n);
+    if (segment == n) {
+        size_t keep = frame_start ? 0 : segment_tail(p, n);
+        write_text(out, (const char *)p, n - keep);
+        if (keep > 0) {
+            out->pending = (unsigned char *)grow(out->pending, &out->pending_cap, keep);
+            memmove(out->pending, p + n - keep, keep);
+            out->pending_len = keep;
+        }
+        return 0;
+    }
+    write_text(out, (const char *)p, segment);
+    out->binary = 1;
+    return decode_records(out, p + segment, n - segment);
+}
+
+/**
+ * @brief Writes what is left of the output at the end of its input.
+ *
+ * @return 0 on success, -1 if a binary record was cut off.
+ */
+static int output_finish(struct Output *out) {
+    int status = 0;
+    if (out->binary && out->pending_len > 0)
+        status = -1;
+    else if (out->pending_len > 0)
+        write_text(out, (const char *)out->pending, out->pending_len);
+    if (out->line_len > 0)
+        write_line(out, out->line, out->line_len);
+    out->pending_len = 0;
+    out->line_len = 0;
+    out->binary = 0;
+    return status;
+}
+
+static void output_init(struct Output *out, FILE *sink) {
+    memset(out, 0, sizeof(*out));
+    out->sink = sink;
+    out->show_location = show_location;
+    out->color = color;
+    log_binary_decoder_init(&out->decoder);
+}
+
+static void output_free(struct Output *out) {
+    free(out->pending);
+    free(out->line);
+}
+
+/**
+ * @brief Parses a time argument into milliseconds since the epoch.
+ *
+ * @return 0 on success, -1 if the argument is not understood.
+ */
+static int parse_time(const char *arg, long long *ms) {
+    int year, month, day, hour, minute, second = 0;
+    char unit = 's';
+    long long value;
+    int used = 0;
+
+    if (sscanf(arg, "%d-%d-%d %d:%d:%d", &year, &month, &day, &hour, &minute, &second) >= 5) {
+        struct tm tm;
+        memset(&tm, 0, sizeof(tm));
+        tm.tm_year = year - 1900;
+        tm.tm_mon = month - 1;
+        tm.tm_mday = day;
+        tm.tm_hour = hour;
+        tm.tm_min = minute;
+        tm.tm_sec = second;
+        tm.tm_isdst = -1;
+        *ms = (long long)mktime(&tm) * 1000;
+        return 0;
+    }
+    if (arg[0] == '-' && sscanf(arg + 1, "%lld%c%n", &value, &unit, &used) >= 1) {
+        long long scale = unit == 'd' ? 86400 : unit == 'h' ? 3600 : unit == 'm' ? 60 : 1;
+        *ms = ((long long)time(NULL) - value * scale) * 1000;
+        return 0;
+    }
+    if (sscanf(arg, "%lld", &value) == 1) {
+        *ms = value * 1000;
+        return 0;
+    }
+    return -1;
+}
+
+/**
+ * @brief Writes the text of one log file (plain or compressed frames) to stdout.
+ *
+ * @param in Input stream.
+ * @param name Name of the input for error messages.
+ * @param stream Print input as soon as it arrives (pipes).
+ * @param follow Wait for more input at the end instead of stopping.
+ * @return 0 on success, 1 if a corrupt or truncated frame was found.
+ */
+static int cat_log(FILE *in, const char *name, int stream, int follow) {
+    struct LogReader reader;
+    log_reader_init(&reader, in);
+    reader.stream = stream || follow;
+    reader.follow = follow;
+    struct Output out;
+    output_init(&out, stdout);
+    int status = 0;
+    const char *text;
+    long n;
+    while ((n = log_reader_next(&reader, &text)) != 0) {
+        if (n < 0) {
+            fprintf(stderr, "logcat: %s: corrupt or truncated frame near offset %lld\n",
+                    name, reader.offset + (long long)reader.pos);
+            status = 1;
+            continue;
+        }
+        if (output_write(&out, text, (size_t)n, reader.in_frame) != 0) {
+            fprintf(stderr, "logcat: %s: corrupt binary record before offset %lld\n",
+                    name, reader.offset + (long long)reader.pos);
+            status = 1;
+        }
+        // Raw binary records may contain anything, including what looks like a frame
+        if (out.binary && !reader.in_frame)
+            reader.unframed = 1;
+        if (reader.stream)
+            fflush(stdout);
+    }
+    if (output_finish(&out) != 0) {
+        fprintf(stderr, "logcat: %s: truncated binary record at end of input\n", name);
+        status = 1;
+    }
+    output_free(&out);
+    log_reader_free(&reader);
+    return status;
+}
+
+/**
+ * @brief A piece of a mapped log file that decodes on its own: a whole frame or plain text.
+ */
+struct Unit {
+    size_t offset;
+    size_t len;
+    int frame;              // A frame (1) or plain text between frames (0)
+    int done;               // Decoded and ready to print
+    int status;             // 0, or which error to report
+    char *text;             // Decoded output
+    size_t text_len;
+};
+
+enum UnitError {
+    UNIT_OK,
+    UNIT_CORRUPT_FRAME,
+    UNIT_CORRUPT_RECORD,
+    UNIT_TRUNCATED_RECORD
+};
+
+struct DecodeJob {
+    const unsigned char *base;  // Mapped file
+    struct Unit *units;
+    size_t count;
+    size_t next;                // Next unit to claim
+    size_t printed;             // Units printed so far
+    size_t window;              // Units decoded ahead of printing at most
+    pthread_mutex_t lock;
+    pthread_cond_t changed;     // A unit was decoded or printed
+};
+
+/**
+ * @brief Decodes one unit into a memory buffer with a fresh output state.
+ */
+static void decode_unit(const unsigned char *base, struct Unit *unit, struct Output *out, char **raw, size_t *raw_cap) {
+    FILE *sink = open_memstream(&unit->text, &unit->text_len);
+    if (!sink) {
+        fprintf(stderr, "logcat: out of memory\n");
+        exit(1);
+    }
+    out->sink = sink;
+    out->binary = 0;
+    out->pending_len = 0;
+    out->line_len = 0;
+
+    const unsigned char *p = base + unit->offset;
+    if (unit->frame) {
+        struct LogFrameHeader h;
+        memset(&h, 0, sizeof(h));
+        log_frame_parse_header(p, unit->len, &h); // Already parsed once by the scan
+        *raw = (char *)grow(*raw, raw_cap, h.raw_len ? h.raw_len : 1);
+        if (log_frame_decode(&h, p, *raw) != 0)
+            unit->status = UNIT_CORRUPT_FRAME;
+        else if (output_write(out, *raw, h.raw_len, 1) != 0)
+            unit->status = UNIT_CORRUPT_RECORD;
+    } else if (output_write(out, (const char *)p, unit->len, 0) != 0) {
+        unit->status = UNIT_CORRUPT_RECORD;
+    }
+    if (output_finish(out) != 0 && unit->status == UNIT_OK)
+        unit->status = UNIT_TRUNCATED_RECORD;
+    fclose(sink);
+}
+
+static void *decode_main(void *arg) {
+    struct DecodeJob *job = (struct DecodeJob *)arg;
+    struct Output *out = (struct Output *)malloc(sizeof(*out)); // The decoder is too large for a thread stack
+    char *raw = NULL;
+    size_t raw_cap = 0;
+    if (!out) {
+        fprintf(stderr, "logcat: out of memory\n");
+        exit(1);
+    }
+    output_init(out, NULL);
+
+    pthread_mutex_lock(&job->lock);
+    for (;;) {
+        // Stay within the window so finished output does not pile up ahead of a slow unit
+        while (job->next < job->count && job->next >= job->printed + job->window)
+            pthread_cond_wait(&job->changed, &job->lock);
+        if (job->next >= job->count)
+            break;
+        struct Unit *unit = &job->units[job->next++];
+        pthread_mutex_unlock(&job->lock);
+        decode_unit(job->base, unit, out, &raw, &raw_cap);
+        pthread_mutex_lock(&job->lock);
+        unit->done = 1;
+        pthread_cond_broadcast(&job->changed);
+    }
+    pthread_mutex_unlock(&job->lock);
+    output_free(out);
+    free(out);
+    free(raw);
+    return NULL;
+}
+
+/**
+ * @brief Cuts a mapped file into frames and the plain text between them.
+ *
+ * @return Number of units, or -1 if the file needs sequential decoding (plain
+ * binary records, or a damaged frame that the reader resynchronizes past).
+ */
+static long scan_units(const unsigned char *base, size_t size, struct Unit **units) {
+    size_t count = 0, cap = 0; // cap in bytes
+    for (size_t pos = 0; pos < size;) {
+        struct LogFrameHeader h;
+        int parsed = log_frame_parse_header(base + pos, size - pos, &h);
+        size_t len;
+        int frame = parsed > 0 && h.frame_len <= size - pos;
+        if (frame) {
+            len = h.frame_len;
+        } else if (parsed >= 0 && size - pos >= 4) {
+            return -1;
+        } else {
+            const unsigned char *magic = (const unsigned char *)memmem(base + pos + 1, size - pos - 1, LOG_FRAME_MAGIC, 4);
+            len = (magic ? (size_t)(magic - base) : size) - pos;
+            if (log_find_segment(base + pos, len) < len)
+                return -1;
+        }
+        *units = (struct Unit *)grow(*units, &cap, (count + 1) * sizeof(**units));
+        struct Unit *unit = &(*units)[count++];
+        memset(unit, 0, sizeof(*unit));
+        unit->offset = pos;
+        unit->len = len;
+        unit->frame = frame;
+        pos += len;
+    }
+    return (long)count;
+}
+
+/**
+ * @brief Writes the text of a log file to stdout, decoding its frames on several threads.
+ *
+ * @return 0 on success, 1 if a corrupt frame or record was found, -1 if the file
+ * has to be read sequentially instead.
+ */
+static int cat_parallel(const char *path, int threads) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    size_t size = (size_t)st.st_size;
+    const unsigned char *base = (const unsigned char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+        return -1;
+
+    struct Unit *units = NULL;
+    long count = scan_units(base, size, &units);
+    if (count < 0) {
+        free(units);
+        munmap((void *)base, size);
+        return -1;
+    }
+    madvise((void *)base, size, MADV_SEQUENTIAL);
+
+    struct DecodeJob job;
+    job.base = base;
+    job.units = units;
+    job.count = (size_t)count;
+    job.next = 0;
+    job.printed = 0;
+    job.window = (size_t)threads * 4;
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.changed, NULL);
+    pthread_t tids[threads];
+    int started = 0;
+    for (int i = 0; i < threads; i++) {
+        if (pthread_create(&tids[i], NULL, decode_main, &job) == 0)
+            started++;
+    }
+    if (started == 0) {
+        job.window = job.count + 1; // Decode everything here, then print it
+        decode_main(&job);
+    }
+    int status = 0;
+    for (size_t i = 0; i < job.count; i++) {
+        struct Unit *unit = &units[i];
+        pthread_mutex_lock(&job.lock);
+        while (!unit->done)
+            pthread_cond_wait(&job.changed, &job.lock);
+        pthread_mutex_unlock(&job.lock);
+
+        fwrite(unit->text, 1, unit->text_len, stdout);
+        free(unit->text);
+        if (unit->status != UNIT_OK) {
+            fprintf(stderr, "logcat: %s: %s at offset %zu\n", path,
+                    unit->status == UNIT_CORRUPT_FRAME    ? "corrupt frame"
+                    : unit->status == UNIT_CORRUPT_RECORD ? "corrupt binary record in the run"
+                                                          : "truncated binary record in the run",
+                    unit->offset);
+            status = 1;
+        }
+
+        pthread_mutex_lock(&job.lock);
+        job.printed++;
+        pthread_cond_broadcast(&job.changed);
+        pthread_mutex_unlock(&job.lock);
+    }
+    for (int i = 0; i < started; i++)
+        pthread_join(tids[i], NULL);
+
+    pthread_mutex_destroy(&job.lock);
+    pthread_cond_destroy(&job.changed);
+    free(units);
+    munmap((void *)base, size);
+    return status;
+}
+
+/**
+ * @brief Loads the side index of a log file, keeping entries that lie within the file.
+ *
+ * @return File offset just past the last indexed frame (0 without an index).
+ */
+static long long load_index(const char *path, long long file_size, struct FrameList *frames) {
+    char index_path[strlen(path) + 5];
+    snprintf(index_path, sizeof(index_path), "%s.idx", path);
+    FILE *index = fopen(index_path, "rb");
+    if (!index)
+        return 0;
+
+    long long end = 0;
+    unsigned char entry[LOG_INDEX_ENTRY_SIZE];
+    while (fread(entry, 1, sizeof(entry), index) == sizeof(entry)) {
+        long long offset = (long long)log_get_le64(entry + 16);
+        size_t frame_len = log_get_le32(entry + 24);
+        if (offset < end || offset + (long long)frame_len > file_size)
+            break; // Index from an older file, or ahead of a truncated one
+        frame_list_add(frames, (long long)log_get_le64(entry), (long long)log_get_le64(entry + 8), offset, frame_len);
+        end = offset + (long long)frame_len;
+    }
+    fclose(index);
+    return end;
+}
+
+/**
+ * @brief Walks frame headers from pos to the end of the file, collecting timed frames.
+ *
+ * Plain text between frames is skipped by scanning for the next frame magic.
+ */
+static void walk_frames(FILE *in, long long pos, long long file_size, struct FrameList *frames) {
+    unsigned char buf[65536];
+
+    while (pos < file_size) {
+        fseeko(in, (off_t)pos, SEEK_SET);
+        size_t got = fread(buf, 1, sizeof(buf), in);
+        struct LogFrameHeader h;
+        int parsed = log_frame_parse_header(buf, got, &h);
+        if (parsed > 0) {
+            size_t frame_len = h.frame_len;
+            if (pos + (long long)frame_len > file_size)
+                return; // Truncated last frame
+            if (h.flags & LOG_FRAME_TIMED)
+                frame_list_add(frames, h.first_ms, h.last_ms, pos, frame_len);
+            pos += (long long)frame_len;
+            continue;
+        }
+        if (parsed == 0)
+            return;
+
+        // Not a frame: skip to the next magic, keeping 3 bytes in case it straddles reads
+        size_t i = 1;
+        while (i + 4 <= got && memcmp(buf + i, LOG_FRAME_MAGIC, 4) != 0)
+            i++;
+        if (i + 4 > got && got < 4)
+            return;
+        pos += (long long)(i + 4 <= got ? i : got - 3);
+    }
+}
+
+/**
+ * @brief Prints the frames of a log file that overlap [start_ms, end_ms].
+ *
+ * @return 0 on success, 1 on error.
+ */
+static int query_log(const char *path, long long start_ms, long long end_ms) {
+    FILE *in = fopen(path, "rb");
+    if (!in) {
+        fprintf(stderr, "logcat: cannot open %s\n", path);
+        return 1;
+    }
+    fseeko(in, 0, SEEK_END);
+    long long file_size = (long long)ftello(in);
+
+    struct FrameList frames = {NULL, 0, 0};
+    long long indexed_end = load_index(path, file_size, &frames);
+    walk_frames(in, indexed_end, file_size, &frames);
+
+    int status = 0;
+    unsigned char *frame = NULL;
+    char *text = NULL;
+    struct Output out;
+    output_init(&out, stdout);
+    for (size_t i = 0; i < frames.count; i++) {
+        struct FrameRef *ref = &frames.items[i];
+        if (ref->first_ms > end_ms || ref->last_ms < start_ms)
+            continue;
+        struct LogFrameHeader h;
+        frame = (unsigned char *)realloc(frame, ref->frame_len);
+        fseeko(in, (off_t)ref->offset, SEEK_SET);
+        if (!frame || fread(frame, 1, ref->frame_len, in) != ref->frame_len ||
+            log_frame_parse_header(frame, ref->frame_len, &h) != 1 ||
+            h.frame_len != ref->frame_len) {
+            fprintf(stderr, "logcat: %s: bad frame at offset %lld\n", path, ref->offset);
+            status = 1;
+            continue;
+        }
+        text = (char *)realloc(text, h.raw_len ? h.raw_len : 1);
+        if (!text || log_frame_decode(&h, frame, text) != 0) {
+            fprintf(stderr, "logcat: %s: corrupt frame at offset %lld\n", path, ref->offset);
+            status = 1;
+            continue;
+        }
+        if (output_write(&out, text, h.raw_len, 1) != 0) {
+            fprintf(stderr, "logcat: %s: corrupt binary record in frame at offset %lld\n", path, ref->offset);
+            status = 1;
+        }
+    }
+
+    output_finish(&out);
+    output_free(&out);
+    free(frame);
+    free(text);
+    free(frames.items);
+    fclose(in);
+    return status;
+}
+
+static void usage(void) {
+    fprintf(stderr, "usage: logcat [-l] [-c] [-f] [-j THREADS] [-s START] [-e END] [file...]\n");
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    long long start_ms = 0;
+    long long end_ms = 0x7FFFFFFFFFFFFFFFLL;
+    int windowed = 0;
+    int follow = 0;
+    int threads = 1;
+    int status = 0;
+    int i = 1;
+
+    for (; i < argc && argv[i][0] == '-' && argv[i][1] != '\0'; i++) {
+        if (strcmp(argv[i], "--") == 0) {
+            i++;
+            break;
+        }
+        if (strcmp(argv[i], "-l") == 0) {
+            show_location = 1;
+            continue;
+        }
+        if (strcmp(argv[i], "-c") == 0) {
+            color = 1;
+            continue;
+        }
+        if (strcmp(argv[i], "-f") == 0) {
+            follow = 1;
+            continue;
+        }
+        if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+            if (threads < 1)
+                threads = 1;
+            continue;
+        }
+        if ((strcmp(argv[i], "-s") != 0 && strcmp(argv[i], "-e") != 0) || i + 1 >= argc)
+            usage();
+        if (parse_time(argv[i + 1], argv[i][1] == 's' ? &start_ms : &end_ms) != 0) {
+            fprintf(stderr, "logcat: bad time %s\n", argv[i + 1]);
+            return 2;
+        }
+        windowed = 1;
+        i++;
+    }
+
+    if (i >= argc) {
+        if (windowed) {
+            fprintf(stderr, "logcat: -s/-e need a file to seek in\n");
+            return 2;
+        }
+        return cat_log(stdin, "<stdin>", 1, 0);
+    }
+
+    for (; i < argc; i++) {
+        if (windowed) {
+            status |= query_log(argv[i], start_ms, end_ms);
+            continue;
+        }
+        if (strcmp(argv[i], "-") == 0) {
+            status |= cat_log(stdin, "<stdin>", 1, 0);
+            continue;
+        }
+        if (threads > 1 && !follow) {
+            int result = cat_parallel(argv[i], threads);
+            if (result >= 0) {
+                status |= result;
+                continue;
+            }
+        }
+        FILE *in = fopen(argv[i], "rb");
+        if (!in) {
+            fprintf(stderr, "logcat: cannot open %s\n", argv[i]);
+            status = 1;
+            continue;
+        }
+        status |= cat_log(in, argv[i], 0, follow);
+        fclose(in);
+    }
+    return status;
+}